@@ -1,4 +1,6 @@
+import csv
 import random
+import sys
 import matplotlib.pyplot as plt
 import numpy as np
 
@@ -6,17 +8,25 @@ asize = 1024
 psize = 16 * 1024
 u_list = [0] * psize
 
-for i in range(300):
-    random.seed(i)
-    for j in range(psize):
-        limit = j
-        va = int(asize * random.random())
-        if va < limit:
-            u_list[j] += 1
+if len(sys.argv) > 1:
+    # Plot a sweep written by relocation_sim instead of simulating here
+    with open(sys.argv[1]) as f:
+        rows = list(csv.DictReader(f))
+    x = [int(r["limit"]) for r in rows]
+    y = [float(r["valid_fraction"]) for r in rows]
+else:
+    for i in range(300):
+        random.seed(i)
+        for j in range(psize):
+            limit = j
+            va = int(asize * random.random())
+            if va < limit:
+                u_list[j] += 1
+    x = np.linspace(1, psize, psize)
+    y = [u / 300 for u in u_list]
 
 fig = plt.figure()
-x = np.linspace(1, psize, psize)
-plt.plot(x, [u / 300 for u in u_list], color="blue")
+plt.plot(x, y, color="blue")
 plt.ylim(0, 1)
 plt.margins(0)
 plt.xlabel("Limit")
@@ -0,0 +1,408 @@
+// Valid-fraction sweep for base-and-bounds, segmentation and multi-level
+// paging (native version of graph.py).
+//
+// For every limit point and every seed one virtual address is drawn
+// uniformly from the address space and translated; the output is the
+// average fraction of valid translations per limit, as CSV.
+//
+//   g++ -O3 -march=native -std=c++17 -pthread relocation_sim.cpp -o relocation_sim
+//   ./relocation_sim --model bounds --asize 1K --psize 16K --seeds 300 > valid.csv
+//   ./relocation_sim --model paging --asize 2^48 --points 4096 --seeds 1000
+//   python3 graph.py valid.csv
+//
+// Sizes take K/M/G/T/P/E suffixes or 2^N (up to 2^64).
+
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+enum class Model { BOUNDS, SEGMENTATION, PAGING };
+
+struct Config {
+  Model model = Model::BOUNDS;
+  int asize_bits = 10;            // -1 when the address space is not a power of two
+  uint64_t asize = 1024;          // unused when asize_bits == 64
+  uint64_t psize = 16 * 1024;     // largest limit swept
+  uint64_t points = 0;            // 0 = one point per limit value, like graph.py
+  uint64_t seeds = 300;
+  int page_bits = 12;
+  unsigned threads = 0;           // 0 = hardware concurrency
+};
+
+// Points handled together; fixes the RNG streams so results do not depend
+// on the number of threads
+const uint64_t CHUNK_POINTS = 4096;
+const int LANES = 4;
+// Table nodes are a page of 8-byte entries, so the page size also bounds
+// the memory a table level takes: 16 MB pages, 2M-entry nodes
+const int MAX_PAGE_BITS = 24;
+
+// ---- PRNG ----
+
+static inline uint64_t rotl(uint64_t x, int k) {
+  return (x << k) | (x >> (64 - k));
+}
+
+static inline uint64_t splitmix64(uint64_t &state) {
+  uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  return z ^ (z >> 31);
+}
+
+// Four interleaved xoshiro256** generators. Each lane is an independent
+// stream, and the lane loops have no cross-lane dependencies, so the
+// compiler can keep all four in one vector register.
+class Xoshiro256x4 {
+private:
+  uint64_t s[4][LANES];
+
+public:
+  Xoshiro256x4(uint64_t seed) {
+    uint64_t sm = seed;
+    for (int i = 0; i < 4; ++i) {
+      for (int l = 0; l < LANES; ++l) {
+        s[i][l] = splitmix64(sm);
+      }
+    }
+  }
+
+  void next(uint64_t out[LANES]) {
+    for (int l = 0; l < LANES; ++l) {
+      uint64_t x = s[1][l] + (s[1][l] << 2);       // * 5
+      x = rotl(x, 7);
+      out[l] = x + (x << 3);                        // * 9
+      uint64_t t = s[1][l] << 17;
+      s[2][l] ^= s[0][l];
+      s[3][l] ^= s[1][l];
+      s[1][l] ^= s[2][l];
+      s[0][l] ^= s[3][l];
+      s[2][l] ^= t;
+      s[3][l] = rotl(s[3][l], 45);
+    }
+  }
+};
+
+// Map 64 random bits to [0, asize)
+static inline uint64_t scale_to_asize(uint64_t r, const Config &cfg) {
+  if (cfg.asize_bits == 64) {
+    return r;
+  }
+  if (cfg.asize_bits >= 0) {
+    return r >> (63 - cfg.asize_bits) >> 1;       // two shifts: asize_bits may be 0
+  }
+  return (uint64_t)(((unsigned __int128)r * cfg.asize) >> 64);
+}
+
+// ---- multi-level page table ----
+
+// Radix page table over an address space of `va_bits`. Entries are either
+// empty, a leaf (a page or, at upper levels, a huge page covering the whole
+// entry) or the index of a next-level node.
+class PageTable {
+private:
+  static constexpr uint64_t EMPTY = 0;
+  static constexpr uint64_t LEAF = 1;
+  int va_bits;
+  int page_bits;
+  int bits_per_level;
+  int levels;
+  int root_bits;
+  std::vector<std::vector<uint64_t>> nodes;
+
+  int level_shift(int level) const {
+    return page_bits + (levels - 1 - level) * bits_per_level;
+  }
+
+  int level_bits(int level) const {
+    return level == 0 ? root_bits : bits_per_level;
+  }
+
+  // Map [0, end) below `node`; `end` is relative to the start of the node
+  void map_prefix(size_t node, int level, uint64_t end) {
+    int shift = level_shift(level);
+    uint64_t full = end >> shift;                   // entries entirely mapped
+    for (uint64_t i = 0; i < full; ++i) {
+      nodes[node][i] = LEAF;
+    }
+    uint64_t rest = end - (full << shift);
+    if (rest && level + 1 < levels) {
+      size_t child = nodes.size();
+      nodes.emplace_back((size_t)1 << level_bits(level + 1), EMPTY);
+      nodes[node][full] = (child << 1);
+      map_prefix(child, level + 1, rest);
+    }
+  }
+
+public:
+  PageTable(int va_bits, int page_bits) : va_bits(va_bits), page_bits(page_bits) {
+    bits_per_level = page_bits - 3;                 // 8-byte entries per page
+    int index_bits = std::max(va_bits - page_bits, 1);
+    levels = (index_bits + bits_per_level - 1) / bits_per_level;
+    root_bits = index_bits - (levels - 1) * bits_per_level;
+  }
+
+  int num_levels() const { return levels; }
+
+  // Map the first `limit` bytes (rounded down to whole pages)
+  void map(uint64_t limit) {
+    if (va_bits < 64 && limit > ((uint64_t)1 << va_bits)) {
+      limit = (uint64_t)1 << va_bits;
+    }
+    nodes.clear();
+    nodes.emplace_back((size_t)1 << root_bits, EMPTY);
+    map_prefix(0, 0, limit & ~(((uint64_t)1 << page_bits) - 1));
+  }
+
+  // Returns the number of levels touched; *valid tells if va is mapped
+  int walk(uint64_t va, bool *valid) const {
+    size_t node = 0;
+    for (int level = 0; level < levels; ++level) {
+      uint64_t mask = ((uint64_t)1 << level_bits(level)) - 1;
+      uint64_t e = nodes[node][(va >> level_shift(level)) & mask];
+      if (e == EMPTY || e == LEAF) {
+        *valid = e == LEAF;
+        return level + 1;
+      }
+      node = e >> 1;
+    }
+    *valid = false;
+    return levels;
+  }
+};
+
+// ---- sweep ----
+
+// Address bits the page table has to cover
+int va_bits(const Config &cfg) {
+  if (cfg.asize_bits >= 0) {
+    return cfg.asize_bits;
+  }
+  return cfg.asize > 1 ? 64 - __builtin_clzll(cfg.asize - 1) : 0;
+}
+
+uint64_t limit_at(const Config &cfg, uint64_t j) {
+  if (cfg.points == 0) {
+    return j;
+  }
+  return (uint64_t)(((unsigned __int128)cfg.psize * j) / cfg.points);
+}
+
+uint64_t num_points(const Config &cfg) {
+  return cfg.points ? cfg.points : cfg.psize;
+}
+
+// Segmentation as in OSTEP segmentation.py: the top address bit picks the
+// segment, segment 0 grows up from 0 and segment 1 grows down from the top,
+// each with the swept limit
+static inline bool segment_valid(uint64_t va, uint64_t limit, const Config &cfg) {
+  uint64_t half;
+  if (cfg.asize_bits == 64) {
+    half = (uint64_t)1 << 63;
+  } else {
+    half = cfg.asize / 2;
+  }
+  if (va < half) {
+    return va < limit;
+  }
+  uint64_t seg_size = cfg.asize_bits == 64 ? half : cfg.asize - half;
+  uint64_t from_top = seg_size - (va - half);       // 1 for the last byte
+  return from_top <= limit;
+}
+
+void sweep_chunk(const Config &cfg, uint64_t chunk, std::vector<uint64_t> &valid,
+                 std::vector<uint64_t> &walk_levels) {
+  uint64_t p0 = chunk * CHUNK_POINTS;
+  uint64_t p1 = std::min(p0 + CHUNK_POINTS, num_points(cfg));
+  uint64_t n = p1 - p0;
+
+  std::vector<uint64_t> limits(n), counts(n, 0), va(n + LANES);
+  for (uint64_t j = 0; j < n; ++j) {
+    limits[j] = limit_at(cfg, p0 + j);
+  }
+
+  if (cfg.model == Model::PAGING) {
+    PageTable pt(va_bits(cfg), cfg.page_bits);
+    uint64_t levels = 0;
+    for (uint64_t j = 0; j < n; ++j) {
+      pt.map(limits[j]);
+      Xoshiro256x4 rng(p0 + j);
+      uint64_t r[LANES];
+      for (uint64_t s = 0; s < cfg.seeds; ++s) {
+        if (s % LANES == 0) {
+          rng.next(r);
+        }
+        bool ok;
+        levels += pt.walk(scale_to_asize(r[s % LANES], cfg), &ok);
+        counts[j] += ok;
+      }
+      walk_levels[p0 + j] = levels;
+      levels = 0;
+    }
+  } else {
+    // One stream per (seed, chunk); a batch of VAs, then a branch-free
+    // compare over the whole batch
+    for (uint64_t s = 0; s < cfg.seeds; ++s) {
+      Xoshiro256x4 rng(s * 0x100000001B3ULL + chunk);
+      for (uint64_t j = 0; j < n; j += LANES) {
+        rng.next(&va[j]);
+      }
+      for (uint64_t j = 0; j < n; ++j) {
+        va[j] = scale_to_asize(va[j], cfg);
+      }
+      if (cfg.model == Model::BOUNDS) {
+        for (uint64_t j = 0; j < n; ++j) {
+          counts[j] += va[j] < limits[j];
+        }
+      } else {
+        for (uint64_t j = 0; j < n; ++j) {
+          counts[j] += segment_valid(va[j], limits[j], cfg);
+        }
+      }
+    }
+  }
+  std::copy(counts.begin(), counts.end(), valid.begin() + p0);
+}
+
+void run_sweep(const Config &cfg) {
+  uint64_t points = num_points(cfg);
+  uint64_t chunks = (points + CHUNK_POINTS - 1) / CHUNK_POINTS;
+  std::vector<uint64_t> valid(points), walk_levels(points, 0);
+
+  unsigned nthreads = cfg.threads ? cfg.threads : std::max(1u, std::thread::hardware_concurrency());
+  std::vector<std::thread> workers;
+  for (unsigned t = 0; t < nthreads; ++t) {
+    workers.emplace_back([&, t]() {
+      for (uint64_t c = t; c < chunks; c += nthreads) {
+        sweep_chunk(cfg, c, valid, walk_levels);
+      }
+    });
+  }
+  for (auto &w : workers) {
+    w.join();
+  }
+
+  bool paging = cfg.model == Model::PAGING;
+  std::printf(paging ? "limit,valid_fraction,avg_walk_levels\n" : "limit,valid_fraction\n");
+  for (uint64_t j = 0; j < points; ++j) {
+    std::printf("%llu,%.6f", (unsigned long long)limit_at(cfg, j), (double)valid[j] / cfg.seeds);
+    if (paging) {
+      std::printf(",%.4f", (double)walk_levels[j] / cfg.seeds);
+    }
+    std::printf("\n");
+  }
+}
+
+// ---- command line ----
+
+// Parses 1024, 16K, 4G, 2^48 ... Returns the exponent in *bits when the
+// size is a power of two (64 for 2^64, which does not fit in the result).
+uint64_t parse_size(const std::string &s, int *bits) {
+  uint64_t value;
+  if (s.rfind("2^", 0) == 0) {
+    int n = std::atoi(s.c_str() + 2);
+    if (n < 1 || n > 64) {
+      std::cerr << "size out of range: " << s << std::endl;
+      std::exit(1);
+    }
+    value = n == 64 ? 0 : (uint64_t)1 << n;
+  } else {
+    char *end;
+    value = std::strtoull(s.c_str(), &end, 10);
+    const char *suffixes = "KMGTPE";
+    const char *p = *end ? std::strchr(suffixes, std::toupper(*end)) : nullptr;
+    if (p) {
+      value <<= 10 * (p - suffixes + 1);
+    }
+  }
+  if (bits) {
+    *bits = value == 0 ? 64 : (value & (value - 1)) == 0 ? __builtin_ctzll(value) : -1;
+  }
+  return value;
+}
+
+void usage(const char *prog) {
+  std::cerr << "usage: " << prog << " [--model bounds|segmentation|paging] [--asize N]"
+            << " [--psize N] [--points N] [--seeds N] [--page N] [--threads N]" << std::endl;
+  std::exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  Config cfg;
+  bool psize_given = false, page_given = false;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (i + 1 >= argc) {
+      usage(argv[0]);
+    }
+    std::string val = argv[++i];
+    if (arg == "--model") {
+      if (val == "bounds") cfg.model = Model::BOUNDS;
+      else if (val == "segmentation") cfg.model = Model::SEGMENTATION;
+      else if (val == "paging") cfg.model = Model::PAGING;
+      else usage(argv[0]);
+    } else if (arg == "--asize") {
+      cfg.asize = parse_size(val, &cfg.asize_bits);
+    } else if (arg == "--psize") {
+      int bits;
+      cfg.psize = parse_size(val, &bits);
+      if (bits == 64) cfg.psize = UINT64_MAX;
+      psize_given = true;
+    } else if (arg == "--points") {
+      cfg.points = parse_size(val, nullptr);
+    } else if (arg == "--seeds") {
+      cfg.seeds = parse_size(val, nullptr);
+    } else if (arg == "--page") {
+      parse_size(val, &cfg.page_bits);
+      if (cfg.page_bits < 4 || cfg.page_bits > MAX_PAGE_BITS) {
+        std::cerr << "--page must be a power of two from 16 to " << (1 << MAX_PAGE_BITS)
+                  << " bytes" << std::endl;
+        std::exit(1);
+      }
+      page_given = true;
+    } else if (arg == "--threads") {
+      cfg.threads = (unsigned)std::atoi(val.c_str());
+    } else {
+      usage(argv[0]);
+    }
+  }
+
+  // Like graph.py, sweep limits up to 16x the address space by default
+  if (!psize_given) {
+    bool overflow = cfg.asize_bits >= 60 || cfg.asize > UINT64_MAX / 16;
+    cfg.psize = overflow ? UINT64_MAX : 16 * cfg.asize;
+  }
+  // One point per limit only makes sense for small sweeps
+  if (cfg.points == 0 && cfg.psize > ((uint64_t)1 << 24)) {
+    cfg.points = 1 << 14;
+  }
+  if (cfg.seeds == 0 || (cfg.asize == 0 && cfg.asize_bits != 64)) {
+    usage(argv[0]);
+  }
+
+  // Pages larger than the address space would never be mapped, and every
+  // valid fraction would silently come out 0. Shrink the default page so
+  // the space holds 16 of them (or as many 16-byte pages as fit); an
+  // explicit --page that does not fit is an error.
+  uint64_t page = (uint64_t)1 << cfg.page_bits;
+  if (cfg.model == Model::PAGING && cfg.asize_bits != 64 && cfg.asize < page) {
+    if (page_given || cfg.asize < 16) {
+      std::cerr << "page size " << page << " is larger than the address space ("
+                << cfg.asize << " bytes)" << std::endl;
+      std::exit(1);
+    }
+    cfg.page_bits = std::max(4, 63 - __builtin_clzll(cfg.asize) - 4);
+    std::cerr << "note: page size reduced to " << ((uint64_t)1 << cfg.page_bits)
+              << " bytes to fit the address space" << std::endl;
+  }
+
+  run_sweep(cfg);
+  return 0;
+}
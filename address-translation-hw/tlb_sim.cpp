@@ -0,0 +1,783 @@
+// Trace-driven TLB and page-table-walk simulator.
+//
+// Replays memory access traces through a hierarchy of set-associative TLBs
+// and, on a miss, a multi-level page table walk with a small paging-structure
+// cache. Traces are memory-mapped and decoded in batches.
+//
+// Trace formats:
+//   lackey   valgrind --tool=lackey --trace-mem=yes output ("I  0400d7d4,8")
+//   binary   TraceHeader followed by packed TraceRecords (see below); use
+//            --convert to turn a lackey trace into one
+//
+//   g++ -O3 -march=native -std=c++17 tlb_sim.cpp -o tlb_sim
+//   valgrind --tool=lackey --trace-mem=yes --log-file=ls.trace ls
+//   ./tlb_sim ls.trace
+//   ./tlb_sim --tlb 64:4 --tlb 2048:16 --policy clock --map 0x4000000-0x8000000:2M a.trace b.trace
+//
+// Several traces run interleaved, each in its own address space (ASID),
+// switching every --quantum accesses. With --no-pcid every switch flushes
+// the TLBs and the paging-structure cache, as on hardware without PCID/ASID
+// tags.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+const size_t BATCH = 4096;
+const int PT_BITS_PER_LEVEL = 9;
+const char TRACE_MAGIC[8] = { 'T', 'L', 'B', 'T', 'R', 'A', 'C', 'E' };
+
+enum class Policy { LRU, CLOCK, RANDOM };
+
+enum AccessType : uint8_t { INSTR = 0, LOAD = 1, STORE = 2, MODIFY = 3 };
+
+struct TraceHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t record_size;
+};
+
+struct TraceRecord {
+  uint64_t va;
+  uint32_t asid;
+  uint8_t type;
+  uint8_t size;
+  uint16_t reserved;
+};
+
+// ASIDs are 64 bits here so that a trace's own 32-bit ASIDs can be offset
+// per file without wrapping
+struct Access {
+  uint64_t va;
+  uint64_t asid;
+};
+
+// ---- trace input ----
+
+// Hex digit values, -1 for anything else: one load per character
+struct HexTable {
+  int8_t value[256];
+  constexpr HexTable() : value() {
+    for (int c = 0; c < 256; ++c) {
+      value[c] = c >= '0' && c <= '9' ? c - '0'
+               : c >= 'a' && c <= 'f' ? c - 'a' + 10
+               : c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+    }
+  }
+};
+constexpr HexTable HEX;
+
+class TraceReader {
+private:
+  const char *data = nullptr;
+  size_t length = 0;
+  size_t pos = 0;
+  bool binary = false;
+  uint64_t asid;
+
+  void skip_line() {
+    const void *nl = std::memchr(data + pos, '\n', length - pos);
+    pos = nl ? (const char *)nl - data + 1 : length;
+  }
+
+  // Lackey lines: "I  addr,size", " L addr,size", " S ...", " M ...";
+  // anything else (valgrind's "==pid==" chatter) is skipped
+  bool next_lackey(Access &a, uint8_t &type, uint8_t &size) {
+    while (pos < length) {
+      if (length - pos < 4) {
+        pos = length;
+        break;
+      }
+      const char *p = data + pos;
+      char kind = p[0] == ' ' ? p[1] : p[0];
+      bool access = kind == 'I' || kind == 'L' || kind == 'S' || kind == 'M';
+      if ((p[0] != 'I' && p[0] != ' ') || !access) {
+        skip_line();
+        continue;
+      }
+      size_t i = pos + 2;
+      while (i < length && data[i] == ' ') ++i;
+      uint64_t va = 0;
+      int h;
+      while (i < length && (h = HEX.value[(unsigned char)data[i]]) >= 0) {
+        va = (va << 4) | (uint64_t)h;
+        ++i;
+      }
+      unsigned sz = 0;
+      if (i < length && data[i] == ',') {
+        for (++i; i < length && data[i] >= '0' && data[i] <= '9'; ++i) {
+          sz = sz * 10 + (data[i] - '0');
+        }
+      }
+      // Lines normally end right after the size; search only if not
+      if (i < length && data[i] == '\n') {
+        pos = i + 1;
+      } else {
+        pos = i;
+        skip_line();
+      }
+      a.va = va;
+      a.asid = asid;
+      type = kind == 'I' ? INSTR : kind == 'L' ? LOAD : kind == 'S' ? STORE : MODIFY;
+      size = (uint8_t)std::min(sz, 255u);
+      return true;
+    }
+    return false;
+  }
+
+public:
+  TraceReader(const std::string &path, uint64_t asid) : asid(asid) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      perror(path.c_str());
+      std::exit(1);
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+      perror("fstat");
+      std::exit(1);
+    }
+    length = (size_t)st.st_size;
+    if (length > 0) {
+      void *m = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (m == MAP_FAILED) {
+        perror("mmap");
+        std::exit(1);
+      }
+      madvise(m, length, MADV_SEQUENTIAL);
+      data = (const char *)m;
+    }
+    close(fd);
+
+    if (length >= sizeof(TraceHeader) && std::memcmp(data, TRACE_MAGIC, sizeof(TRACE_MAGIC)) == 0) {
+      const TraceHeader *h = (const TraceHeader *)data;
+      if (h->version != 1 || h->record_size != sizeof(TraceRecord)) {
+        std::cerr << path << ": unsupported trace version" << std::endl;
+        std::exit(1);
+      }
+      binary = true;
+      pos = sizeof(TraceHeader);
+    }
+  }
+
+  ~TraceReader() {
+    if (data) munmap((void *)data, length);
+  }
+
+  bool done() const {
+    return binary ? pos + sizeof(TraceRecord) > length : pos >= length;
+  }
+
+  // ASID of this trace; binary records keep their own ASIDs, offset by
+  // this one so separate files never collide
+  uint64_t asid_base() const { return asid; }
+
+  // Binary traces: up to `max` records straight from the mapping, no copy
+  const TraceRecord *next_records(size_t max, size_t *n) {
+    const TraceRecord *r = (const TraceRecord *)(data + pos);
+    *n = std::min((length - pos) / sizeof(TraceRecord), max);
+    pos += *n * sizeof(TraceRecord);
+    return r;
+  }
+
+  // Decode up to `max` accesses
+  size_t next_batch(Access *out, size_t max) {
+    size_t n = 0;
+    if (binary) {
+      const TraceRecord *r = next_records(max, &n);
+      for (size_t i = 0; i < n; ++i) {
+        out[i].va = r[i].va;
+        out[i].asid = r[i].asid + asid;
+      }
+      return n;
+    }
+    uint8_t type, size;
+    while (n < max && next_lackey(out[n], type, size)) {
+      ++n;
+    }
+    return n;
+  }
+
+  // Rewrite a lackey trace in the binary format
+  void convert(const std::string &out_path) {
+    FILE *out = std::fopen(out_path.c_str(), "wb");
+    if (!out) {
+      perror(out_path.c_str());
+      std::exit(1);
+    }
+    TraceHeader h;
+    std::memcpy(h.magic, TRACE_MAGIC, sizeof(h.magic));
+    h.version = 1;
+    h.record_size = sizeof(TraceRecord);
+    std::fwrite(&h, sizeof(h), 1, out);
+
+    std::vector<TraceRecord> buf;
+    buf.reserve(BATCH);
+    Access a;
+    uint8_t type, size;
+    while (next_lackey(a, type, size)) {
+      buf.push_back(TraceRecord{ a.va, 0, type, size, 0 });
+      if (buf.size() == BATCH) {
+        std::fwrite(buf.data(), sizeof(TraceRecord), buf.size(), out);
+        buf.clear();
+      }
+    }
+    std::fwrite(buf.data(), sizeof(TraceRecord), buf.size(), out);
+    std::fclose(out);
+  }
+
+  bool is_binary() const { return binary; }
+};
+
+// ---- TLB ----
+
+// Set-associative TLB. Entries are tagged with the virtual page number, the
+// page size and the ASID. Tags are 64 bits so that no ASID aliases another.
+class Tlb {
+private:
+  static constexpr uint64_t INVALID = ~0ULL;
+  size_t sets;
+  size_t ways;
+  Policy policy;
+  std::vector<uint64_t> vpns;
+  std::vector<uint64_t> tags;       // asid << 8 | page shift
+  std::vector<uint64_t> stamps;     // LRU: last use; CLOCK: reference bit
+  std::vector<uint32_t> hands;      // CLOCK hand per set
+  size_t last = 0;                  // entry of the last hit or insert
+  uint64_t now = 0;
+  uint64_t rng = 0x9E3779B97F4A7C15ULL;
+
+  size_t set_of(uint64_t vpn, uint64_t tag) const {
+    return (size_t)((vpn ^ (vpn >> 17) ^ tag) & (sets - 1));
+  }
+
+  // Branch-free where it can be: victims are picked on every miss, and on
+  // walk-heavy traces that is most accesses
+  size_t victim(size_t base) {
+    if (policy == Policy::LRU) {
+      // Invalid entries keep stamp 0, so the oldest stamp covers them too
+      size_t v = 0;
+      uint64_t oldest = stamps[base];
+      for (size_t w = 1; w < ways; ++w) {
+        bool older = stamps[base + w] < oldest;
+        v = older ? w : v;
+        oldest = older ? stamps[base + w] : oldest;
+      }
+      return v;
+    }
+    for (size_t w = 0; w < ways; ++w) {
+      if (vpns[base + w] == INVALID) return w;
+    }
+    if (policy == Policy::CLOCK) {
+      uint32_t &hand = hands[base / ways];
+      while (stamps[base + hand]) {
+        stamps[base + hand] = 0;
+        hand = hand + 1 == ways ? 0 : hand + 1;
+      }
+      size_t v = hand;
+      hand = hand + 1 == ways ? 0 : hand + 1;
+      return v;
+    }
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return (size_t)(((unsigned __int128)rng * ways) >> 64);
+  }
+
+public:
+  std::string name;
+  uint64_t hits = 0;
+  uint64_t misses = 0;
+
+  Tlb(const std::string &name, size_t entries, size_t ways, Policy policy)
+      : ways(ways), policy(policy), name(name) {
+    sets = std::max<size_t>(entries / ways, 1);
+    if (sets & (sets - 1)) {
+      std::cerr << name << ": entries / ways must be a power of two" << std::endl;
+      std::exit(1);
+    }
+    vpns.assign(sets * ways, INVALID);
+    tags.assign(sets * ways, 0);
+    stamps.assign(sets * ways, 0);
+    hands.assign(sets, 0);
+  }
+
+  size_t entries() const { return sets * ways; }
+  size_t associativity() const { return ways; }
+
+  // A translation is in at most one entry, so a repeat of the last one
+  // can skip the set search
+  bool lookup(uint64_t vpn, uint64_t tag) {
+    if (vpns[last] == vpn && tags[last] == tag) {
+      stamps[last] = policy == Policy::LRU ? ++now : 1;
+      ++hits;
+      return true;
+    }
+    size_t base = set_of(vpn, tag) * ways;
+    for (size_t w = 0; w < ways; ++w) {
+      if (vpns[base + w] == vpn && tags[base + w] == tag) {
+        last = base + w;
+        stamps[last] = policy == Policy::LRU ? ++now : 1;
+        ++hits;
+        return true;
+      }
+    }
+    ++misses;
+    return false;
+  }
+
+  // `n` more hits on the entry of the last hit or insert, in one step
+  void hit_last(uint64_t n) {
+    now += n;
+    stamps[last] = policy == Policy::LRU ? now : 1;
+    hits += n;
+  }
+
+  void insert(uint64_t vpn, uint64_t tag) {
+    size_t base = set_of(vpn, tag) * ways;
+    last = base + victim(base);
+    vpns[last] = vpn;
+    tags[last] = tag;
+    stamps[last] = policy == Policy::LRU ? ++now : 1;
+  }
+
+  void flush() {
+    std::fill(vpns.begin(), vpns.end(), INVALID);
+    std::fill(stamps.begin(), stamps.end(), 0);
+  }
+};
+
+// ---- page table ----
+
+// Pages touched so far. Pages are grouped by the leaf page-table page that
+// maps them: an open-addressing table finds the leaf, and a 512-bit bitmap
+// per leaf records its pages, so the set stays small and cache friendly
+// even when a trace touches millions of pages.
+class PageSet {
+private:
+  static constexpr uint64_t EMPTY = ~0ULL;
+  static constexpr int LEAF_BITS = PT_BITS_PER_LEVEL;
+  static constexpr size_t WORDS_PER_LEAF = ((size_t)1 << LEAF_BITS) / 64;
+  std::vector<uint64_t> prefixes;   // va >> (page shift + LEAF_BITS)
+  std::vector<uint64_t> tags;       // asid << 8 | page shift, EMPTY if unused
+  std::vector<uint32_t> leaf_of;    // slot -> leaf index
+  std::vector<uint64_t> bits;       // WORDS_PER_LEAF words per leaf
+  size_t leaves = 0;
+  size_t count = 0;
+
+  static uint64_t mix(uint64_t k) {
+    k ^= k >> 33;
+    k *= 0xFF51AFD7ED558CCDULL;
+    k ^= k >> 33;
+    return k;
+  }
+
+  size_t find_slot(uint64_t prefix, uint64_t tag) const {
+    size_t mask = tags.size() - 1;
+    for (size_t i = mix(prefix ^ mix(tag)) & mask;; i = (i + 1) & mask) {
+      if (tags[i] == EMPTY || (prefixes[i] == prefix && tags[i] == tag)) return i;
+    }
+  }
+
+  void grow() {
+    std::vector<uint64_t> old_prefixes;
+    std::vector<uint64_t> old_tags;
+    std::vector<uint32_t> old_leaf_of;
+    old_prefixes.swap(prefixes);
+    old_tags.swap(tags);
+    old_leaf_of.swap(leaf_of);
+    prefixes.assign(old_prefixes.size() * 2, 0);
+    tags.assign(old_tags.size() * 2, EMPTY);
+    leaf_of.assign(old_leaf_of.size() * 2, 0);
+    for (size_t i = 0; i < old_tags.size(); ++i) {
+      if (old_tags[i] == EMPTY) continue;
+      size_t j = find_slot(old_prefixes[i], old_tags[i]);
+      prefixes[j] = old_prefixes[i];
+      tags[j] = old_tags[i];
+      leaf_of[j] = old_leaf_of[i];
+    }
+  }
+
+public:
+  PageSet() : prefixes(1 << 12, 0), tags(1 << 12, EMPTY), leaf_of(1 << 12, 0) {}
+
+  // Returns true if the page was not there before
+  bool insert(uint64_t vpn, uint64_t tag) {
+    uint64_t prefix = vpn >> LEAF_BITS;
+    size_t i = find_slot(prefix, tag);
+    if (tags[i] == EMPTY) {
+      if ((leaves + 1) * 2 > tags.size()) {
+        grow();
+        i = find_slot(prefix, tag);
+      }
+      prefixes[i] = prefix;
+      tags[i] = tag;
+      leaf_of[i] = (uint32_t)leaves++;
+      bits.resize(leaves * WORDS_PER_LEAF, 0);
+    }
+    unsigned page = (unsigned)(vpn & (((uint64_t)1 << LEAF_BITS) - 1));
+    uint64_t &word = bits[leaf_of[i] * WORDS_PER_LEAF + page / 64];
+    uint64_t bit = (uint64_t)1 << (page % 64);
+    if (word & bit) return false;
+    word |= bit;
+    ++count;
+    return true;
+  }
+
+  size_t size() const { return count; }
+};
+
+// Radix page table walker with a paging-structure cache (PWC) holding
+// upper-level entries, as on x86 MMUs. The PWC is a set-associative Tlb
+// whose entries are tagged exactly with the VA prefix above the level, the
+// ASID and the shift of that level.
+class PageWalker {
+private:
+  int va_bits;
+  bool has_pwc;
+  Tlb pwc;
+  PageSet pages;
+
+  static uint64_t tag(uint64_t asid, int shift) {
+    return (asid << 8) | (uint64_t)shift;
+  }
+
+public:
+  uint64_t walks = 0;
+  uint64_t memory_refs = 0;
+  uint64_t pwc_hits = 0;
+  uint64_t page_faults = 0;
+
+  PageWalker(int va_bits, size_t pwc_entries, size_t pwc_ways)
+      : va_bits(va_bits), has_pwc(pwc_entries > 0),
+        pwc("PWC", std::max<size_t>(pwc_entries, 1), std::max<size_t>(std::min(pwc_ways, pwc_entries), 1), Policy::LRU) {}
+
+  int levels_for(int page_shift) const {
+    return (va_bits - page_shift + PT_BITS_PER_LEVEL - 1) / PT_BITS_PER_LEVEL;
+  }
+
+  // Walk from the root to the leaf for a page of 2^page_shift bytes. The
+  // deepest upper-level entry found in the PWC lets the walk skip every
+  // level above it; the levels below it, which just missed, are cached.
+  // Returns the number of page-table memory references.
+  int walk(uint64_t va, uint64_t asid, int page_shift) {
+    int levels = levels_for(page_shift);
+    int start = 0;   // first level that has to be read from memory
+    if (has_pwc) {
+      for (int level = levels - 1; level >= 1; --level) {
+        int shift = page_shift + (levels - level) * PT_BITS_PER_LEVEL;
+        if (pwc.lookup(va >> shift, tag(asid, shift))) {
+          start = level;
+          ++pwc_hits;
+          break;
+        }
+      }
+      for (int level = start + 1; level < levels; ++level) {
+        int shift = page_shift + (levels - level) * PT_BITS_PER_LEVEL;
+        pwc.insert(va >> shift, tag(asid, shift));
+      }
+    }
+    if (pages.insert(va >> page_shift, tag(asid, page_shift))) {
+      ++page_faults;  // first touch; the OS would map it here
+    }
+    int refs = levels - start;
+    ++walks;
+    memory_refs += refs;
+    return refs;
+  }
+
+  // Address-space switch without ASID tags: cached upper levels go too
+  void flush() {
+    pwc.flush();
+  }
+
+  size_t pages_touched() const { return pages.size(); }
+};
+
+// ---- MMU ----
+
+struct PageRange {
+  uint64_t lo;
+  uint64_t hi;
+  int shift;
+};
+
+struct Config {
+  std::vector<std::pair<size_t, size_t>> tlbs;   // entries, ways
+  Policy policy = Policy::LRU;
+  int default_shift = 12;
+  std::vector<PageRange> ranges;
+  int va_bits = 48;
+  size_t pwc_entries = 32;
+  size_t pwc_ways = 4;
+  bool pcid = true;
+  uint64_t quantum = 100000;
+  uint64_t walk_latency = 30;                    // cycles per page-table memory reference
+  uint64_t tlb_latency = 1;                      // extra cycles per TLB level probed after L1
+  std::vector<std::string> traces;
+  std::string convert_to;
+};
+
+class Mmu {
+private:
+  const Config &cfg;
+  uint64_t last_asid = ~0ULL;
+  uint64_t last_vpn = ~0ULL;        // page of the last translated access
+  int last_shift = 0;
+
+  int page_shift(uint64_t va) const {
+    for (const PageRange &r : cfg.ranges) {
+      if (va >= r.lo && va < r.hi) return r.shift;
+    }
+    return cfg.default_shift;
+  }
+
+public:
+  std::vector<Tlb> tlbs;
+  PageWalker walker;
+  uint64_t accesses = 0;
+  uint64_t flushes = 0;
+  uint64_t cycles = 0;
+
+  Mmu(const Config &cfg) : cfg(cfg), walker(cfg.va_bits, cfg.pwc_entries, cfg.pwc_ways) {
+    for (size_t i = 0; i < cfg.tlbs.size(); ++i) {
+      tlbs.emplace_back("L" + std::to_string(i + 1) + " TLB", cfg.tlbs[i].first, cfg.tlbs[i].second, cfg.policy);
+    }
+  }
+
+  // Accesses to the page translated last are L1 hits on the entry that
+  // translation left in tlbs[0] (found or filled). They are only counted
+  // here and charged in one step, which is what keeps the common case fast.
+  // Ranges are aligned to their page sizes, so va >> last_shift == last_vpn
+  // means the same page.
+  //
+  // Takes decoded Accesses or binary TraceRecords as they are mapped; each
+  // record's ASID is offset by `asid_base`.
+  template <typename Record>
+  void translate_batch(const Record *batch, size_t n, uint64_t asid_base = 0) {
+    uint64_t repeats = 0;
+    for (size_t i = 0; i < n; ++i) {
+      const Access a = { batch[i].va, batch[i].asid + asid_base };
+      if (a.asid == last_asid && (a.va >> last_shift) == last_vpn) {
+        ++repeats;
+        continue;
+      }
+      if (repeats) {
+        tlbs[0].hit_last(repeats);
+        repeats = 0;
+      }
+      if (a.asid != last_asid) {
+        if (!cfg.pcid && last_asid != ~0ULL) {
+          for (Tlb &t : tlbs) t.flush();
+          walker.flush();
+          ++flushes;
+        }
+        last_asid = a.asid;
+      }
+      int shift = page_shift(a.va);
+      uint64_t vpn = a.va >> shift;
+      uint64_t tag = cfg.pcid ? (a.asid << 8) | (uint64_t)shift : (uint64_t)shift;
+
+      size_t level = 0;
+      while (level < tlbs.size() && !tlbs[level].lookup(vpn, tag)) {
+        ++level;
+      }
+      cycles += cfg.tlb_latency * std::min(level, tlbs.size() - 1);
+      if (level == tlbs.size()) {
+        cycles += cfg.walk_latency * walker.walk(a.va, a.asid, shift);
+      }
+      // Fill every level that missed (inclusive hierarchy)
+      for (size_t l = 0; l < level && l < tlbs.size(); ++l) {
+        tlbs[l].insert(vpn, tag);
+      }
+      last_vpn = vpn;
+      last_shift = shift;
+    }
+    if (repeats) {
+      tlbs[0].hit_last(repeats);
+    }
+    accesses += n;
+  }
+};
+
+// ---- command line ----
+
+uint64_t parse_size(const std::string &s) {
+  char *end;
+  uint64_t v = std::strtoull(s.c_str(), &end, 0);
+  switch (*end) {
+  case 'k': case 'K': v <<= 10; break;
+  case 'm': case 'M': v <<= 20; break;
+  case 'g': case 'G': v <<= 30; break;
+  default: break;
+  }
+  return v;
+}
+
+int log2_of(uint64_t v) {
+  if (v == 0 || (v & (v - 1))) {
+    std::cerr << "page size must be a power of two" << std::endl;
+    std::exit(1);
+  }
+  return __builtin_ctzll(v);
+}
+
+void usage(const char *prog) {
+  std::cerr << "usage: " << prog << " [options] trace...\n"
+            << "  --tlb ENTRIES:WAYS    add a TLB level (default 64:4 and 1536:12)\n"
+            << "  --policy lru|clock|random\n"
+            << "  --page SIZE           default page size (4K)\n"
+            << "  --map LO-HI:SIZE      use SIZE pages for [LO, HI)\n"
+            << "  --va-bits N           virtual address bits (48)\n"
+            << "  --pwc N[:WAYS]        paging-structure cache entries and ways (32:4)\n"
+            << "  --walk-latency N      cycles per page-table reference (30)\n"
+            << "  --quantum N           accesses per trace before switching (100000)\n"
+            << "  --no-pcid             flush TLBs and PWC on every address-space switch\n"
+            << "  --convert OUT         write the (lackey) trace as binary and exit\n";
+  std::exit(1);
+}
+
+Config parse_args(int argc, char *argv[]) {
+  Config cfg;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    auto value = [&]() -> std::string {
+      if (i + 1 >= argc) usage(argv[0]);
+      return argv[++i];
+    };
+    if (arg == "--tlb") {
+      std::string v = value();
+      size_t colon = v.find(':');
+      if (colon == std::string::npos) usage(argv[0]);
+      cfg.tlbs.emplace_back(parse_size(v.substr(0, colon)), parse_size(v.substr(colon + 1)));
+    } else if (arg == "--policy") {
+      std::string v = value();
+      if (v == "lru") cfg.policy = Policy::LRU;
+      else if (v == "clock") cfg.policy = Policy::CLOCK;
+      else if (v == "random") cfg.policy = Policy::RANDOM;
+      else usage(argv[0]);
+    } else if (arg == "--page") {
+      cfg.default_shift = log2_of(parse_size(value()));
+    } else if (arg == "--map") {
+      std::string v = value();
+      size_t dash = v.find('-'), colon = v.find(':');
+      if (dash == std::string::npos || colon == std::string::npos) usage(argv[0]);
+      cfg.ranges.push_back(PageRange{ parse_size(v.substr(0, dash)),
+                                      parse_size(v.substr(dash + 1, colon - dash - 1)),
+                                      log2_of(parse_size(v.substr(colon + 1))) });
+    } else if (arg == "--va-bits") {
+      cfg.va_bits = std::atoi(value().c_str());
+    } else if (arg == "--pwc") {
+      std::string v = value();
+      size_t colon = v.find(':');
+      cfg.pwc_entries = parse_size(v.substr(0, colon));
+      if (colon != std::string::npos) cfg.pwc_ways = parse_size(v.substr(colon + 1));
+    } else if (arg == "--walk-latency") {
+      cfg.walk_latency = parse_size(value());
+    } else if (arg == "--quantum") {
+      cfg.quantum = std::max<uint64_t>(parse_size(value()), 1);
+    } else if (arg == "--no-pcid") {
+      cfg.pcid = false;
+    } else if (arg == "--convert") {
+      cfg.convert_to = value();
+    } else if (arg.size() > 1 && arg[0] == '-') {
+      usage(argv[0]);
+    } else {
+      cfg.traces.push_back(arg);
+    }
+  }
+  if (cfg.traces.empty()) usage(argv[0]);
+  // A page must not straddle a range boundary, with either page size
+  for (const PageRange &r : cfg.ranges) {
+    uint64_t align = (uint64_t)1 << std::max(r.shift, cfg.default_shift);
+    if (r.lo >= r.hi || ((r.lo | r.hi) & (align - 1))) {
+      std::cerr << "--map: range must be aligned to its page size and to --page" << std::endl;
+      std::exit(1);
+    }
+  }
+  if (cfg.tlbs.empty()) {
+    cfg.tlbs = { { 64, 4 }, { 1536, 12 } };
+  }
+  return cfg;
+}
+
+int main(int argc, char *argv[]) {
+  Config cfg = parse_args(argc, argv);
+
+  std::vector<TraceReader *> readers;
+  for (size_t i = 0; i < cfg.traces.size(); ++i) {
+    // Leave room for the 32-bit ASIDs a binary trace carries itself
+    readers.push_back(new TraceReader(cfg.traces[i], (uint64_t)i << 32));
+  }
+  if (!cfg.convert_to.empty()) {
+    if (readers[0]->is_binary()) {
+      std::cerr << cfg.traces[0] << " is already binary" << std::endl;
+      return 1;
+    }
+    readers[0]->convert(cfg.convert_to);
+    return 0;
+  }
+
+  Mmu mmu(cfg);
+  std::vector<Access> batch(BATCH);
+  auto start = std::chrono::steady_clock::now();
+
+  // Round-robin over the traces, one quantum at a time
+  size_t live = readers.size();
+  while (live > 0) {
+    live = 0;
+    for (TraceReader *r : readers) {
+      uint64_t left = cfg.quantum;
+      while (left > 0 && !r->done()) {
+        size_t n;
+        if (r->is_binary()) {
+          const TraceRecord *records = r->next_records(std::min<uint64_t>(left, BATCH), &n);
+          if (n == 0) break;
+          mmu.translate_batch(records, n, r->asid_base());
+        } else {
+          n = r->next_batch(batch.data(), std::min<uint64_t>(left, BATCH));
+          if (n == 0) break;
+          mmu.translate_batch(batch.data(), n);
+        }
+        left -= n;
+      }
+      if (!r->done()) ++live;
+    }
+  }
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  std::printf("accesses          %llu (%.1f M/s)\n", (unsigned long long)mmu.accesses,
+              mmu.accesses / seconds / 1e6);
+  for (const Tlb &t : mmu.tlbs) {
+    uint64_t total = t.hits + t.misses;
+    std::printf("%-8s %5zux%-3zu hits %llu  misses %llu  hit rate %.4f%%\n", t.name.c_str(),
+                t.entries() / t.associativity(), t.associativity(),
+                (unsigned long long)t.hits, (unsigned long long)t.misses,
+                total ? 100.0 * t.hits / total : 0.0);
+  }
+  const PageWalker &w = mmu.walker;
+  std::printf("page walks        %llu  (%.4f per 1000 accesses)\n", (unsigned long long)w.walks,
+              mmu.accesses ? 1000.0 * w.walks / mmu.accesses : 0.0);
+  std::printf("avg walk cost     %.3f memory refs, %.1f cycles\n",
+              w.walks ? (double)w.memory_refs / w.walks : 0.0,
+              w.walks ? (double)w.memory_refs * cfg.walk_latency / w.walks : 0.0);
+  std::printf("PWC hit rate      %.2f%%\n", w.walks ? 100.0 * w.pwc_hits / w.walks : 0.0);
+  std::printf("pages touched     %zu (first-touch faults %llu)\n", w.pages_touched(),
+              (unsigned long long)w.page_faults);
+  std::printf("TLB flushes       %llu\n", (unsigned long long)mmu.flushes);
+  std::printf("translation cost  %.3f cycles/access\n",
+              mmu.accesses ? (double)mmu.cycles / mmu.accesses : 0.0);
+
+  for (TraceReader *r : readers) delete r;
+  return 0;
+}
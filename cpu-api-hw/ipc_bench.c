@@ -0,0 +1,395 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <mqueue.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+
+/*
+ * IPC throughput and latency between two processes (q7.c sends a single
+ * message over a pipe; this moves a lot of them over several transports).
+ *
+ *   pipe          default 64 KB pipe
+ *   pipe-1M       pipe enlarged with F_SETPIPE_SZ
+ *   socketpair    AF_UNIX SOCK_STREAM
+ *   mq            POSIX message queue (sizes above msgsize_max are skipped)
+ *   shm-ring      lock-free single-producer/single-consumer byte ring in a
+ *                 memfd shared between the processes, no syscalls at all
+ *   vmsplice      sender maps its pages into an enlarged pipe, reader read()s
+ *
+ * For every message size the parent streams messages to the child and waits
+ * for a one-byte ack (throughput), then bounces a message back and forth and
+ * records each round trip (latency percentiles).
+ *
+ * usage: ipc_bench [max_msg_bytes]
+ */
+
+#define BILLION 1000000000LL
+#define MIN_MSG 8
+#define MAX_MSG (1024 * 1024)
+#define THROUGHPUT_BYTES (256LL * 1024 * 1024)  // data streamed per test
+#define MIN_MESSAGES 200
+#define MAX_MESSAGES 500000
+#define LATENCY_ROUNDTRIPS 2000
+#define BIG_PIPE_SIZE (1024 * 1024)
+#define RING_SIZE (4 * 1024 * 1024)
+#define SPINS_BEFORE_YIELD 256
+#define MQ_DEPTH 10
+
+enum direction { TO_CHILD, TO_PARENT };
+
+// Byte ring in shared memory; head and tail on their own cache lines
+struct ring {
+  _Alignas(64) atomic_size_t head;  // written by the producer
+  _Alignas(64) atomic_size_t tail;  // written by the consumer
+  _Alignas(64) char data[RING_SIZE];
+};
+
+struct channel {
+  int fds[2][2];          // per direction: [0] read end, [1] write end
+  mqd_t mq[2];
+  struct ring* rings[2];
+  size_t msg_size;
+};
+
+struct transport {
+  const char* label;
+  int (*setup)(struct channel* ch);        // returns -1 to skip this size
+  void (*send)(struct channel* ch, enum direction d, char* buf, size_t len);
+  void (*recv)(struct channel* ch, enum direction d, char* buf, size_t len);
+  void (*teardown)(struct channel* ch);
+  int whole_messages;  // recv must ask for the full message size (mq)
+  int failed;          // a child did not exit cleanly; later sizes are skipped
+};
+
+uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * BILLION + ts.tv_nsec;
+}
+
+void die(const char* what) {
+  perror(what);
+  exit(1);
+}
+
+/* ---- stream transports: pipe, socketpair ---- */
+
+void stream_send(struct channel* ch, enum direction d, char* buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(ch->fds[d][1], buf, len);
+    if (n < 0) {
+      if (errno == EINTR) { continue; }
+      die("write");
+    }
+    buf += n;
+    len -= n;
+  }
+}
+
+void stream_recv(struct channel* ch, enum direction d, char* buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = read(ch->fds[d][0], buf, len);
+    if (n <= 0) {
+      if (n < 0 && errno == EINTR) { continue; }
+      die("read");
+    }
+    buf += n;
+    len -= n;
+  }
+}
+
+void fds_teardown(struct channel* ch) {
+  for (int d = 0; d < 2; ++d) {
+    close(ch->fds[d][0]);
+    close(ch->fds[d][1]);
+  }
+}
+
+int pipe_setup(struct channel* ch) {
+  if (pipe(ch->fds[TO_CHILD]) || pipe(ch->fds[TO_PARENT])) { die("pipe"); }
+  return 0;
+}
+
+int big_pipe_setup(struct channel* ch) {
+  pipe_setup(ch);
+  for (int d = 0; d < 2; ++d) {
+    if (fcntl(ch->fds[d][1], F_SETPIPE_SZ, BIG_PIPE_SIZE) < 0) { die("F_SETPIPE_SZ"); }
+  }
+  return 0;
+}
+
+int socketpair_setup(struct channel* ch) {
+  int sv[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) { die("socketpair"); }
+  // One socket per end; both directions share the connection
+  ch->fds[TO_CHILD][1] = sv[0];
+  ch->fds[TO_PARENT][0] = sv[0];
+  ch->fds[TO_CHILD][0] = sv[1];
+  ch->fds[TO_PARENT][1] = sv[1];
+  return 0;
+}
+
+void socketpair_teardown(struct channel* ch) {
+  close(ch->fds[TO_CHILD][1]);
+  close(ch->fds[TO_CHILD][0]);
+}
+
+/* ---- POSIX message queues ---- */
+
+int mq_setup(struct channel* ch) {
+  struct mq_attr attr = { .mq_maxmsg = MQ_DEPTH, .mq_msgsize = (long) ch->msg_size };
+  for (int d = 0; d < 2; ++d) {
+    char name[64];
+    snprintf(name, sizeof(name), "/ipc_bench_%d_%d", (int) getpid(), d);
+    ch->mq[d] = mq_open(name, O_RDWR | O_CREAT | O_EXCL, 0600, &attr);
+    if (ch->mq[d] == (mqd_t) -1) {
+      if (d == 1) { mq_close(ch->mq[0]); }
+      for (int u = 0; u < 2; ++u) {
+        snprintf(name, sizeof(name), "/ipc_bench_%d_%d", (int) getpid(), u);
+        mq_unlink(name);
+      }
+      return -1;  // usually msg_size > /proc/sys/fs/mqueue/msgsize_max
+    }
+    mq_unlink(name);  // the open descriptors keep the queue alive
+  }
+  return 0;
+}
+
+void mq_bench_send(struct channel* ch, enum direction d, char* buf, size_t len) {
+  while (mq_send(ch->mq[d], buf, len, 0) < 0) {
+    if (errno != EINTR) { die("mq_send"); }
+  }
+}
+
+void mq_bench_recv(struct channel* ch, enum direction d, char* buf, size_t len) {
+  while (mq_receive(ch->mq[d], buf, len, NULL) < 0) {
+    if (errno != EINTR) { die("mq_receive"); }
+  }
+}
+
+void mq_teardown(struct channel* ch) {
+  mq_close(ch->mq[0]);
+  mq_close(ch->mq[1]);
+}
+
+/* ---- SPSC ring in shared memory ---- */
+
+int ring_setup(struct channel* ch) {
+  int fd = memfd_create("ipc_bench_ring", 0);
+  if (fd < 0) { die("memfd_create"); }
+  if (ftruncate(fd, 2 * sizeof(struct ring))) { die("ftruncate"); }
+  struct ring* rings = mmap(NULL, 2 * sizeof(struct ring), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (rings == MAP_FAILED) { die("mmap"); }
+  close(fd);  // the mapping survives fork and keeps the memfd alive
+
+  for (int d = 0; d < 2; ++d) {
+    ch->rings[d] = &rings[d];
+    atomic_init(&rings[d].head, 0);
+    atomic_init(&rings[d].tail, 0);
+  }
+  return 0;
+}
+
+// Spin briefly, then yield so a peer on the same CPU can make progress
+void ring_backoff(int* spins) {
+  if (++*spins >= SPINS_BEFORE_YIELD) {
+    *spins = 0;
+    sched_yield();
+  }
+}
+
+void ring_send(struct channel* ch, enum direction d, char* buf, size_t len) {
+  struct ring* r = ch->rings[d];
+  size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+  int spins = 0;
+  while (len > 0) {
+    size_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+    size_t space = RING_SIZE - (head - tail);
+    if (space == 0) { ring_backoff(&spins); continue; }
+
+    size_t off = head % RING_SIZE;
+    size_t n = len < space ? len : space;
+    if (n > RING_SIZE - off) { n = RING_SIZE - off; }  // stop at the wrap
+    memcpy(r->data + off, buf, n);
+    head += n;
+    buf += n;
+    len -= n;
+    atomic_store_explicit(&r->head, head, memory_order_release);
+  }
+}
+
+void ring_recv(struct channel* ch, enum direction d, char* buf, size_t len) {
+  struct ring* r = ch->rings[d];
+  size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+  int spins = 0;
+  while (len > 0) {
+    size_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+    size_t avail = head - tail;
+    if (avail == 0) { ring_backoff(&spins); continue; }
+
+    size_t off = tail % RING_SIZE;
+    size_t n = len < avail ? len : avail;
+    if (n > RING_SIZE - off) { n = RING_SIZE - off; }
+    memcpy(buf, r->data + off, n);
+    tail += n;
+    buf += n;
+    len -= n;
+    atomic_store_explicit(&r->tail, tail, memory_order_release);
+  }
+}
+
+void ring_teardown(struct channel* ch) {
+  munmap(ch->rings[0], 2 * sizeof(struct ring));
+}
+
+/* ---- vmsplice into a pipe ---- */
+
+void vmsplice_send(struct channel* ch, enum direction d, char* buf, size_t len) {
+  while (len > 0) {
+    struct iovec iov = { .iov_base = buf, .iov_len = len };
+    ssize_t n = vmsplice(ch->fds[d][1], &iov, 1, 0);
+    if (n < 0) {
+      if (errno == EINTR) { continue; }
+      die("vmsplice");
+    }
+    buf += n;
+    len -= n;
+  }
+}
+
+struct transport transports[] = {
+  { "pipe",       pipe_setup,       stream_send,   stream_recv,   fds_teardown,        0, 0 },
+  { "pipe-1M",    big_pipe_setup,   stream_send,   stream_recv,   fds_teardown,        0, 0 },
+  { "socketpair", socketpair_setup, stream_send,   stream_recv,   socketpair_teardown, 0, 0 },
+  { "mq",         mq_setup,         mq_bench_send, mq_bench_recv, mq_teardown,         1, 0 },
+  { "shm-ring",   ring_setup,       ring_send,     ring_recv,     ring_teardown,       0, 0 },
+  { "vmsplice",   big_pipe_setup,   vmsplice_send, stream_recv,   fds_teardown,        0, 0 },
+};
+
+#define NUM_TRANSPORTS (sizeof(transports) / sizeof(transports[0]))
+
+uint64_t num_messages(size_t msg_size) {
+  uint64_t n = THROUGHPUT_BYTES / msg_size;
+  if (n < MIN_MESSAGES) { n = MIN_MESSAGES; }
+  if (n > MAX_MESSAGES) { n = MAX_MESSAGES; }
+  return n;
+}
+
+int compare_u64(const void* a, const void* b) {
+  uint64_t x = *(const uint64_t*) a, y = *(const uint64_t*) b;
+  return (x > y) - (x < y);
+}
+
+// Child side: drain the stream, ack it, then echo every ping
+void run_child(struct transport* t, struct channel* ch, char* buf) {
+  size_t len = ch->msg_size;
+  uint64_t n = num_messages(len);
+  for (uint64_t i = 0; i < n; ++i) {
+    t->recv(ch, TO_CHILD, buf, len);
+  }
+  t->send(ch, TO_PARENT, buf, t->whole_messages ? len : 1);
+
+  for (int i = 0; i < LATENCY_ROUNDTRIPS; ++i) {
+    t->recv(ch, TO_CHILD, buf, len);
+    t->send(ch, TO_PARENT, buf, len);
+  }
+}
+
+void run_test(struct transport* t, size_t msg_size) {
+  struct channel ch;
+  memset(&ch, 0, sizeof(ch));
+  ch.msg_size = msg_size;
+  if (t->failed) {
+    printf("  %-11s %9zu %14s\n", t->label, msg_size, "skipped");
+    return;
+  }
+  if (t->setup(&ch) < 0) {
+    printf("  %-11s %9zu %14s\n", t->label, msg_size, "n/a");
+    return;
+  }
+
+  char* buf = malloc(msg_size);
+  if (buf == NULL) { die("malloc"); }
+  memset(buf, 'x', msg_size);
+
+  int rc = fork();
+  if (rc < 0) {
+    fprintf(stderr, "fork failed\n");
+    exit(1);
+  } else if (rc == 0) { // child
+    run_child(t, &ch, buf);
+    _exit(0);
+  }
+
+  // Throughput: stream n messages and wait for the ack
+  uint64_t n = num_messages(msg_size);
+  uint64_t start = now_ns();
+  for (uint64_t i = 0; i < n; ++i) {
+    t->send(&ch, TO_CHILD, buf, msg_size);
+  }
+  t->recv(&ch, TO_PARENT, buf, t->whole_messages ? msg_size : 1);
+  uint64_t elapsed = now_ns() - start;
+
+  // Latency: one message each way per round trip
+  uint64_t* rtt = malloc(LATENCY_ROUNDTRIPS * sizeof(uint64_t));
+  if (rtt == NULL) { die("malloc"); }
+  for (int i = 0; i < LATENCY_ROUNDTRIPS; ++i) {
+    uint64_t t0 = now_ns();
+    t->send(&ch, TO_CHILD, buf, msg_size);
+    t->recv(&ch, TO_PARENT, buf, msg_size);
+    rtt[i] = now_ns() - t0;
+  }
+  // A child that did not get every message right makes the numbers
+  // meaningless
+  int status;
+  if (waitpid(rc, &status, 0) < 0) { die("waitpid"); }
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    printf("  %-11s %9zu %14s\n", t->label, msg_size, "failed");
+    t->failed = 1;
+    free(rtt);
+    free(buf);
+    t->teardown(&ch);
+    return;
+  }
+  qsort(rtt, LATENCY_ROUNDTRIPS, sizeof(uint64_t), compare_u64);
+
+  printf("  %-11s %9zu %14.0f %10.3f %10.2f %10.2f %10.2f\n",
+         t->label, msg_size,
+         n * (double) BILLION / elapsed,
+         (double) n * msg_size / elapsed,  // bytes/ns == GB/s
+         rtt[LATENCY_ROUNDTRIPS / 2] / 1000.0,
+         rtt[LATENCY_ROUNDTRIPS * 99 / 100] / 1000.0,
+         rtt[LATENCY_ROUNDTRIPS * 999 / 1000] / 1000.0);
+
+  free(rtt);
+  free(buf);
+  t->teardown(&ch);
+}
+
+int main(int argc, const char* argv[]) {
+  size_t max_msg = MAX_MSG;
+  if (argc > 1) { max_msg = strtoull(argv[1], NULL, 10); }
+
+  printf("  %-11s %9s %14s %10s %10s %10s %10s\n",
+         "transport", "msg bytes", "msgs/s", "GB/s", "p50 us", "p99 us", "p99.9 us");
+  for (size_t i = 0; i < NUM_TRANSPORTS; ++i) {
+    size_t size = MIN_MSG;
+    for (; size <= max_msg; size *= 8) {
+      run_test(&transports[i], size);
+    }
+    // Sizes go up by 8x, so finish on the requested maximum itself
+    if (size / 8 < max_msg) { run_test(&transports[i], max_msg); }
+  }
+  return 0;
+}
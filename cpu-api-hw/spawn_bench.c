@@ -0,0 +1,235 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <spawn.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+/*
+ * Process creation cost, as a function of how much memory the parent has
+ * touched (q1-q6 do the same fork/wait/exec dance without timing it).
+ *
+ *   fork+exit     child exits straight away; pays for copying page tables
+ *   fork+exec     child execs /bin/true
+ *   vfork+exec    parent is suspended and the child borrows its mm
+ *   posix_spawn   glibc uses clone(CLONE_VM|CLONE_VFORK) internally
+ *   clone+exec    clone(CLONE_VM|CLONE_VFORK) by hand, on a private stack
+ *   fork+cow      child writes one word per page (x = 200 in q1.c), so
+ *                 every page takes a copy-on-write fault
+ *
+ * usage: spawn_bench [max_rss_mb]
+ */
+
+#define BILLION 1000000000LL
+#define MB (1024ULL * 1024ULL)
+#define DEFAULT_MAX_RSS_MB 1024
+#define MIN_ITERATIONS 3
+#define MAX_ITERATIONS 2000
+#define TIME_BUDGET_NS (BILLION / 2)     // per method and size
+#define CLONE_STACK_SIZE (64 * 1024)
+#define EXEC_PATH "/bin/true"
+
+extern char **environ;
+
+char *exec_argv[] = { "true", NULL };
+
+char *parent_memory = NULL;
+size_t parent_rss = 0;
+long page_size = 4096;
+
+uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * BILLION + ts.tv_nsec;
+}
+
+long child_minflt(void) {
+  struct rusage ru;
+  getrusage(RUSAGE_CHILDREN, &ru);
+  return ru.ru_minflt;
+}
+
+long self_minflt(void) {
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  return ru.ru_minflt;
+}
+
+void wait_child(pid_t rc) {
+  int status;
+  if (waitpid(rc, &status, 0) != rc || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    fprintf(stderr, "child %d failed\n", (int) rc);
+    exit(1);
+  }
+}
+
+void spawn_fork_exit(void) {
+  pid_t rc = fork();
+  if (rc < 0) {
+    fprintf(stderr, "Fork failed\n");
+    exit(1);
+  } else if (rc == 0) { // child
+    _exit(0);
+  }
+  wait_child(rc);
+}
+
+void spawn_fork_exec(void) {
+  pid_t rc = fork();
+  if (rc < 0) {
+    fprintf(stderr, "Fork failed\n");
+    exit(1);
+  } else if (rc == 0) { // child
+    execv(EXEC_PATH, exec_argv);
+    _exit(127);
+  }
+  wait_child(rc);
+}
+
+void spawn_vfork_exec(void) {
+  pid_t rc = vfork();
+  if (rc < 0) {
+    fprintf(stderr, "vfork failed\n");
+    exit(1);
+  } else if (rc == 0) { // child: only exec or _exit are safe here
+    execv(EXEC_PATH, exec_argv);
+    _exit(127);
+  }
+  wait_child(rc);
+}
+
+void spawn_posix_spawn(void) {
+  pid_t rc;
+  if (posix_spawn(&rc, EXEC_PATH, NULL, NULL, exec_argv, environ) != 0) {
+    fprintf(stderr, "posix_spawn failed\n");
+    exit(1);
+  }
+  wait_child(rc);
+}
+
+int clone_child(void *args) {
+  (void) args;
+  execv(EXEC_PATH, exec_argv);
+  _exit(127);
+}
+
+void spawn_clone_exec(void) {
+  static char *stack = NULL;
+  if (stack == NULL) {
+    stack = mmap(NULL, CLONE_STACK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+    if (stack == MAP_FAILED) { perror("mmap"); exit(1); }
+  }
+  // Stacks grow down on every architecture Linux still cares about
+  pid_t rc = clone(clone_child, stack + CLONE_STACK_SIZE, CLONE_VM | CLONE_VFORK | SIGCHLD, NULL);
+  if (rc < 0) {
+    perror("clone");
+    exit(1);
+  }
+  wait_child(rc);
+}
+
+void spawn_fork_cow(void) {
+  pid_t rc = fork();
+  if (rc < 0) {
+    fprintf(stderr, "Fork failed\n");
+    exit(1);
+  } else if (rc == 0) { // child: dirty every inherited page
+    for (size_t off = 0; off < parent_rss; off += page_size) {
+      parent_memory[off] = 200;
+    }
+    _exit(0);
+  }
+  wait_child(rc);
+}
+
+struct spawn_method {
+  const char *label;
+  void (*spawn)(void);
+};
+
+struct spawn_method methods[] = {
+  { "fork+exit",   spawn_fork_exit },
+  { "fork+exec",   spawn_fork_exec },
+  { "vfork+exec",  spawn_vfork_exec },
+  { "posix_spawn", spawn_posix_spawn },
+  { "clone+exec",  spawn_clone_exec },
+  { "fork+cow",    spawn_fork_cow },
+};
+
+#define NUM_METHODS (sizeof(methods) / sizeof(methods[0]))
+
+// Give the parent `size` bytes of touched (resident) memory
+void set_parent_rss(size_t size) {
+  if (parent_memory) { munmap(parent_memory, parent_rss); }
+  parent_memory = NULL;
+  parent_rss = size;
+  if (size == 0) { return; }
+
+  parent_memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (parent_memory == MAP_FAILED) { perror("mmap"); exit(1); }
+  // Keep to base pages: with THP set to "always" one fault would copy a
+  // whole 2 MB page, and the per-page copy-on-write figure below would be
+  // off by up to 512x. EINVAL just means the kernel has no THP.
+  if (madvise(parent_memory, size, MADV_NOHUGEPAGE)) { perror("madvise"); }
+  for (size_t off = 0; off < size; off += page_size) {
+    parent_memory[off] = 100;
+  }
+}
+
+// Returns the average latency in ns
+double run_method(struct spawn_method *m) {
+  uint64_t iterations = 0;
+  long parent_faults = self_minflt();
+  long child_faults = child_minflt();
+  uint64_t min_ns = UINT64_MAX;
+  uint64_t start = now_ns(), elapsed = 0;
+
+  while (iterations < MIN_ITERATIONS || (elapsed < TIME_BUDGET_NS && iterations < MAX_ITERATIONS)) {
+    uint64_t t0 = now_ns();
+    m->spawn();
+    uint64_t t1 = now_ns();
+    if (t1 - t0 < min_ns) { min_ns = t1 - t0; }
+    ++iterations;
+    elapsed = t1 - start;
+  }
+
+  parent_faults = self_minflt() - parent_faults;
+  child_faults = child_minflt() - child_faults;
+  printf("  %-12s %12.1f %12.1f %10.0f %12.1f %12.1f\n",
+         m->label,
+         elapsed / 1000.0 / iterations,
+         min_ns / 1000.0,
+         iterations * (double) BILLION / elapsed,
+         (double) child_faults / iterations,
+         (double) parent_faults / iterations);
+  return (double) elapsed / iterations;
+}
+
+int main(int argc, const char* argv[]) {
+  size_t max_rss_mb = DEFAULT_MAX_RSS_MB;
+  if (argc > 1) { max_rss_mb = strtoull(argv[1], NULL, 10); }
+  page_size = sysconf(_SC_PAGESIZE);
+
+  for (size_t rss_mb = 10; rss_mb <= max_rss_mb; rss_mb *= 10) {
+    set_parent_rss(rss_mb * MB);
+    printf("parent RSS %zu MB (pid:%d)\n", rss_mb, (int) getpid());
+    printf("  %-12s %12s %12s %10s %12s %12s\n",
+           "method", "avg us", "min us", "spawns/s", "child flt", "parent flt");
+    double avg_ns[NUM_METHODS];
+    for (size_t i = 0; i < NUM_METHODS; ++i) {
+      avg_ns[i] = run_method(&methods[i]);
+    }
+    // fork+cow minus fork+exit leaves just the copy-on-write faults
+    size_t pages = parent_rss / page_size;
+    printf("  copy-on-write fault: %.1f ns/page\n\n", (avg_ns[NUM_METHODS - 1] - avg_ns[0]) / pages);
+  }
+  set_parent_rss(0);
+  return 0;
+}
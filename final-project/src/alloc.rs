@@ -0,0 +1,354 @@
+use std::cell::Cell;
+use std::collections::BTreeSet;
+use std::io;
+use std::sync::atomic::{AtomicBool, AtomicU64, AtomicUsize, Ordering};
+use std::sync::Mutex;
+
+use crate::disk::BLOCK_SIZE;
+use crate::layout::{Bitmap, BITS_PER_BLOCK};
+
+pub fn no_space() -> io::Error {
+    return io::Error::new(io::ErrorKind::StorageFull, "out of data blocks");
+}
+
+// One allocation group: the blocks covered by a single bitmap block
+struct Group {
+    // What the bitmap block on disk says
+    bitmap: Bitmap,
+    // `bitmap` plus the blocks freed by transactions that have not
+    // committed yet; allocation searches this one
+    busy: Bitmap,
+    hint: u64,
+}
+
+// Data block allocator over the block bitmap. It hands out extents rather
+// than single blocks and tries to continue right where a file's last block
+// ended, so files written sequentially stay contiguous on disk.
+//
+// The bitmap is split into allocation groups of one bitmap block each,
+// with a lock per group. A thread allocating without a goal starts in a
+// group of its own, so concurrent writers rarely share a lock (or end up
+// interleaving their files' blocks).
+//
+// A freed block is clear in the bitmap written out with its transaction,
+// but is not handed out again until that transaction has committed (the
+// committed bitmap of ext3). Until then the block may still be what the
+// file system after a crash points at: reusing it for data, which is
+// written in place right away, or for metadata, whose log copies a
+// checkpoint running concurrently could write home, would put something
+// else under the old owner.
+pub struct BlockAllocator {
+    groups: Vec<Mutex<Group>>,
+    // Bitmap blocks changed since the last take_dirty()
+    dirty: Vec<AtomicBool>,
+    data_start: u64,
+    num_blocks: u64,
+    free: AtomicU64,
+    next_group: AtomicUsize,
+    // Freed extents waiting for their transaction: (tid, start, len)
+    pending: Mutex<Vec<(u64, u64, u64)>>,
+}
+
+thread_local! {
+    // Group a thread allocates from when it has no goal
+    static HOME_GROUP: Cell<Option<usize>> = Cell::new(None);
+}
+
+impl BlockAllocator {
+    pub fn new(bitmap: Bitmap, data_start: u64) -> Self {
+        let num_blocks = bitmap.len();
+        let count = (Bitmap::block_of(num_blocks - 1) + 1) as usize;
+        let mut buf = vec![0u8; BLOCK_SIZE];
+        let groups = (0..count as u64)
+            .map(|i| {
+                let len = BITS_PER_BLOCK.min(num_blocks - i * BITS_PER_BLOCK);
+                let mut group = Bitmap::new(len);
+                let mut busy = Bitmap::new(len);
+                bitmap.store_block(i, &mut buf);
+                group.load_block(0, &buf);
+                busy.load_block(0, &buf);
+                return Mutex::new(Group { bitmap: group, busy, hint: 0 });
+            })
+            .collect();
+        return Self {
+            groups,
+            dirty: (0..count).map(|_| AtomicBool::new(false)).collect(),
+            data_start,
+            num_blocks,
+            free: AtomicU64::new(num_blocks - bitmap.count_ones()),
+            next_group: AtomicUsize::new(Bitmap::block_of(data_start) as usize),
+            pending: Mutex::new(Vec::new()),
+        };
+    }
+
+    // Blocks that can be allocated now; those freed by a transaction count
+    // once it has committed
+    pub fn free_blocks(&self) -> u64 {
+        return self.free.load(Ordering::Relaxed);
+    }
+
+    fn home_group(&self) -> usize {
+        return HOME_GROUP.with(|home| match home.get() {
+            Some(group) if group < self.groups.len() => group,
+            _ => {
+                let group = self.next_group.fetch_add(1, Ordering::Relaxed) % self.groups.len();
+                home.set(Some(group));
+                group
+            }
+        });
+    }
+
+    // Allocate up to `want` consecutive blocks, preferably starting at
+    // `goal`. Returns (first block, count); the count is smaller than `want`
+    // only when no free run that long exists in the group searched. Runs
+    // never cross a group boundary.
+    pub fn allocate(&self, goal: u64, want: u64) -> Option<(u64, u64)> {
+        if want == 0 {
+            return None;
+        }
+        let first = if goal >= self.data_start && goal < self.num_blocks {
+            Bitmap::block_of(goal) as usize
+        } else {
+            self.home_group()
+        };
+        // Groups holding a shorter run than wanted are a fallback
+        let mut fallback = None;
+        for k in 0..self.groups.len() {
+            let index = (first + k) % self.groups.len();
+            let base = index as u64 * BITS_PER_BLOCK;
+            let mut group = self.groups[index].lock().unwrap();
+            let local_goal = if k == 0 && goal >= base && goal < base + group.bitmap.len() {
+                goal - base
+            } else {
+                group.hint
+            };
+            let at_goal = group.busy.free_run(local_goal, want);
+            if at_goal > 0 {
+                return Some(self.take(&mut group, index, local_goal, at_goal));
+            }
+            let (start, len) = match group.busy.find_run(local_goal, want) {
+                Some(run) => run,
+                None => continue,
+            };
+            if len < want {
+                if fallback.map_or(true, |(_, best)| len > best) {
+                    fallback = Some((index, len));
+                }
+                continue;
+            }
+            return Some(self.take(&mut group, index, start, len));
+        }
+        let (index, _) = fallback?;
+        let mut group = self.groups[index].lock().unwrap();
+        let hint = group.hint;
+        let (start, len) = group.busy.find_run(hint, want)?;
+        return Some(self.take(&mut group, index, start, len));
+    }
+
+    fn take(&self, group: &mut Group, index: usize, start: u64, len: u64) -> (u64, u64) {
+        group.bitmap.set_range(start, len, true);
+        group.busy.set_range(start, len, true);
+        group.hint = start + len;
+        if group.hint >= group.bitmap.len() {
+            group.hint = 0;
+        }
+        self.dirty[index].store(true, Ordering::Release);
+        self.free.fetch_sub(len, Ordering::Relaxed);
+        return (index as u64 * BITS_PER_BLOCK + start, len);
+    }
+
+    // Free an extent in transaction `tid`. The blocks can be allocated
+    // again once release() is told that `tid` has committed.
+    pub fn free(&self, start: u64, len: u64, tid: u64) {
+        if len == 0 {
+            return;
+        }
+        self.for_each_group(start, len, |group, index, local, n| {
+            group.bitmap.set_range(local, n, false);
+            self.dirty[index].store(true, Ordering::Release);
+        });
+        self.pending.lock().unwrap().push((tid, start, len));
+    }
+
+    // Make the blocks freed by transactions below `committed` available
+    pub fn release(&self, committed: u64) {
+        let released: Vec<(u64, u64, u64)> = {
+            let mut pending = self.pending.lock().unwrap();
+            // Extents are added in transaction order
+            if pending.first().map_or(true, |&(tid, _, _)| tid >= committed) {
+                return;
+            }
+            let (released, kept) = pending.drain(..).partition(|&(tid, _, _)| tid < committed);
+            *pending = kept;
+            released
+        };
+        for (_, start, len) in released {
+            self.for_each_group(start, len, |group, _, local, n| {
+                group.busy.set_range(local, n, false);
+            });
+            self.free.fetch_add(len, Ordering::Relaxed);
+        }
+    }
+
+    // Call `f(group, group index, first block in the group, count)` for
+    // each group the extent touches, with the group locked
+    fn for_each_group<F>(&self, start: u64, len: u64, mut f: F)
+    where
+        F: FnMut(&mut Group, usize, u64, u64),
+    {
+        let mut block = start;
+        while block < start + len {
+            let index = Bitmap::block_of(block) as usize;
+            let base = index as u64 * BITS_PER_BLOCK;
+            let n = (base + BITS_PER_BLOCK).min(start + len) - block;
+            let mut group = self.groups[index].lock().unwrap();
+            f(&mut group, index, block - base, n);
+            block += n;
+        }
+    }
+
+    pub fn mark_all_dirty(&self) {
+        for dirty in &self.dirty {
+            dirty.store(true, Ordering::Release);
+        }
+    }
+
+    pub fn take_dirty(&self) -> BTreeSet<u64> {
+        return (0..self.dirty.len())
+            .filter(|&i| self.dirty[i].swap(false, Ordering::AcqRel))
+            .map(|i| i as u64)
+            .collect();
+    }
+
+    // Copy bitmap block `index` into `buf` and hand it to `write` while the
+    // group is still locked, so a later change cannot be overtaken by this
+    // older copy
+    pub fn store_block<F>(&self, index: u64, buf: &mut [u8], write: F) -> io::Result<()>
+    where
+        F: FnOnce(&[u8]) -> io::Result<()>,
+    {
+        let group = self.groups[index as usize].lock().unwrap();
+        group.bitmap.store_block(0, buf);
+        return write(buf);
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn allocator(blocks: u64, data_start: u64) -> BlockAllocator {
+        let mut bitmap = Bitmap::new(blocks);
+        bitmap.set_range(0, data_start, true);
+        return BlockAllocator::new(bitmap, data_start);
+    }
+
+    #[test]
+    fn extents_continue_at_the_goal() {
+        let allocator = allocator(1000, 10);
+        assert_eq!(allocator.free_blocks(), 990);
+        assert_eq!(allocator.allocate(100, 8), Some((100, 8)));
+        assert_eq!(allocator.allocate(108, 4), Some((108, 4)));
+        // Taken goal: the next run after it
+        assert_eq!(allocator.allocate(100, 2), Some((112, 2)));
+        assert_eq!(allocator.free_blocks(), 976);
+        assert_eq!(allocator.allocate(5, 0), None);
+    }
+
+    #[test]
+    fn short_runs_when_nothing_longer_is_free() {
+        let allocator = allocator(64, 0);
+        assert_eq!(allocator.allocate(0, 60), Some((0, 60)));
+        assert_eq!(allocator.allocate(0, 10), Some((60, 4)));
+        assert_eq!(allocator.allocate(0, 1), None);
+        assert_eq!(allocator.free_blocks(), 0);
+    }
+
+    #[test]
+    fn extents_stay_inside_a_group() {
+        let allocator = allocator(2 * BITS_PER_BLOCK, 10);
+        let goal = BITS_PER_BLOCK - 2;
+        assert_eq!(allocator.allocate(goal, 5), Some((goal, 2)));
+        let (start, len) = allocator.allocate(goal, 5).unwrap();
+        assert_eq!(len, 5);
+        assert!(start / BITS_PER_BLOCK == (start + len - 1) / BITS_PER_BLOCK);
+        // Only the bitmap block of the group used is written back
+        assert_eq!(allocator.take_dirty().into_iter().collect::<Vec<_>>(), vec![0]);
+        assert!(allocator.take_dirty().is_empty());
+    }
+
+    #[test]
+    fn freed_blocks_wait_for_their_commit() {
+        let allocator = allocator(64, 0);
+        assert_eq!(allocator.allocate(0, 64), Some((0, 64)));
+        allocator.take_dirty();
+        allocator.free(8, 4, 5);
+        allocator.free(20, 1, 6);
+        // Free on disk right away, but not handed out yet
+        assert_eq!(allocator.take_dirty().len(), 1);
+        let mut buf = vec![0u8; BLOCK_SIZE];
+        allocator
+            .store_block(0, &mut buf, |buf| {
+                assert_eq!(buf[1], 0b11110000);
+                return Ok(());
+            })
+            .unwrap();
+        assert_eq!(allocator.allocate(0, 1), None);
+        allocator.release(5);
+        assert_eq!(allocator.free_blocks(), 0);
+        allocator.release(6);
+        assert_eq!(allocator.free_blocks(), 4);
+        assert_eq!(allocator.allocate(0, 8), Some((8, 4)));
+        allocator.release(100);
+        assert_eq!(allocator.allocate(0, 8), Some((20, 1)));
+    }
+
+    #[test]
+    fn threads_never_share_a_block() {
+        let allocator = allocator(4 * BITS_PER_BLOCK, 10);
+        let taken = std::sync::Mutex::new(Vec::new());
+        std::thread::scope(|s| {
+            for t in 0..4u64 {
+                let (allocator, taken) = (&allocator, &taken);
+                s.spawn(move || {
+                    let mut mine = Vec::new();
+                    for i in 0..500 {
+                        let goal = if i % 2 == 0 { 0 } else { t * BITS_PER_BLOCK + i };
+                        mine.push(allocator.allocate(goal, 1 + i % 7).unwrap());
+                        if i % 5 == 0 {
+                            let (start, len) = mine.pop().unwrap();
+                            allocator.free(start, len, 0);
+                        }
+                    }
+                    taken.lock().unwrap().extend(mine);
+                });
+            }
+        });
+        let mut blocks: Vec<u64> = taken
+            .into_inner()
+            .unwrap()
+            .into_iter()
+            .flat_map(|(start, len)| start..start + len)
+            .collect();
+        let count = blocks.len();
+        blocks.sort_unstable();
+        blocks.dedup();
+        assert_eq!(blocks.len(), count);
+        assert!(blocks[0] >= 10);
+        allocator.release(1);
+        assert_eq!(allocator.free_blocks(), 4 * BITS_PER_BLOCK - 10 - count as u64);
+    }
+
+    #[test]
+    fn store_block_writes_the_group() {
+        let allocator = allocator(BITS_PER_BLOCK, 3);
+        allocator.allocate(3, 2).unwrap();
+        let mut buf = vec![0u8; BLOCK_SIZE];
+        allocator
+            .store_block(0, &mut buf, |buf| {
+                assert_eq!(buf[0], 0b11111);
+                return Ok(());
+            })
+            .unwrap();
+    }
+}
@@ -0,0 +1,203 @@
+use std::env;
+use std::fs;
+use std::io::{self, Read};
+use std::time::{Duration, Instant};
+
+use final_project::disk::BLOCK_SIZE;
+use final_project::FileSystem;
+
+// usage: bench [files] [big file MB] [image]
+//
+// Baseline for the file system's hot paths. Creates `files` empty files
+// (1000 per directory), looks each one up by path, lists every directory,
+// writes and reads back a 4 KB file for up to SMALL_FILES of them, then
+// writes a big file in 1 MB appends and reads it back whole, with read_at,
+// with the streaming reader and with random 4 KB read_at calls. Each line
+// reports one measurement, in the same format every run so results can
+// be compared.
+//
+// The image (default: bench.img in the temp directory) is created sparse,
+// sized for the workload, and removed at the end.
+const FILES_PER_DIR: u64 = 1000;
+const SMALL_FILES: u64 = 100_000;
+const SMALL_SIZE: usize = 4096;
+const APPEND_SIZE: usize = 1 << 20;
+const RANDOM_READS: u64 = 100_000;
+
+fn report(name: &str, count: u64, unit: &str, elapsed: Duration, bytes: u64) {
+    let secs = elapsed.as_secs_f64().max(1e-9);
+    let throughput = if bytes > 0 {
+        format!("{:>10.1} MB/s", bytes as f64 / secs / (1024.0 * 1024.0))
+    } else {
+        String::new()
+    };
+    println!(
+        "{:<18} {:>9} {:<7} {:>9.3} s {:>12.0} /s {}",
+        name,
+        count,
+        unit,
+        secs,
+        count as f64 / secs,
+        throughput
+    );
+}
+
+fn timed<T, F: FnOnce() -> io::Result<T>>(f: F) -> io::Result<(T, Duration)> {
+    let start = Instant::now();
+    let value = f()?;
+    return Ok((value, start.elapsed()));
+}
+
+fn path(i: u64) -> String {
+    return format!("/d{}/f{}", i / FILES_PER_DIR, i);
+}
+
+fn main() -> io::Result<()> {
+    let mut args = env::args().skip(1);
+    let files: u64 = args.next().map_or(1_000_000, |a| a.parse().expect("files"));
+    let big_mb: u64 = args.next().map_or(1024, |a| a.parse::<u64>().expect("big file MB")).max(1);
+    let image = args
+        .next()
+        .map_or_else(|| env::temp_dir().join("bench.img"), |a| a.into());
+
+    let dirs = (files + FILES_PER_DIR - 1) / FILES_PER_DIR;
+    let small = files.min(SMALL_FILES);
+    let big = big_mb << 20;
+    let bs = BLOCK_SIZE as u64;
+    // One inode per four blocks; data, inode table and directories
+    // with room to spare
+    let num_blocks = (4 * (files + dirs + 16))
+        .max((big / bs + small + (files + dirs) / 16 + dirs * 32) * 5 / 4 + 65536);
+    let fs = FileSystem::create_image(&image, num_blocks)?;
+    println!(
+        "{} files in {} directories, {} MB file, {} blocks at {}",
+        files,
+        dirs,
+        big_mb,
+        num_blocks,
+        image.display()
+    );
+
+    let mut ids = Vec::with_capacity(files as usize);
+    let ((), elapsed) = timed(|| {
+        for d in 0..dirs {
+            fs.mkdir(&format!("/d{}", d))?;
+        }
+        for i in 0..files {
+            ids.push(fs.create(&path(i))?);
+        }
+        return fs.sync();
+    })?;
+    report("create", files, "files", elapsed, 0);
+
+    let ((), elapsed) = timed(|| {
+        for i in 0..files {
+            if fs.lookup(&path(i))? != ids[i as usize] {
+                return Err(io::Error::new(io::ErrorKind::InvalidData, path(i)));
+            }
+        }
+        return Ok(());
+    })?;
+    report("lookup", files, "paths", elapsed, 0);
+
+    let (listed, elapsed) = timed(|| {
+        let mut listed = 0;
+        for d in 0..dirs {
+            listed += fs.readdir(fs.lookup(&format!("/d{}", d))?)?.len() as u64;
+        }
+        return Ok(listed);
+    })?;
+    assert_eq!(listed, files);
+    report("list", listed, "entries", elapsed, 0);
+
+    let data = vec![0x5Au8; SMALL_SIZE];
+    let ((), elapsed) = timed(|| {
+        for i in 0..small {
+            fs.write_to_file(ids[i as usize], &data)?;
+        }
+        return fs.sync();
+    })?;
+    report("write small", small, "files", elapsed, small * SMALL_SIZE as u64);
+
+    let ((), elapsed) = timed(|| {
+        let mut buf = vec![0u8; SMALL_SIZE];
+        for i in 0..small {
+            if fs.read_at(ids[i as usize], 0, &mut buf)? != SMALL_SIZE || buf != data {
+                return Err(io::Error::new(io::ErrorKind::InvalidData, path(i)));
+            }
+        }
+        return Ok(());
+    })?;
+    report("read small", small, "files", elapsed, small * SMALL_SIZE as u64);
+
+    let file = fs.create("/big")?;
+    let chunk: Vec<u8> = (0..APPEND_SIZE).map(|i| (i / BLOCK_SIZE) as u8).collect();
+    let appends = big / APPEND_SIZE as u64;
+    let ((), elapsed) = timed(|| {
+        for _ in 0..appends {
+            fs.append(file, &chunk)?;
+        }
+        return fs.sync();
+    })?;
+    report("write big", appends, "MBs", elapsed, big);
+
+    let (whole, elapsed) = timed(|| fs.read_file(file))?;
+    assert_eq!(whole.len() as u64, big);
+    drop(whole);
+    report("read_file big", 1, "files", elapsed, big);
+
+    let ((), elapsed) = timed(|| {
+        let mut buf = vec![0u8; APPEND_SIZE];
+        for k in 0..appends {
+            fs.read_at(file, k * APPEND_SIZE as u64, &mut buf)?;
+        }
+        return Ok(());
+    })?;
+    report("read_at big", appends, "MBs", elapsed, big);
+
+    let (streamed, elapsed) = timed(|| {
+        let mut reader = fs.reader(file)?;
+        let mut streamed = 0u64;
+        while let Some(slice) = reader.next_chunk()? {
+            streamed += slice.len() as u64;
+        }
+        return Ok(streamed);
+    })?;
+    assert_eq!(streamed, big);
+    report("stream big", streamed / bs, "blocks", elapsed, big);
+
+    let ((), elapsed) = timed(|| {
+        let mut reader = fs.reader(file)?;
+        let mut buf = vec![0u8; 64 * 1024];
+        while reader.read(&mut buf)? > 0 {}
+        return Ok(());
+    })?;
+    report("Read::read big", big / bs, "blocks", elapsed, big);
+
+    let ((), elapsed) = timed(|| {
+        let mut buf = [0u8; BLOCK_SIZE];
+        let mut x: u64 = 0x9E3779B97F4A7C15;
+        for _ in 0..RANDOM_READS {
+            x ^= x << 13;
+            x ^= x >> 7;
+            x ^= x << 17;
+            let block = x % (big / bs);
+            fs.read_at(file, block * bs, &mut buf)?;
+            if buf[0] != (block % (APPEND_SIZE as u64 / bs)) as u8 {
+                return Err(io::Error::new(io::ErrorKind::InvalidData, "random read"));
+            }
+        }
+        return Ok(());
+    })?;
+    report("random read_at", RANDOM_READS, "blocks", elapsed, RANDOM_READS * bs);
+
+    let cache = fs.cache_stats();
+    let journal = fs.journal_stats();
+    println!(
+        "cache hits {} misses {} evictions {}; journal commits {} blocks logged {}",
+        cache.hits, cache.misses, cache.evictions, journal.commits, journal.logged_blocks
+    );
+    drop(fs);
+    fs::remove_file(&image)?;
+    return Ok(());
+}
@@ -0,0 +1,130 @@
+use std::env;
+use std::io;
+use std::sync::Arc;
+use std::thread;
+use std::time::{Duration, Instant};
+
+use final_project::disk::{MemDisk, BLOCK_SIZE};
+use final_project::FileSystem;
+
+// usage: stress [files per thread] [file size] [max threads]
+//
+// Runs the same workload with 1, 2, 4, ... threads up to the number of
+// cores (or max threads), each time on a fresh in-memory file system shared by all threads.
+// Every thread creates files in a directory of its own, writes them, then
+// reads them back by path and checks the contents. At the end the device
+// is mounted again and every file is counted.
+fn main() -> io::Result<()> {
+    let mut args = env::args().skip(1);
+    let files: u64 = args.next().map_or(2000, |a| a.parse().expect("files per thread"));
+    let size: usize = args.next().map_or(16384, |a| a.parse().expect("file size"));
+    let cores = thread::available_parallelism().map_or(1, |n| n.get());
+    let max_threads: usize = args.next().map_or(cores, |a| a.parse().expect("max threads"));
+
+    let mut counts = vec![1];
+    while counts.last().unwrap() * 2 <= max_threads {
+        counts.push(counts.last().unwrap() * 2);
+    }
+    if *counts.last().unwrap() != max_threads {
+        counts.push(max_threads);
+    }
+
+    println!("{} files of {} bytes per thread, {} cores", files, size, cores);
+    println!(
+        "{:>8} {:>14} {:>14} {:>14} {:>10} {:>10}",
+        "threads", "create/s", "write MB/s", "read MB/s", "commits", "hit rate"
+    );
+    for &threads in &counts {
+        run(threads, files, size)?;
+    }
+    return Ok(());
+}
+
+fn rate(count: f64, elapsed: Duration) -> f64 {
+    return count / elapsed.as_secs_f64().max(1e-9);
+}
+
+// Contents of file `i` of thread `t`, so a misplaced block shows up
+fn pattern(t: usize, i: u64, size: usize) -> Vec<u8> {
+    return (0..size).map(|k| (t as u64 * 31 + i * 7 + k as u64 / 512) as u8).collect();
+}
+
+fn run(threads: usize, files: u64, size: usize) -> io::Result<()> {
+    let blocks_per_file = (size as u64 + BLOCK_SIZE as u64 - 1) / BLOCK_SIZE as u64 + 1;
+    let num_blocks = threads as u64 * files * blocks_per_file * 5 / 4 + 8 * files * threads as u64 / 4 + 65536;
+    let device = Arc::new(MemDisk::new(num_blocks));
+    let fs = FileSystem::format(device.clone())?;
+
+    // Each phase runs `op(thread, file)` on every thread and returns the
+    // wall-clock time for all of them
+    let phase = |op: &(dyn Fn(usize, u64) -> io::Result<()> + Sync)| -> io::Result<Duration> {
+        let start = Instant::now();
+        thread::scope(|scope| {
+            let workers: Vec<_> = (0..threads)
+                .map(|t| {
+                    return scope.spawn(move || -> io::Result<()> {
+                        for i in 0..files {
+                            op(t, i)?;
+                        }
+                        return Ok(());
+                    });
+                })
+                .collect();
+            for worker in workers {
+                worker.join().expect("worker panicked")?;
+            }
+            return Ok::<(), io::Error>(());
+        })?;
+        return Ok(start.elapsed());
+    };
+
+    for t in 0..threads {
+        fs.mkdir(&format!("/t{}", t))?;
+    }
+    let create = phase(&|t, i| {
+        fs.create(&format!("/t{}/f{}", t, i))?;
+        return Ok(());
+    })?;
+    let write = phase(&|t, i| {
+        let id = fs.lookup(&format!("/t{}/f{}", t, i))?;
+        return fs.write_to_file(id, &pattern(t, i, size));
+    })?;
+    fs.sync()?;
+    let read = phase(&|t, i| {
+        let id = fs.lookup(&format!("/t{}/f{}", t, i))?;
+        if fs.read_file(id)? != pattern(t, i, size) {
+            return Err(io::Error::new(
+                io::ErrorKind::InvalidData,
+                format!("/t{}/f{} read back wrong", t, i),
+            ));
+        }
+        return Ok(());
+    })?;
+
+    let total = (threads as u64 * files) as f64;
+    let megabytes = total * size as f64 / (1024.0 * 1024.0);
+    let cache = fs.cache_stats();
+    println!(
+        "{:>8} {:>14.0} {:>14.1} {:>14.1} {:>10} {:>9.1}%",
+        threads,
+        rate(total, create),
+        rate(megabytes, write),
+        rate(megabytes, read),
+        fs.journal_stats().commits,
+        100.0 * cache.hits as f64 / (cache.hits + cache.misses).max(1) as f64
+    );
+    drop(fs);
+
+    // Everything must survive an unmount and mount
+    let fs = FileSystem::mount(device)?;
+    for t in 0..threads {
+        let found = fs.readdir(fs.lookup(&format!("/t{}", t))?)?.len() as u64;
+        if found != files {
+            return Err(io::Error::new(
+                io::ErrorKind::InvalidData,
+                format!("/t{} holds {} files after mounting, not {}", t, found, files),
+            ));
+        }
+    }
+    return Ok(());
+}
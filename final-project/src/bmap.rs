@@ -0,0 +1,376 @@
+// Mapping from a file's block numbers to disk blocks.
+//
+// The first NUM_DIRECT_POINTERS blocks hang off the inode directly. After
+// them come a single, a double and a triple indirect tree; each pointer
+// block holds PTRS_PER_BLOCK block numbers (0 = hole), for a maximum file
+// size of about 512 GB with 4 KB blocks.
+
+use std::collections::{BTreeSet, HashMap};
+use std::io;
+
+use crate::alloc::{no_space, BlockAllocator};
+use crate::disk::{BlockDevice, BLOCK_SIZE};
+use crate::journal::Journal;
+use crate::layout::{
+    get_u64, put_u64, FileType, Inode, NUM_DIRECT_POINTERS, NUM_INDIRECT_POINTERS, PTRS_PER_BLOCK,
+};
+
+pub const MAX_FILE_BLOCKS: u64 = NUM_DIRECT_POINTERS as u64
+    + PTRS_PER_BLOCK
+    + PTRS_PER_BLOCK * PTRS_PER_BLOCK
+    + PTRS_PER_BLOCK * PTRS_PER_BLOCK * PTRS_PER_BLOCK;
+
+// File blocks covered by one pointer at `depth` levels above the data
+fn span(depth: u32) -> u64 {
+    return PTRS_PER_BLOCK.pow(depth);
+}
+
+// First file block covered by indirect tree `level` (0 = single)
+fn tree_base(level: usize) -> u64 {
+    let mut base = NUM_DIRECT_POINTERS as u64;
+    for l in 0..level {
+        base += span(l as u32 + 1);
+    }
+    return base;
+}
+
+enum Slot {
+    Direct(usize),
+    // Indirect tree (0 = single) and the block's index inside that tree
+    Tree(usize, u64),
+}
+
+fn slot(n: u64) -> Option<Slot> {
+    if n < NUM_DIRECT_POINTERS as u64 {
+        return Some(Slot::Direct(n as usize));
+    }
+    for level in 0..NUM_INDIRECT_POINTERS {
+        let base = tree_base(level);
+        if n < base + span(level as u32 + 1) {
+            return Some(Slot::Tree(level, n - base));
+        }
+    }
+    return None;
+}
+
+pub fn read_pointers(device: &dyn BlockDevice, block: u64) -> io::Result<Vec<u64>> {
+    let mut buf = [0u8; BLOCK_SIZE];
+    device.read_block(block, &mut buf)?;
+    return Ok(buf.chunks_exact(8).map(|c| get_u64(c, 0)).collect());
+}
+
+pub fn write_pointers(device: &dyn BlockDevice, block: u64, pointers: &[u64]) -> io::Result<()> {
+    let mut buf = [0u8; BLOCK_SIZE];
+    for (i, pointer) in pointers.iter().enumerate() {
+        put_u64(&mut buf, i * 8, *pointer);
+    }
+    return device.write_block(block, &buf);
+}
+
+// Walks (and grows) the pointer trees of inodes. Pointer blocks are read
+// once and kept for the life of the mapper; changed ones are written back
+// by flush().
+pub struct BlockMapper<'a> {
+    device: &'a dyn BlockDevice,
+    blocks: HashMap<u64, Vec<u64>>,
+    dirty: BTreeSet<u64>,
+}
+
+impl<'a> BlockMapper<'a> {
+    pub fn new(device: &'a dyn BlockDevice) -> Self {
+        return Self {
+            device,
+            blocks: HashMap::new(),
+            dirty: BTreeSet::new(),
+        };
+    }
+
+    fn pointers(&mut self, block: u64) -> io::Result<&mut Vec<u64>> {
+        if !self.blocks.contains_key(&block) {
+            let pointers = read_pointers(self.device, block)?;
+            self.blocks.insert(block, pointers);
+        }
+        return Ok(self.blocks.get_mut(&block).unwrap());
+    }
+
+    fn new_pointer_block(&mut self, allocator: &BlockAllocator, goal: u64) -> io::Result<u64> {
+        let (block, _) = allocator.allocate(goal, 1).ok_or_else(no_space)?;
+        self.blocks.insert(block, vec![0; PTRS_PER_BLOCK as usize]);
+        self.dirty.insert(block);
+        return Ok(block);
+    }
+
+    // Disk block holding file block `n`, or None for a hole
+    pub fn lookup(&mut self, inode: &Inode, n: u64) -> io::Result<Option<u64>> {
+        let (level, index) = match slot(n) {
+            None => return Ok(None),
+            Some(Slot::Direct(i)) => return Ok(inode.direct_pointers[i]),
+            Some(Slot::Tree(level, index)) => (level, index),
+        };
+        let mut block = match inode.indirect_pointers[level] {
+            Some(block) => block,
+            None => return Ok(None),
+        };
+        for depth in (0..=level as u32).rev() {
+            let i = (index / span(depth) % PTRS_PER_BLOCK) as usize;
+            block = self.pointers(block)?[i];
+            if block == 0 {
+                return Ok(None);
+            }
+        }
+        return Ok(Some(block));
+    }
+
+    // Point file block `n` at disk block `data`, allocating pointer blocks
+    // on the way down (placed after `data` so they do not split a run)
+    pub fn map(
+        &mut self,
+        inode: &mut Inode,
+        n: u64,
+        data: u64,
+        allocator: &BlockAllocator,
+    ) -> io::Result<()> {
+        let (level, index) = match slot(n) {
+            None => {
+                return Err(io::Error::new(
+                    io::ErrorKind::FileTooLarge,
+                    format!("block {} is past the largest file size", n),
+                ))
+            }
+            Some(Slot::Direct(i)) => {
+                inode.direct_pointers[i] = Some(data);
+                return Ok(());
+            }
+            Some(Slot::Tree(level, index)) => (level, index),
+        };
+        let mut block = match inode.indirect_pointers[level] {
+            Some(block) => block,
+            None => {
+                let block = self.new_pointer_block(allocator, data + 1)?;
+                inode.indirect_pointers[level] = Some(block);
+                block
+            }
+        };
+        for depth in (0..=level as u32).rev() {
+            let i = (index / span(depth) % PTRS_PER_BLOCK) as usize;
+            if depth == 0 {
+                self.pointers(block)?[i] = data;
+                self.dirty.insert(block);
+                break;
+            }
+            let mut next = self.pointers(block)?[i];
+            if next == 0 {
+                next = self.new_pointer_block(allocator, data + 1)?;
+                self.pointers(block)?[i] = next;
+                self.dirty.insert(block);
+            }
+            block = next;
+        }
+        return Ok(());
+    }
+
+    // Turn file block `n` back into a hole. The pointer blocks above it
+    // stay; a truncate frees them once they are empty.
+    pub fn unmap(&mut self, inode: &mut Inode, n: u64) -> io::Result<()> {
+        let (level, index) = match slot(n) {
+            None => return Ok(()),
+            Some(Slot::Direct(i)) => {
+                inode.direct_pointers[i] = None;
+                return Ok(());
+            }
+            Some(Slot::Tree(level, index)) => (level, index),
+        };
+        let mut block = match inode.indirect_pointers[level] {
+            Some(block) => block,
+            None => return Ok(()),
+        };
+        for depth in (0..=level as u32).rev() {
+            let i = (index / span(depth) % PTRS_PER_BLOCK) as usize;
+            if depth == 0 {
+                self.pointers(block)?[i] = 0;
+                self.dirty.insert(block);
+                break;
+            }
+            block = self.pointers(block)?[i];
+            if block == 0 {
+                return Ok(());
+            }
+        }
+        return Ok(());
+    }
+
+    pub fn flush(&mut self) -> io::Result<()> {
+        for block in std::mem::take(&mut self.dirty) {
+            write_pointers(self.device, block, &self.blocks[&block])?;
+        }
+        return Ok(());
+    }
+}
+
+// Free a block in the running transaction. Blocks written through the
+// journal are revoked too, so no logged copy is replayed or checkpointed
+// over their next owner.
+pub fn release(journal: &Journal, allocator: &BlockAllocator, block: u64, logged: bool) {
+    if logged {
+        journal.revoke(block);
+    }
+    allocator.free(block, 1, journal.running_tid());
+}
+
+// Free the data blocks at file index >= `keep` under the tree rooted at
+// `block` (`depth` levels of pointer blocks, first covered index `base`),
+// and every pointer block left empty. `logged` says whether the data
+// blocks go through the journal. Returns true if `block` itself was freed.
+fn truncate_tree(
+    journal: &Journal,
+    allocator: &BlockAllocator,
+    block: u64,
+    depth: u32,
+    base: u64,
+    keep: u64,
+    logged: bool,
+) -> io::Result<bool> {
+    if depth == 0 {
+        if base >= keep {
+            release(journal, allocator, block, logged);
+            return Ok(true);
+        }
+        return Ok(false);
+    }
+    let mut pointers = read_pointers(journal, block)?;
+    let child_span = span(depth - 1);
+    let mut changed = false;
+    for (i, pointer) in pointers.iter_mut().enumerate() {
+        let child_base = base + i as u64 * child_span;
+        if *pointer == 0 || child_base + child_span <= keep {
+            continue;
+        }
+        if truncate_tree(journal, allocator, *pointer, depth - 1, child_base, keep, logged)? {
+            *pointer = 0;
+            changed = true;
+        }
+    }
+    if pointers.iter().all(|&p| p == 0) {
+        release(journal, allocator, block, true);
+        return Ok(true);
+    }
+    if changed {
+        write_pointers(journal, block, &pointers)?;
+    }
+    return Ok(false);
+}
+
+// Release every block of `inode` from file block `keep` on
+pub fn truncate_blocks(
+    journal: &Journal,
+    allocator: &BlockAllocator,
+    inode: &mut Inode,
+    keep: u64,
+) -> io::Result<()> {
+    // Directory contents are metadata and go through the journal
+    let logged = inode.file_type == FileType::Directory;
+    for i in (keep.min(NUM_DIRECT_POINTERS as u64) as usize)..NUM_DIRECT_POINTERS {
+        if let Some(block) = inode.direct_pointers[i].take() {
+            release(journal, allocator, block, logged);
+        }
+    }
+    for level in 0..NUM_INDIRECT_POINTERS {
+        if let Some(root) = inode.indirect_pointers[level] {
+            if truncate_tree(journal, allocator, root, level as u32 + 1, tree_base(level), keep, logged)? {
+                inode.indirect_pointers[level] = None;
+            }
+        }
+    }
+    return Ok(());
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::disk::MemDisk;
+    use crate::layout::{Bitmap, FileType};
+
+    const DATA_START: u64 = 4;
+
+    fn allocator(blocks: u64) -> BlockAllocator {
+        let mut bitmap = Bitmap::new(blocks);
+        bitmap.set_range(0, DATA_START, true);
+        return BlockAllocator::new(bitmap, DATA_START);
+    }
+
+    // The first and last file block of every part of the tree
+    fn boundaries() -> Vec<u64> {
+        let direct = NUM_DIRECT_POINTERS as u64;
+        return vec![
+            0,
+            direct - 1,
+            tree_base(0),
+            tree_base(1) - 1,
+            tree_base(1),
+            tree_base(2) - 1,
+            tree_base(2),
+            MAX_FILE_BLOCKS - 1,
+        ];
+    }
+
+    #[test]
+    fn map_and_lookup_across_trees() {
+        let disk = MemDisk::new(1024);
+        let allocator = allocator(1024);
+        let free = allocator.free_blocks();
+        let mut inode = Inode::new(1, "f", FileType::RegularFile);
+        let mut mapper = BlockMapper::new(&disk);
+        let mut mapped = Vec::new();
+        for n in boundaries() {
+            let (block, _) = allocator.allocate(0, 1).unwrap();
+            mapper.map(&mut inode, n, block, &allocator).unwrap();
+            mapped.push((n, block));
+        }
+        mapper.flush().unwrap();
+        // 1 single, 1 + 2 double and 1 + 2 + 2 triple pointer blocks
+        assert_eq!(free - allocator.free_blocks(), mapped.len() as u64 + 9);
+
+        let mut mapper = BlockMapper::new(&disk);
+        for &(n, block) in &mapped {
+            assert_eq!(mapper.lookup(&inode, n).unwrap(), Some(block), "file block {}", n);
+        }
+        for n in [1, tree_base(0) + 1, tree_base(1) + 1, tree_base(2) + 1, tree_base(2) - 2] {
+            assert_eq!(mapper.lookup(&inode, n).unwrap(), None, "file block {}", n);
+        }
+        assert_eq!(mapper.lookup(&inode, MAX_FILE_BLOCKS).unwrap(), None);
+        let e = mapper.map(&mut inode, MAX_FILE_BLOCKS, 100, &allocator).err().unwrap();
+        assert_eq!(e.kind(), io::ErrorKind::FileTooLarge);
+    }
+
+    #[test]
+    fn unmap_leaves_a_hole() {
+        let disk = MemDisk::new(256);
+        let allocator = allocator(256);
+        let mut inode = Inode::new(1, "f", FileType::RegularFile);
+        let mut mapper = BlockMapper::new(&disk);
+        let n = tree_base(1) + 3;
+        mapper.map(&mut inode, 2, 50, &allocator).unwrap();
+        mapper.map(&mut inode, n, 51, &allocator).unwrap();
+        mapper.map(&mut inode, n + 1, 52, &allocator).unwrap();
+        mapper.unmap(&mut inode, 2).unwrap();
+        mapper.unmap(&mut inode, n).unwrap();
+        // Unmapping a hole is a no-op
+        mapper.unmap(&mut inode, tree_base(2)).unwrap();
+        mapper.flush().unwrap();
+
+        let mut mapper = BlockMapper::new(&disk);
+        assert_eq!(mapper.lookup(&inode, 2).unwrap(), None);
+        assert_eq!(mapper.lookup(&inode, n).unwrap(), None);
+        assert_eq!(mapper.lookup(&inode, n + 1).unwrap(), Some(52));
+    }
+
+    #[test]
+    fn pointer_blocks_follow_the_data() {
+        let disk = MemDisk::new(256);
+        let allocator = allocator(256);
+        let mut inode = Inode::new(1, "f", FileType::RegularFile);
+        let mut mapper = BlockMapper::new(&disk);
+        mapper.map(&mut inode, tree_base(0), 100, &allocator).unwrap();
+        assert_eq!(inode.indirect_pointers[0], Some(101));
+    }
+}
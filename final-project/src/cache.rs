@@ -0,0 +1,545 @@
+// Buffer cache between the file system (and its journal) and the device.
+//
+// A fixed number of block frames, replaced with the CLOCK algorithm: every
+// hit sets the frame's reference bit and the hand clears bits until it
+// finds a frame that has not been used since its last pass, which tracks
+// LRU closely without reordering anything on a hit.
+//
+// Writes are write-back. Dirty frames go to the device in batches (sorted,
+// consecutive blocks merged into one request) when a dirty frame is
+// evicted, when half the cache is dirty, and on sync(). Since nothing is
+// promised durable before sync(), the journal's ordering still holds.
+//
+// Reads that continue where an earlier read stopped are treated as a
+// sequential stream; a miss in a stream fetches a read-ahead window past
+// the request with the same device call, doubling the window up to
+// MAX_READAHEAD while the stream lasts. Requests of BYPASS_BLOCKS or more
+// go straight to the device so a large file does not wipe out the cache.
+// The cache lock is not held during such a read; cached frames of the
+// range are kept from eviction meanwhile and copied over the result, since
+// a frame always holds the newest copy of its block.
+
+use std::collections::HashMap;
+use std::io;
+use std::sync::{Arc, Mutex};
+
+use crate::disk::{BlockDevice, BLOCK_SIZE};
+
+const BYPASS_BLOCKS: usize = 64;
+const MIN_READAHEAD: u64 = 8;
+const MAX_READAHEAD: u64 = 64;
+// Sequential streams tracked at once
+const STREAMS: usize = 8;
+
+#[derive(Clone, Debug, Default)]
+pub struct CacheStats {
+    pub hits: u64,
+    pub misses: u64,
+    pub evictions: u64,
+    // Blocks written back, and the device requests that took
+    pub writebacks: u64,
+    pub writeback_requests: u64,
+    pub readahead_blocks: u64,
+    // Read-ahead blocks later hit
+    pub readahead_hits: u64,
+    pub bypassed_blocks: u64,
+}
+
+struct Frame {
+    block: u64,
+    data: Box<[u8]>,
+    dirty: bool,
+    referenced: bool,
+    // Brought in by read-ahead and not used yet
+    prefetched: bool,
+}
+
+#[derive(Clone, Copy)]
+struct Stream {
+    next: u64,
+    window: u64,
+}
+
+struct CacheState {
+    frames: Vec<Frame>,
+    map: HashMap<u64, usize>,
+    hand: usize,
+    dirty: usize,
+    streams: [Stream; STREAMS],
+    // Stream slot to replace next
+    oldest: usize,
+    // Block ranges [start, end) being read past the cache
+    reading: Vec<(u64, u64)>,
+    stats: CacheStats,
+}
+
+pub struct BufferCache {
+    device: Arc<dyn BlockDevice>,
+    capacity: usize,
+    state: Mutex<CacheState>,
+}
+
+impl BufferCache {
+    pub fn new(device: Arc<dyn BlockDevice>, capacity: usize) -> Self {
+        return Self {
+            device,
+            capacity: capacity.max(1),
+            state: Mutex::new(CacheState {
+                frames: Vec::new(),
+                map: HashMap::new(),
+                hand: 0,
+                dirty: 0,
+                streams: [Stream { next: u64::MAX, window: 0 }; STREAMS],
+                oldest: 0,
+                reading: Vec::new(),
+                stats: CacheStats::default(),
+            }),
+        };
+    }
+
+    pub fn capacity(&self) -> usize {
+        return self.capacity;
+    }
+
+    pub fn stats(&self) -> CacheStats {
+        return self.state.lock().unwrap().stats.clone();
+    }
+
+    // Write every dirty frame without syncing the device
+    pub fn flush(&self) -> io::Result<()> {
+        let mut state = self.state.lock().unwrap();
+        return self.write_back_locked(&mut state);
+    }
+
+    fn write_back_locked(&self, state: &mut CacheState) -> io::Result<()> {
+        if state.dirty == 0 {
+            return Ok(());
+        }
+        let mut dirty: Vec<(u64, usize)> = state
+            .frames
+            .iter()
+            .enumerate()
+            .filter(|(_, frame)| frame.dirty)
+            .map(|(i, frame)| (frame.block, i))
+            .collect();
+        dirty.sort_unstable();
+        let mut buf = Vec::new();
+        let mut i = 0;
+        while i < dirty.len() {
+            let mut j = i + 1;
+            while j < dirty.len() && dirty[j].0 == dirty[j - 1].0 + 1 {
+                j += 1;
+            }
+            buf.clear();
+            for &(_, frame) in &dirty[i..j] {
+                buf.extend_from_slice(&state.frames[frame].data);
+            }
+            self.device.write_blocks(dirty[i].0, &buf)?;
+            for &(_, frame) in &dirty[i..j] {
+                state.frames[frame].dirty = false;
+            }
+            state.dirty -= j - i;
+            state.stats.writebacks += (j - i) as u64;
+            state.stats.writeback_requests += 1;
+            i = j;
+        }
+        return Ok(());
+    }
+
+    // A frame for `block`, which must not be cached yet. The frame is
+    // taken from the free pool or from the CLOCK victim; if every frame is
+    // being read past the cache, the cache grows for the moment.
+    fn frame_for(&self, state: &mut CacheState, block: u64) -> io::Result<usize> {
+        let victim = match state.frames.len() < self.capacity {
+            true => None,
+            false => Self::victim(state),
+        };
+        let index = match victim {
+            Some(hand) => {
+                if state.frames[hand].dirty {
+                    self.write_back_locked(state)?;
+                }
+                let old = state.frames[hand].block;
+                state.map.remove(&old);
+                state.stats.evictions += 1;
+                let frame = &mut state.frames[hand];
+                frame.block = block;
+                frame.prefetched = false;
+                hand
+            }
+            None => {
+                state.frames.push(Frame {
+                    block,
+                    data: vec![0u8; BLOCK_SIZE].into_boxed_slice(),
+                    dirty: false,
+                    referenced: false,
+                    prefetched: false,
+                });
+                state.frames.len() - 1
+            }
+        };
+        state.map.insert(block, index);
+        return Ok(index);
+    }
+
+    // Advance the CLOCK hand to a frame not used since its last pass.
+    // Frames of a range being read past the cache are skipped: their copy
+    // is still to be laid over the device's.
+    fn victim(state: &mut CacheState) -> Option<usize> {
+        for _ in 0..2 * state.frames.len() {
+            let hand = state.hand;
+            state.hand = (hand + 1) % state.frames.len();
+            let block = state.frames[hand].block;
+            if state.reading.iter().any(|&(start, end)| block >= start && block < end) {
+                continue;
+            }
+            let frame = &mut state.frames[hand];
+            if frame.referenced {
+                frame.referenced = false;
+                continue;
+            }
+            return Some(hand);
+        }
+        return None;
+    }
+
+    // Read-ahead window for a read of `count` blocks at `start`: 0 unless
+    // the read continues a known stream
+    fn track_stream(state: &mut CacheState, start: u64, count: u64) -> u64 {
+        for stream in state.streams.iter_mut() {
+            if stream.next == start {
+                stream.next = start + count;
+                stream.window = (stream.window * 2).clamp(MIN_READAHEAD, MAX_READAHEAD);
+                return stream.window;
+            }
+        }
+        let slot = state.oldest;
+        state.oldest = (slot + 1) % STREAMS;
+        state.streams[slot] = Stream { next: start + count, window: 0 };
+        return 0;
+    }
+
+    // Copy the cached blocks of a range read from the device over what the
+    // device returned. Clean frames too: one may have been written back
+    // after the device read its block.
+    fn overlay_cached(state: &CacheState, start: u64, buf: &mut [u8]) {
+        for (i, chunk) in buf.chunks_exact_mut(BLOCK_SIZE).enumerate() {
+            if let Some(&frame) = state.map.get(&(start + i as u64)) {
+                chunk.copy_from_slice(&state.frames[frame].data);
+            }
+        }
+    }
+}
+
+impl BlockDevice for BufferCache {
+    fn num_blocks(&self) -> u64 {
+        return self.device.num_blocks();
+    }
+
+    fn read_block(&self, block: u64, buf: &mut [u8]) -> io::Result<()> {
+        return self.read_blocks(block, buf);
+    }
+
+    fn write_block(&self, block: u64, buf: &[u8]) -> io::Result<()> {
+        return self.write_blocks(block, buf);
+    }
+
+    fn sync(&self) -> io::Result<()> {
+        self.flush()?;
+        return self.device.sync();
+    }
+
+    fn read_blocks(&self, start: u64, buf: &mut [u8]) -> io::Result<()> {
+        let count = buf.len() / BLOCK_SIZE;
+        let mut state = self.state.lock().unwrap();
+        let window = Self::track_stream(&mut state, start, count as u64);
+        if count == 0 || count >= BYPASS_BLOCKS || buf.len() % BLOCK_SIZE != 0 {
+            // Other threads can use the cache during a large transfer
+            let range = (start, start + count as u64);
+            state.reading.push(range);
+            drop(state);
+            let result = self.device.read_blocks(start, buf);
+            let mut state = self.state.lock().unwrap();
+            let at = state.reading.iter().position(|&r| r == range).unwrap();
+            state.reading.swap_remove(at);
+            result?;
+            Self::overlay_cached(&state, start, buf);
+            state.stats.bypassed_blocks += count as u64;
+            return Ok(());
+        }
+
+        let mut i = 0;
+        while i < count {
+            let block = start + i as u64;
+            if let Some(&index) = state.map.get(&block) {
+                let frame = &mut state.frames[index];
+                frame.referenced = true;
+                buf[i * BLOCK_SIZE..(i + 1) * BLOCK_SIZE].copy_from_slice(&frame.data);
+                if frame.prefetched {
+                    frame.prefetched = false;
+                    state.stats.readahead_hits += 1;
+                }
+                state.stats.hits += 1;
+                i += 1;
+                continue;
+            }
+            // Fetch the run of missing blocks in one request, extended by
+            // the read-ahead window when it reaches the end of the read
+            let mut j = i + 1;
+            while j < count && !state.map.contains_key(&(start + j as u64)) {
+                j += 1;
+            }
+            let mut fetch = (j - i) as u64;
+            if j == count && window > 0 {
+                let end = (start + count as u64 + window).min(self.device.num_blocks());
+                let mut next = start + count as u64;
+                while next < end && !state.map.contains_key(&next) {
+                    next += 1;
+                }
+                fetch = next - block;
+            }
+            let mut data = vec![0u8; fetch as usize * BLOCK_SIZE];
+            self.device.read_blocks(block, &mut data)?;
+            state.stats.misses += (j - i) as u64;
+            state.stats.readahead_blocks += fetch - (j - i) as u64;
+            buf[i * BLOCK_SIZE..j * BLOCK_SIZE].copy_from_slice(&data[..(j - i) * BLOCK_SIZE]);
+            for (k, chunk) in data.chunks_exact(BLOCK_SIZE).enumerate() {
+                let index = self.frame_for(&mut state, block + k as u64)?;
+                let frame = &mut state.frames[index];
+                frame.data.copy_from_slice(chunk);
+                frame.referenced = k < j - i;
+                frame.prefetched = k >= j - i;
+            }
+            i = j;
+        }
+        return Ok(());
+    }
+
+    fn write_blocks(&self, start: u64, buf: &[u8]) -> io::Result<()> {
+        let count = buf.len() / BLOCK_SIZE;
+        if start + count as u64 > self.device.num_blocks() {
+            return Err(io::Error::new(
+                io::ErrorKind::InvalidInput,
+                format!("blocks {}..{} out of range", start, start + count as u64),
+            ));
+        }
+        if count == 0 || count >= BYPASS_BLOCKS || buf.len() % BLOCK_SIZE != 0 {
+            // Bring cached copies up to date, and clean, before the device
+            // write rather than after: once a frame is clean no write-back
+            // (by any thread) can put its older contents over this write
+            // while the cache lock is not held.
+            let mut state = self.state.lock().unwrap();
+            for (i, chunk) in buf.chunks_exact(BLOCK_SIZE).enumerate() {
+                if let Some(&index) = state.map.get(&(start + i as u64)) {
+                    let frame = &mut state.frames[index];
+                    frame.data.copy_from_slice(chunk);
+                    if frame.dirty {
+                        frame.dirty = false;
+                        state.dirty -= 1;
+                    }
+                }
+            }
+            state.stats.bypassed_blocks += count as u64;
+            drop(state);
+            return self.device.write_blocks(start, buf);
+        }
+        let mut state = self.state.lock().unwrap();
+        for (i, chunk) in buf.chunks_exact(BLOCK_SIZE).enumerate() {
+            let block = start + i as u64;
+            let index = match state.map.get(&block) {
+                Some(&index) => index,
+                None => self.frame_for(&mut state, block)?,
+            };
+            let frame = &mut state.frames[index];
+            frame.data.copy_from_slice(chunk);
+            frame.referenced = true;
+            frame.prefetched = false;
+            if !frame.dirty {
+                frame.dirty = true;
+                state.dirty += 1;
+            }
+        }
+        if state.dirty * 2 > self.capacity {
+            self.write_back_locked(&mut state)?;
+        }
+        return Ok(());
+    }
+}
+
+// Dropping the cache writes back whatever is still dirty
+impl Drop for BufferCache {
+    fn drop(&mut self) {
+        if let Err(e) = self.flush() {
+            eprintln!("Warning: buffer cache write-back failed: {}", e);
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::disk::MemDisk;
+    use std::sync::atomic::{AtomicBool, Ordering};
+    use std::sync::{OnceLock, Weak};
+
+    fn block_of(byte: u8) -> Vec<u8> {
+        return vec![byte; BLOCK_SIZE];
+    }
+
+    fn read(device: &dyn BlockDevice, block: u64) -> Vec<u8> {
+        let mut buf = vec![0u8; BLOCK_SIZE];
+        device.read_block(block, &mut buf).unwrap();
+        return buf;
+    }
+
+    fn cache(capacity: usize) -> (Arc<MemDisk>, BufferCache) {
+        let disk = Arc::new(MemDisk::new(256));
+        let cache = BufferCache::new(disk.clone(), capacity);
+        return (disk, cache);
+    }
+
+    #[test]
+    fn writes_wait_for_write_back() {
+        let (disk, cache) = cache(16);
+        cache.write_block(5, &block_of(1)).unwrap();
+        cache.write_block(6, &block_of(2)).unwrap();
+        assert_eq!(read(&*disk, 5), block_of(0));
+        assert_eq!(read(&cache, 5), block_of(1));
+        cache.sync().unwrap();
+        assert_eq!(read(&*disk, 5), block_of(1));
+        assert_eq!(read(&*disk, 6), block_of(2));
+        // Consecutive dirty blocks go out in one request
+        let stats = cache.stats();
+        assert_eq!((stats.writebacks, stats.writeback_requests), (2, 1));
+        assert_eq!(stats.hits, 1);
+    }
+
+    #[test]
+    fn eviction_keeps_dirty_data() {
+        let (disk, cache) = cache(4);
+        for block in 0..40u64 {
+            cache.write_block(block * 3, &block_of(block as u8 + 1)).unwrap();
+        }
+        for block in 0..40u64 {
+            assert_eq!(read(&cache, block * 3), block_of(block as u8 + 1));
+        }
+        assert!(cache.stats().evictions > 0);
+        drop(cache);
+        for block in 0..40u64 {
+            assert_eq!(read(&*disk, block * 3), block_of(block as u8 + 1));
+        }
+    }
+
+    #[test]
+    fn sequential_reads_fetch_ahead() {
+        let (disk, cache) = cache(128);
+        for block in 0..64u64 {
+            disk.write_block(block, &block_of(block as u8)).unwrap();
+        }
+        for block in 0..64u64 {
+            assert_eq!(read(&cache, block), block_of(block as u8));
+        }
+        let stats = cache.stats();
+        assert!(stats.readahead_blocks > 0);
+        assert_eq!(stats.hits + stats.misses, 64);
+        assert_eq!(stats.readahead_hits, stats.hits);
+        assert!(stats.misses < 8, "{} misses", stats.misses);
+        // Read-ahead stops at the end of the device
+        assert_eq!(read(&cache, 255), block_of(0));
+    }
+
+    #[test]
+    fn large_reads_see_dirty_blocks() {
+        let (disk, cache) = cache(16);
+        disk.write_blocks(0, &vec![1u8; BYPASS_BLOCKS * BLOCK_SIZE]).unwrap();
+        cache.write_block(10, &block_of(2)).unwrap();
+        let mut buf = vec![0u8; BYPASS_BLOCKS * BLOCK_SIZE];
+        cache.read_blocks(0, &mut buf).unwrap();
+        assert_eq!(&buf[10 * BLOCK_SIZE..11 * BLOCK_SIZE], &block_of(2)[..]);
+        assert_eq!(&buf[11 * BLOCK_SIZE..12 * BLOCK_SIZE], &block_of(1)[..]);
+        assert_eq!(cache.stats().bypassed_blocks, BYPASS_BLOCKS as u64);
+    }
+
+    // Runs cache traffic in the middle of the next large read, after the
+    // device has read its blocks
+    struct BusyDisk {
+        disk: MemDisk,
+        cache: OnceLock<Weak<BufferCache>>,
+        armed: AtomicBool,
+    }
+
+    impl BlockDevice for BusyDisk {
+        fn num_blocks(&self) -> u64 {
+            return self.disk.num_blocks();
+        }
+
+        fn read_block(&self, block: u64, buf: &mut [u8]) -> io::Result<()> {
+            return self.disk.read_block(block, buf);
+        }
+
+        fn write_block(&self, block: u64, buf: &[u8]) -> io::Result<()> {
+            return self.disk.write_block(block, buf);
+        }
+
+        fn sync(&self) -> io::Result<()> {
+            return self.disk.sync();
+        }
+
+        fn read_blocks(&self, start: u64, buf: &mut [u8]) -> io::Result<()> {
+            self.disk.read_blocks(start, buf)?;
+            if buf.len() >= BYPASS_BLOCKS * BLOCK_SIZE && self.armed.swap(false, Ordering::Relaxed) {
+                // Enough writes elsewhere to write back and evict every
+                // frame that could be
+                let cache = self.cache.get().unwrap().upgrade().unwrap();
+                for block in 100..120u64 {
+                    cache.write_block(block, &block_of(5)).unwrap();
+                }
+            }
+            return Ok(());
+        }
+    }
+
+    #[test]
+    fn large_reads_race_with_write_back() {
+        let disk = Arc::new(BusyDisk {
+            disk: MemDisk::new(256),
+            cache: OnceLock::new(),
+            armed: AtomicBool::new(false),
+        });
+        let cache = Arc::new(BufferCache::new(disk.clone(), 4));
+        disk.cache.set(Arc::downgrade(&cache)).unwrap();
+        cache.write_block(10, &block_of(2)).unwrap();
+        disk.armed.store(true, Ordering::Relaxed);
+        let mut buf = vec![0u8; BYPASS_BLOCKS * BLOCK_SIZE];
+        cache.read_blocks(0, &mut buf).unwrap();
+        assert_eq!(&buf[10 * BLOCK_SIZE..11 * BLOCK_SIZE], &block_of(2)[..]);
+        assert!(cache.stats().evictions > 0);
+        assert_eq!(read(&*disk, 10), block_of(2));
+    }
+
+    // A large write replaces a dirty cached copy: a later write-back must
+    // not put the older data back
+    #[test]
+    fn large_writes_replace_dirty_blocks() {
+        let (disk, cache) = cache(16);
+        cache.write_block(10, &block_of(2)).unwrap();
+        cache.write_blocks(0, &vec![3u8; BYPASS_BLOCKS * BLOCK_SIZE]).unwrap();
+        assert_eq!(read(&*disk, 10), block_of(3));
+        assert_eq!(read(&cache, 10), block_of(3));
+        cache.flush().unwrap();
+        assert_eq!(read(&*disk, 10), block_of(3));
+        assert_eq!(cache.stats().writebacks, 0);
+    }
+
+    #[test]
+    fn out_of_range() {
+        let (_disk, cache) = cache(16);
+        assert!(cache.write_block(256, &block_of(1)).is_err());
+        // A large write that fails leaves the cached copies alone
+        cache.write_block(252, &block_of(4)).unwrap();
+        assert!(cache.write_blocks(250, &vec![0u8; BYPASS_BLOCKS * BLOCK_SIZE]).is_err());
+        assert_eq!(read(&cache, 252), block_of(4));
+        let mut buf = block_of(0);
+        assert!(cache.read_block(256, &mut buf).is_err());
+    }
+}
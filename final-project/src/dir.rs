@@ -0,0 +1,302 @@
+// Directory format: a linear hash table of (name, inode) entries kept in
+// the directory's own data blocks.
+//
+//   file block 0                 header
+//   file block 1 + i             bucket i
+//   file block OVERFLOW_BASE...  overflow blocks, chained from a full bucket
+//
+// A name hashes to bucket h mod 2^level, or h mod 2^(level + 1) if that
+// bucket has already been split this round. Each time the average load
+// passes SPLIT_LOAD the bucket at `split` is split in two, so the table
+// grows one block at a time and a lookup reads one bucket (plus overflow
+// blocks only when hashes collide badly). The overflow area sits far past
+// the buckets in the sparse directory file; blocks freed by a split go on
+// a free list and are reused.
+
+use std::collections::{HashMap, VecDeque};
+
+use crate::disk::BLOCK_SIZE;
+use crate::layout::{get_u32, get_u64, put_u32, put_u64};
+
+pub const ROOT_ID: u64 = 1;
+pub const OVERFLOW_BASE: u64 = 1 << 26;
+// Average entries per bucket before the next split
+const SPLIT_LOAD: u64 = 64;
+const DIR_MAGIC: u64 = u64::from_le_bytes(*b"CPSCHDIR");
+const BUCKET_HEADER: usize = 16;
+
+// FNV-1a
+pub fn name_hash(name: &str) -> u64 {
+    let mut h: u64 = 0xCBF29CE484222325;
+    for byte in name.bytes() {
+        h = (h ^ byte as u64).wrapping_mul(0x100000001B3);
+    }
+    return h;
+}
+
+#[derive(Clone, Debug)]
+pub struct DirHeader {
+    pub level: u32,
+    pub split: u64,
+    pub buckets: u64,
+    pub entries: u64,
+    pub next_overflow: u64,
+    pub free_overflow: u64,
+}
+
+impl DirHeader {
+    pub fn new() -> Self {
+        return Self {
+            level: 0,
+            split: 0,
+            buckets: 1,
+            entries: 0,
+            next_overflow: OVERFLOW_BASE,
+            free_overflow: 0,
+        };
+    }
+
+    pub fn bucket_of(&self, hash: u64) -> u64 {
+        let bucket = hash & ((1u64 << self.level) - 1);
+        if bucket < self.split {
+            return hash & ((1u64 << (self.level + 1)) - 1);
+        }
+        return bucket;
+    }
+
+    pub fn needs_split(&self) -> bool {
+        return self.entries > self.buckets * SPLIT_LOAD && self.buckets + 1 < OVERFLOW_BASE - 1;
+    }
+
+    // Move the split pointer past the bucket just split
+    pub fn advance_split(&mut self) {
+        self.buckets += 1;
+        self.split += 1;
+        if self.split == 1u64 << self.level {
+            self.level += 1;
+            self.split = 0;
+        }
+    }
+
+    pub fn encode(&self, buf: &mut [u8]) {
+        buf.fill(0);
+        put_u64(buf, 0, DIR_MAGIC);
+        put_u32(buf, 8, self.level);
+        put_u64(buf, 16, self.split);
+        put_u64(buf, 24, self.buckets);
+        put_u64(buf, 32, self.entries);
+        put_u64(buf, 40, self.next_overflow);
+        put_u64(buf, 48, self.free_overflow);
+    }
+
+    pub fn decode(buf: &[u8]) -> Option<Self> {
+        if get_u64(buf, 0) != DIR_MAGIC {
+            return None;
+        }
+        return Some(Self {
+            level: get_u32(buf, 8),
+            split: get_u64(buf, 16),
+            buckets: get_u64(buf, 24),
+            entries: get_u64(buf, 32),
+            next_overflow: get_u64(buf, 40),
+            free_overflow: get_u64(buf, 48),
+        });
+    }
+}
+
+pub fn bucket_block(bucket: u64) -> u64 {
+    return 1 + bucket;
+}
+
+// One block of a bucket chain:
+//   0    entry count (u32)
+//   8    next block in the chain (file block, 0 = end; also links the free list)
+//   16   entries: inode id (u64), name length (u8), name
+pub struct Bucket {
+    pub entries: Vec<(String, u64)>,
+    pub next: u64,
+}
+
+impl Bucket {
+    pub fn new() -> Self {
+        return Self {
+            entries: Vec::new(),
+            next: 0,
+        };
+    }
+
+    pub fn entry_size(name: &str) -> usize {
+        return 9 + name.len();
+    }
+
+    fn used(&self) -> usize {
+        return BUCKET_HEADER + self.entries.iter().map(|(n, _)| Self::entry_size(n)).sum::<usize>();
+    }
+
+    pub fn fits(&self, name: &str) -> bool {
+        return self.used() + Self::entry_size(name) <= BLOCK_SIZE;
+    }
+
+    pub fn find(&self, name: &str) -> Option<u64> {
+        return self.entries.iter().find(|(n, _)| n == name).map(|(_, id)| *id);
+    }
+
+    pub fn encode(&self, buf: &mut [u8]) {
+        buf.fill(0);
+        put_u32(buf, 0, self.entries.len() as u32);
+        put_u64(buf, 8, self.next);
+        let mut at = BUCKET_HEADER;
+        for (name, id) in &self.entries {
+            put_u64(buf, at, *id);
+            buf[at + 8] = name.len() as u8;
+            buf[at + 9..at + 9 + name.len()].copy_from_slice(name.as_bytes());
+            at += Self::entry_size(name);
+        }
+    }
+
+    pub fn decode(buf: &[u8]) -> Self {
+        let count = get_u32(buf, 0) as usize;
+        let mut entries = Vec::with_capacity(count);
+        let mut at = BUCKET_HEADER;
+        for _ in 0..count {
+            if at + 9 > BLOCK_SIZE {
+                break;
+            }
+            let id = get_u64(buf, at);
+            let len = buf[at + 8] as usize;
+            if at + 9 + len > BLOCK_SIZE {
+                break;
+            }
+            entries.push((String::from_utf8_lossy(&buf[at + 9..at + 9 + len]).into_owned(), id));
+            at += 9 + len;
+        }
+        return Self {
+            entries,
+            next: get_u64(buf, 8),
+        };
+    }
+}
+
+// Bounded cache of (directory, name) -> inode, evicting the oldest entry.
+// Keyed by name hash so a lookup allocates nothing; on a hash collision
+// the newer name simply replaces the older one.
+pub struct DentryCache {
+    map: HashMap<(u64, u64), (String, u64)>,
+    order: VecDeque<(u64, u64)>,
+    capacity: usize,
+    pub hits: u64,
+    pub misses: u64,
+}
+
+impl DentryCache {
+    pub fn new(capacity: usize) -> Self {
+        return Self {
+            map: HashMap::new(),
+            order: VecDeque::new(),
+            capacity,
+            hits: 0,
+            misses: 0,
+        };
+    }
+
+    pub fn get(&mut self, dir: u64, name: &str) -> Option<u64> {
+        match self.map.get(&(dir, name_hash(name))) {
+            Some((cached, id)) if cached == name => {
+                self.hits += 1;
+                return Some(*id);
+            }
+            _ => {
+                self.misses += 1;
+                return None;
+            }
+        }
+    }
+
+    pub fn insert(&mut self, dir: u64, name: &str, id: u64) {
+        let key = (dir, name_hash(name));
+        if self.map.insert(key, (name.to_string(), id)).is_none() {
+            self.order.push_back(key);
+            if self.order.len() > self.capacity {
+                if let Some(old) = self.order.pop_front() {
+                    self.map.remove(&old);
+                }
+            }
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn splits_move_entries_to_the_new_bucket_only() {
+        let hashes: Vec<u64> = (0..2000).map(|i| name_hash(&format!("file{}", i))).collect();
+        let mut header = DirHeader::new();
+        for _ in 0..100 {
+            let before: Vec<u64> = hashes.iter().map(|&h| header.bucket_of(h)).collect();
+            let new = header.buckets;
+            header.advance_split();
+            for (&h, &old) in hashes.iter().zip(&before) {
+                let now = header.bucket_of(h);
+                assert!(now < header.buckets);
+                assert!(now == old || now == new, "hash {:x}: {} -> {}", h, old, now);
+            }
+        }
+        assert_eq!(header.buckets, 101);
+        assert_eq!((header.level, header.split), (6, 37));
+    }
+
+    #[test]
+    fn header_round_trip() {
+        let mut header = DirHeader::new();
+        header.advance_split();
+        header.entries = 1234;
+        header.free_overflow = OVERFLOW_BASE + 3;
+        let mut buf = [0u8; BLOCK_SIZE];
+        header.encode(&mut buf);
+        let back = DirHeader::decode(&buf).unwrap();
+        assert_eq!((back.level, back.split, back.buckets), (1, 0, 2));
+        assert_eq!(back.entries, 1234);
+        assert_eq!(back.next_overflow, OVERFLOW_BASE);
+        assert_eq!(back.free_overflow, OVERFLOW_BASE + 3);
+        assert!(DirHeader::decode(&[0u8; BLOCK_SIZE]).is_none());
+    }
+
+    #[test]
+    fn bucket_fills_one_block() {
+        let mut bucket = Bucket::new();
+        let mut n = 0;
+        loop {
+            let name = format!("{:0>128}", n);
+            if !bucket.fits(&name) {
+                break;
+            }
+            bucket.entries.push((name, n + 100));
+            n += 1;
+        }
+        assert_eq!(n as usize, (BLOCK_SIZE - BUCKET_HEADER) / Bucket::entry_size(&"x".repeat(128)));
+        bucket.next = OVERFLOW_BASE + 7;
+        let mut buf = [0u8; BLOCK_SIZE];
+        bucket.encode(&mut buf);
+        let back = Bucket::decode(&buf);
+        assert_eq!(back.entries, bucket.entries);
+        assert_eq!(back.next, OVERFLOW_BASE + 7);
+        assert_eq!(back.find(&format!("{:0>128}", 5)), Some(105));
+        assert_eq!(back.find("missing"), None);
+    }
+
+    #[test]
+    fn dentry_cache_evicts_the_oldest() {
+        let mut cache = DentryCache::new(2);
+        cache.insert(1, "a", 10);
+        cache.insert(1, "b", 11);
+        assert_eq!(cache.get(1, "a"), Some(10));
+        assert_eq!(cache.get(2, "a"), None);
+        cache.insert(1, "c", 12);
+        assert_eq!(cache.get(1, "a"), None);
+        assert_eq!(cache.get(1, "b"), Some(11));
+        assert_eq!(cache.get(1, "c"), Some(12));
+        assert_eq!((cache.hits, cache.misses), (3, 2));
+    }
+}
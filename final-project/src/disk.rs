@@ -0,0 +1,205 @@
+use std::fs::{File, OpenOptions};
+use std::io;
+use std::os::unix::fs::FileExt;
+use std::path::Path;
+use std::sync::RwLock;
+
+pub const BLOCK_SIZE: usize = 4096;
+
+// Fixed-size block storage underneath the file system. Every call takes
+// &self so that a device can be shared between threads.
+pub trait BlockDevice: Send + Sync {
+    fn num_blocks(&self) -> u64;
+    fn read_block(&self, block: u64, buf: &mut [u8]) -> io::Result<()>;
+    fn write_block(&self, block: u64, buf: &[u8]) -> io::Result<()>;
+    fn sync(&self) -> io::Result<()>;
+
+    // Consecutive blocks starting at `start`; `buf` is a whole number of
+    // blocks. Devices that can should do this in one request.
+    fn read_blocks(&self, start: u64, buf: &mut [u8]) -> io::Result<()> {
+        for (i, chunk) in buf.chunks_exact_mut(BLOCK_SIZE).enumerate() {
+            self.read_block(start + i as u64, chunk)?;
+        }
+        return Ok(());
+    }
+
+    fn write_blocks(&self, start: u64, buf: &[u8]) -> io::Result<()> {
+        for (i, chunk) in buf.chunks_exact(BLOCK_SIZE).enumerate() {
+            self.write_block(start + i as u64, chunk)?;
+        }
+        return Ok(());
+    }
+}
+
+fn check_range(start: u64, num_blocks: u64, len: usize) -> io::Result<()> {
+    if len == 0 || len % BLOCK_SIZE != 0 {
+        return Err(io::Error::new(
+            io::ErrorKind::InvalidInput,
+            format!("buffer is {} bytes, not a whole number of blocks", len),
+        ));
+    }
+    let count = (len / BLOCK_SIZE) as u64;
+    if start >= num_blocks || count > num_blocks - start {
+        return Err(io::Error::new(
+            io::ErrorKind::InvalidInput,
+            format!(
+                "blocks {}..{} out of range ({} blocks)",
+                start,
+                start + count,
+                num_blocks
+            ),
+        ));
+    }
+    return Ok(());
+}
+
+// A device kept in one flat allocation. The pages are only touched (and so
+// only backed by memory) once a block is written.
+pub struct MemDisk {
+    data: RwLock<Vec<u8>>,
+    num_blocks: u64,
+}
+
+impl MemDisk {
+    pub fn new(num_blocks: u64) -> Self {
+        return Self {
+            data: RwLock::new(vec![0; num_blocks as usize * BLOCK_SIZE]),
+            num_blocks,
+        };
+    }
+}
+
+impl BlockDevice for MemDisk {
+    fn num_blocks(&self) -> u64 {
+        return self.num_blocks;
+    }
+
+    fn read_block(&self, block: u64, buf: &mut [u8]) -> io::Result<()> {
+        return self.read_blocks(block, buf);
+    }
+
+    fn write_block(&self, block: u64, buf: &[u8]) -> io::Result<()> {
+        return self.write_blocks(block, buf);
+    }
+
+    fn sync(&self) -> io::Result<()> {
+        return Ok(());
+    }
+
+    fn read_blocks(&self, start: u64, buf: &mut [u8]) -> io::Result<()> {
+        check_range(start, self.num_blocks, buf.len())?;
+        let offset = start as usize * BLOCK_SIZE;
+        let data = self.data.read().unwrap();
+        buf.copy_from_slice(&data[offset..offset + buf.len()]);
+        return Ok(());
+    }
+
+    fn write_blocks(&self, start: u64, buf: &[u8]) -> io::Result<()> {
+        check_range(start, self.num_blocks, buf.len())?;
+        let offset = start as usize * BLOCK_SIZE;
+        let mut data = self.data.write().unwrap();
+        data[offset..offset + buf.len()].copy_from_slice(buf);
+        return Ok(());
+    }
+}
+
+// A device backed by a single image file, accessed with positioned reads
+// and writes (pread/pwrite), so there is no shared file offset to lock.
+pub struct FileDisk {
+    file: File,
+    num_blocks: u64,
+}
+
+impl FileDisk {
+    // Create (or truncate) an image of `num_blocks` blocks. The file is
+    // sparse until blocks are written.
+    pub fn create<P: AsRef<Path>>(path: P, num_blocks: u64) -> io::Result<Self> {
+        let file = OpenOptions::new()
+            .read(true)
+            .write(true)
+            .create(true)
+            .truncate(true)
+            .open(path)?;
+        file.set_len(num_blocks * BLOCK_SIZE as u64)?;
+        return Ok(Self { file, num_blocks });
+    }
+
+    pub fn open<P: AsRef<Path>>(path: P) -> io::Result<Self> {
+        let file = OpenOptions::new().read(true).write(true).open(path)?;
+        let num_blocks = file.metadata()?.len() / BLOCK_SIZE as u64;
+        return Ok(Self { file, num_blocks });
+    }
+}
+
+impl BlockDevice for FileDisk {
+    fn num_blocks(&self) -> u64 {
+        return self.num_blocks;
+    }
+
+    fn read_block(&self, block: u64, buf: &mut [u8]) -> io::Result<()> {
+        return self.read_blocks(block, buf);
+    }
+
+    fn write_block(&self, block: u64, buf: &[u8]) -> io::Result<()> {
+        return self.write_blocks(block, buf);
+    }
+
+    fn sync(&self) -> io::Result<()> {
+        return self.file.sync_data();
+    }
+
+    fn read_blocks(&self, start: u64, buf: &mut [u8]) -> io::Result<()> {
+        check_range(start, self.num_blocks, buf.len())?;
+        return self.file.read_exact_at(buf, start * BLOCK_SIZE as u64);
+    }
+
+    fn write_blocks(&self, start: u64, buf: &[u8]) -> io::Result<()> {
+        check_range(start, self.num_blocks, buf.len())?;
+        return self.file.write_all_at(buf, start * BLOCK_SIZE as u64);
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn pattern(seed: u8, blocks: usize) -> Vec<u8> {
+        return (0..blocks * BLOCK_SIZE).map(|i| (i as u8).wrapping_mul(31) ^ seed).collect();
+    }
+
+    fn check_device(device: &dyn BlockDevice) {
+        let data = pattern(1, 3);
+        device.write_blocks(2, &data).unwrap();
+        let mut back = vec![0u8; 3 * BLOCK_SIZE];
+        device.read_blocks(2, &mut back).unwrap();
+        assert_eq!(back, data);
+        let mut one = vec![0u8; BLOCK_SIZE];
+        device.read_block(3, &mut one).unwrap();
+        assert_eq!(one, &data[BLOCK_SIZE..2 * BLOCK_SIZE]);
+
+        let last = device.num_blocks() - 1;
+        assert!(device.write_block(last, &one).is_ok());
+        assert!(device.write_block(last + 1, &one).is_err());
+        assert!(device.read_blocks(last, &mut back).is_err());
+        assert!(device.read_block(0, &mut one[..100]).is_err());
+        device.sync().unwrap();
+    }
+
+    #[test]
+    fn mem_disk() {
+        check_device(&MemDisk::new(16));
+    }
+
+    #[test]
+    fn file_disk() {
+        let path = std::env::temp_dir().join(format!("disk-test-{}.img", std::process::id()));
+        check_device(&FileDisk::create(&path, 16).unwrap());
+        let disk = FileDisk::open(&path).unwrap();
+        assert_eq!(disk.num_blocks(), 16);
+        let mut back = vec![0u8; BLOCK_SIZE];
+        disk.read_block(4, &mut back).unwrap();
+        assert_eq!(back, &pattern(1, 3)[2 * BLOCK_SIZE..]);
+        drop(disk);
+        std::fs::remove_file(&path).unwrap();
+    }
+}
@@ -0,0 +1,1467 @@
+use std::collections::{BTreeSet, HashMap};
+use std::io;
+use std::path::Path;
+use std::sync::{Arc, Mutex, RwLock};
+
+use crate::alloc::{no_space, BlockAllocator};
+use crate::bmap::{release, truncate_blocks, BlockMapper, MAX_FILE_BLOCKS};
+use crate::cache::{BufferCache, CacheStats};
+use crate::dir::{bucket_block, name_hash, Bucket, DentryCache, DirHeader, ROOT_ID};
+use crate::disk::{BlockDevice, FileDisk, MemDisk, BLOCK_SIZE};
+use crate::journal::{Journal, JournalStats};
+use crate::layout::{Bitmap, FileType, Inode, Superblock, NAME_MAX};
+use crate::reader::FileReader;
+
+// Size of the in-memory device behind FileSystem::new() (64 MB)
+const DEFAULT_MEM_BLOCKS: u64 = 16384;
+// Blocks held by the buffer cache (32 MB)
+pub const DEFAULT_CACHE_BLOCKS: usize = 8192;
+// Names remembered by the dentry cache
+const DCACHE_ENTRIES: usize = 65536;
+// Lock striping for the inode map, the inode table blocks and the dentry
+// cache
+const INODE_SHARDS: usize = 16;
+const INODE_BLOCK_LOCKS: usize = 64;
+const DCACHE_SHARDS: usize = 16;
+
+pub(crate) type InodeRef = Arc<RwLock<Inode>>;
+
+fn invalid_input(message: String) -> io::Error {
+    return io::Error::new(io::ErrorKind::InvalidInput, message);
+}
+
+fn not_found(id: u64) -> io::Error {
+    return io::Error::new(io::ErrorKind::NotFound, format!("no inode {}", id));
+}
+
+fn not_a_directory(id: u64) -> io::Error {
+    return io::Error::new(
+        io::ErrorKind::NotADirectory,
+        format!("inode {} is not a directory", id),
+    );
+}
+
+// Split an absolute path into its parent and final component
+fn split_path(path: &str) -> io::Result<(&str, &str)> {
+    let path = path.trim_end_matches('/');
+    return match path.rfind('/') {
+        Some(at) if path.starts_with('/') && at + 1 < path.len() => {
+            Ok((&path[..at.max(1)], &path[at + 1..]))
+        }
+        _ => Err(invalid_input(format!("'{}' does not name a file", path))),
+    };
+}
+
+// The inode bitmap, and where the search for a free inode resumes
+struct InodeAllocator {
+    bitmap: Bitmap,
+    hint: u64,
+    // Bitmap blocks changed since the last flush
+    dirty: BTreeSet<u64>,
+}
+
+// Metadata blocks are read and written through the journal; file data goes
+// to the device directly, ahead of the commit that makes it reachable.
+// Both pass through the buffer cache.
+//
+// Every method takes &self, so one FileSystem can be shared by many
+// threads. Each inode has its own reader-writer lock: reads of a file or
+// directory run in parallel, and a change to it excludes everything else
+// on that inode only. Each operation is a journal handle, taken before any
+// inode lock.
+pub struct FileSystem {
+    device: Arc<BufferCache>,
+    journal: Journal,
+    superblock: Superblock,
+    inode_alloc: Mutex<InodeAllocator>,
+    allocator: BlockAllocator,
+    // Inodes read or written since mount, sharded by id; the rest stay on
+    // disk
+    inodes: Vec<RwLock<HashMap<u64, InodeRef>>>,
+    // An inode table block holds several inodes; writing one back is a
+    // read-modify-write of the whole block
+    inode_block_locks: Vec<Mutex<()>>,
+    // (directory, name) -> inode, so repeated path lookups skip the
+    // buckets; sharded by name hash
+    dcache: Vec<Mutex<DentryCache>>,
+}
+
+impl FileSystem {
+    // A file system on a fresh in-memory device
+    pub fn new() -> Self {
+        return Self::format(Arc::new(MemDisk::new(DEFAULT_MEM_BLOCKS)))
+            .expect("formatting an in-memory device");
+    }
+
+    // Create a new image file of `num_blocks` blocks and format it
+    pub fn create_image<P: AsRef<Path>>(path: P, num_blocks: u64) -> io::Result<Self> {
+        return Self::format(Arc::new(FileDisk::create(path, num_blocks)?));
+    }
+
+    pub fn open_image<P: AsRef<Path>>(path: P) -> io::Result<Self> {
+        return Self::mount(Arc::new(FileDisk::open(path)?));
+    }
+
+    pub fn format(device: Arc<dyn BlockDevice>) -> io::Result<Self> {
+        return Self::format_with_cache(device, DEFAULT_CACHE_BLOCKS);
+    }
+
+    pub fn format_with_cache(device: Arc<dyn BlockDevice>, cache_blocks: usize) -> io::Result<Self> {
+        let device = Arc::new(BufferCache::new(device, cache_blocks));
+        let superblock = Superblock::new(device.num_blocks());
+        if superblock.data_start >= superblock.num_blocks {
+            return Err(invalid_input(format!(
+                "{} blocks is too small for a file system",
+                superblock.num_blocks
+            )));
+        }
+        // Clear the inode table in case the device held an older image
+        let zero = [0u8; BLOCK_SIZE];
+        for block in superblock.inode_table_start..superblock.data_start {
+            device.write_block(block, &zero)?;
+        }
+        let mut buf = [0u8; BLOCK_SIZE];
+        superblock.encode(&mut buf);
+        device.write_block(0, &buf)?;
+
+        let mut block_bitmap = Bitmap::new(superblock.num_blocks);
+        block_bitmap.set_range(0, superblock.data_start, true);
+        let fs = Self {
+            journal: Journal::create(
+                device.clone(),
+                superblock.journal_start,
+                superblock.journal_blocks,
+            )?,
+            device,
+            inode_alloc: Mutex::new(InodeAllocator {
+                bitmap: Bitmap::new(superblock.num_inodes),
+                hint: 1,
+                dirty: (0..superblock.inode_bitmap_blocks()).collect(),
+            }),
+            allocator: BlockAllocator::new(block_bitmap, superblock.data_start),
+            inodes: Self::inode_shards(),
+            inode_block_locks: (0..INODE_BLOCK_LOCKS).map(|_| Mutex::new(())).collect(),
+            dcache: Self::dcache_shards(),
+            superblock,
+        };
+
+        fs.inode_alloc.lock().unwrap().bitmap.set(0, true);
+        fs.allocator.mark_all_dirty();
+        fs.flush_bitmaps()?;
+        // The first inode handed out is the root directory
+        let root = fs.create_inode("/", FileType::Directory)?;
+        debug_assert_eq!(root, ROOT_ID);
+        fs.journal.shutdown()?;
+        return Ok(fs);
+    }
+
+    // Mounting replays the journal and reads the superblock and the two
+    // bitmaps; inodes and data are read on first use
+    pub fn mount(device: Arc<dyn BlockDevice>) -> io::Result<Self> {
+        return Self::mount_with_cache(device, DEFAULT_CACHE_BLOCKS);
+    }
+
+    pub fn mount_with_cache(device: Arc<dyn BlockDevice>, cache_blocks: usize) -> io::Result<Self> {
+        let device = Arc::new(BufferCache::new(device, cache_blocks));
+        let mut buf = [0u8; BLOCK_SIZE];
+        device.read_block(0, &mut buf)?;
+        let superblock = match Superblock::decode(&buf) {
+            Some(sb) if sb.num_blocks <= device.num_blocks() => sb,
+            _ => {
+                return Err(io::Error::new(
+                    io::ErrorKind::InvalidData,
+                    "not a file system image",
+                ))
+            }
+        };
+
+        let journal = Journal::open(
+            device.clone(),
+            superblock.journal_start,
+            superblock.journal_blocks,
+        )?;
+
+        let mut inode_bitmap = Bitmap::new(superblock.num_inodes);
+        for i in 0..superblock.inode_bitmap_blocks() {
+            device.read_block(superblock.inode_bitmap_start + i, &mut buf)?;
+            inode_bitmap.load_block(i, &buf);
+        }
+        let mut block_bitmap = Bitmap::new(superblock.num_blocks);
+        for i in 0..superblock.block_bitmap_blocks() {
+            device.read_block(superblock.block_bitmap_start + i, &mut buf)?;
+            block_bitmap.load_block(i, &buf);
+        }
+
+        return Ok(Self {
+            device,
+            journal,
+            inode_alloc: Mutex::new(InodeAllocator {
+                bitmap: inode_bitmap,
+                hint: 1,
+                dirty: BTreeSet::new(),
+            }),
+            allocator: BlockAllocator::new(block_bitmap, superblock.data_start),
+            inodes: Self::inode_shards(),
+            inode_block_locks: (0..INODE_BLOCK_LOCKS).map(|_| Mutex::new(())).collect(),
+            dcache: Self::dcache_shards(),
+            superblock,
+        });
+    }
+
+    fn inode_shards() -> Vec<RwLock<HashMap<u64, InodeRef>>> {
+        return (0..INODE_SHARDS).map(|_| RwLock::new(HashMap::new())).collect();
+    }
+
+    fn dcache_shards() -> Vec<Mutex<DentryCache>> {
+        return (0..DCACHE_SHARDS)
+            .map(|_| Mutex::new(DentryCache::new(DCACHE_ENTRIES / DCACHE_SHARDS)))
+            .collect();
+    }
+
+    fn dcache(&self, name: &str) -> &Mutex<DentryCache> {
+        return &self.dcache[(name_hash(name) % DCACHE_SHARDS as u64) as usize];
+    }
+
+    // Commit everything done so far; one device sync covers all of it
+    pub fn sync(&self) -> io::Result<()> {
+        self.journal.sync()?;
+        self.allocator.release(self.journal.committed_tid());
+        return self.device.sync();
+    }
+
+    // Operations between begin() and commit() form one transaction: after
+    // a crash either all of them are replayed or none. Pairs may nest.
+    pub fn begin(&self) {
+        self.journal.begin();
+    }
+
+    pub fn commit(&self) -> io::Result<()> {
+        self.journal.commit()?;
+        self.allocator.release(self.journal.committed_tid());
+        return Ok(());
+    }
+
+    pub fn journal_stats(&self) -> JournalStats {
+        return self.journal.stats();
+    }
+
+    pub fn print_journal(&self) {
+        self.journal.print_journal();
+    }
+
+    pub fn cache_stats(&self) -> CacheStats {
+        return self.device.stats();
+    }
+
+    pub fn print_cache(&self) {
+        let s = self.device.stats();
+        let lookups = s.hits + s.misses;
+        println!("Buffer cache ({} blocks)", self.device.capacity());
+        println!(
+            "  hits {}, misses {} ({:.1}% hit rate), evictions {}",
+            s.hits,
+            s.misses,
+            if lookups == 0 { 0.0 } else { 100.0 * s.hits as f64 / lookups as f64 },
+            s.evictions
+        );
+        println!(
+            "  written back {} blocks in {} requests, read ahead {} ({} used), bypassed {}",
+            s.writebacks, s.writeback_requests, s.readahead_blocks, s.readahead_hits, s.bypassed_blocks
+        );
+    }
+
+    pub fn free_blocks(&self) -> u64 {
+        return self.allocator.free_blocks();
+    }
+
+    fn flush_bitmaps(&self) -> io::Result<()> {
+        let mut buf = [0u8; BLOCK_SIZE];
+        {
+            let mut inodes = self.inode_alloc.lock().unwrap();
+            for index in std::mem::take(&mut inodes.dirty) {
+                inodes.bitmap.store_block(index, &mut buf);
+                self.journal
+                    .write_block(self.superblock.inode_bitmap_start + index, &buf)?;
+            }
+        }
+        for index in self.allocator.take_dirty() {
+            self.allocator.store_block(index, &mut buf, |buf| {
+                return self
+                    .journal
+                    .write_block(self.superblock.block_bitmap_start + index, buf);
+            })?;
+        }
+        return Ok(());
+    }
+
+    fn allocate_inode(&self) -> io::Result<u64> {
+        let mut inodes = self.inode_alloc.lock().unwrap();
+        let id = match inodes.bitmap.find_free(inodes.hint) {
+            Some(id) => id,
+            None => {
+                return Err(io::Error::new(
+                    io::ErrorKind::StorageFull,
+                    "out of inodes",
+                ))
+            }
+        };
+        inodes.bitmap.set(id, true);
+        inodes.hint = id + 1;
+        inodes.dirty.insert(Bitmap::block_of(id));
+        return Ok(id);
+    }
+
+    // Give back an inode that was never linked anywhere
+    fn release_inode(&self, id: u64) -> io::Result<()> {
+        let inode = self.inodes[id as usize % INODE_SHARDS].write().unwrap().remove(&id);
+        if let Some(inode) = inode {
+            self.truncate_data(&mut inode.write().unwrap(), 0)?;
+        }
+        let mut inodes = self.inode_alloc.lock().unwrap();
+        inodes.bitmap.set(id, false);
+        inodes.dirty.insert(Bitmap::block_of(id));
+        return Ok(());
+    }
+
+    fn write_inode(&self, inode: &Inode) -> io::Result<()> {
+        let (block, offset) = self.superblock.inode_location(inode.id);
+        let _guard = self.inode_block_locks[block as usize % INODE_BLOCK_LOCKS].lock().unwrap();
+        let mut buf = [0u8; BLOCK_SIZE];
+        self.journal.read_block(block, &mut buf)?;
+        inode.encode(&mut buf[offset..]);
+        return self.journal.write_block(block, &buf);
+    }
+
+    fn load_inode(&self, id: u64) -> io::Result<Option<Inode>> {
+        if id == 0
+            || id >= self.superblock.num_inodes
+            || !self.inode_alloc.lock().unwrap().bitmap.get(id)
+        {
+            return Ok(None);
+        }
+        let (block, offset) = self.superblock.inode_location(id);
+        let mut buf = [0u8; BLOCK_SIZE];
+        self.journal.read_block(block, &mut buf)?;
+        return Ok(Inode::decode(id, &buf[offset..]));
+    }
+
+    // Inode `id` from the inode map, reading it from disk on first use
+    pub(crate) fn inode(&self, id: u64) -> io::Result<InodeRef> {
+        let shard = &self.inodes[id as usize % INODE_SHARDS];
+        if let Some(inode) = shard.read().unwrap().get(&id) {
+            return Ok(inode.clone());
+        }
+        let loaded = match self.load_inode(id)? {
+            Some(inode) => inode,
+            None => return Err(not_found(id)),
+        };
+        // Another thread may have loaded it meanwhile; keep the first copy
+        let mut shard = shard.write().unwrap();
+        return Ok(shard
+            .entry(id)
+            .or_insert_with(|| Arc::new(RwLock::new(loaded)))
+            .clone());
+    }
+
+    // Run `f` on inode `id` under its read lock
+    fn with_inode<T, F: FnOnce(&Inode) -> io::Result<T>>(&self, id: u64, f: F) -> io::Result<T> {
+        let inode = self.inode(id)?;
+        let inode = inode.read().unwrap();
+        return f(&inode);
+    }
+
+    // File blocks [first, first + count) as runs of (file block, disk
+    // block, length) with consecutive disk blocks; holes have disk block 0
+    pub(crate) fn runs(&self, inode: &Inode, first: u64, count: u64) -> io::Result<Vec<(u64, u64, u64)>> {
+        let mut mapper = BlockMapper::new(&self.journal);
+        let mut runs: Vec<(u64, u64, u64)> = Vec::new();
+        for n in first..first + count {
+            let block = mapper.lookup(inode, n)?.unwrap_or(0);
+            if let Some(last) = runs.last_mut() {
+                let (_, start, len) = *last;
+                let contiguous = if start == 0 { block == 0 } else { block == start + len };
+                if contiguous {
+                    last.2 += 1;
+                    continue;
+                }
+            }
+            runs.push((n, block, 1));
+        }
+        return Ok(runs);
+    }
+
+    // Directory contents are metadata and go through the journal
+    pub(crate) fn data_device(&self, inode: &Inode) -> &dyn BlockDevice {
+        if inode.file_type == FileType::Directory {
+            return &self.journal;
+        }
+        return &*self.device;
+    }
+
+    // Read up to buf.len() bytes at `offset`, stopping at the end of the
+    // file; returns the number read. Whole blocks go from the device
+    // straight into `buf`, only a partial first or last block is read
+    // into a bounce buffer.
+    fn read_range(&self, inode: &Inode, offset: u64, buf: &mut [u8]) -> io::Result<usize> {
+        if offset >= inode.size || buf.is_empty() {
+            return Ok(0);
+        }
+        let bs = BLOCK_SIZE as u64;
+        let len = (buf.len() as u64).min(inode.size - offset);
+        let end = offset + len;
+        let first = offset / bs;
+        let device = self.data_device(inode);
+        let mut bounce = [0u8; BLOCK_SIZE];
+        for (n, block, count) in self.runs(inode, first, (end - 1) / bs - first + 1)? {
+            let lo = (n * bs).max(offset);
+            let hi = ((n + count) * bs).min(end);
+            if block == 0 {
+                buf[(lo - offset) as usize..(hi - offset) as usize].fill(0);
+                continue;
+            }
+            let disk = |at: u64| block + (at / bs - n);
+            let whole_lo = (lo + bs - 1) / bs * bs;
+            let whole_hi = hi / bs * bs;
+            if whole_lo < whole_hi {
+                let out = &mut buf[(whole_lo - offset) as usize..(whole_hi - offset) as usize];
+                device.read_blocks(disk(whole_lo), out)?;
+            }
+            // The partial blocks at either end, if any
+            let mut edges = Vec::with_capacity(2);
+            if lo % bs != 0 || hi - lo < bs {
+                edges.push(lo / bs * bs);
+            }
+            if hi % bs != 0 && hi / bs * bs != lo / bs * bs {
+                edges.push(hi / bs * bs);
+            }
+            for edge in edges {
+                device.read_block(disk(edge), &mut bounce)?;
+                let from = edge.max(lo);
+                let to = (edge + bs).min(hi);
+                buf[(from - offset) as usize..(to - offset) as usize]
+                    .copy_from_slice(&bounce[(from - edge) as usize..(to - edge) as usize]);
+            }
+        }
+        return Ok(len as usize);
+    }
+
+    // Write `data` at byte `offset` of `inode`, allocating blocks for any
+    // part not yet backed. New blocks are taken as one extent continuing
+    // the block before `offset`, and runs of whole blocks that land on
+    // consecutive disk blocks go to the device in a single request.
+    fn write_data(&self, inode: &mut Inode, offset: u64, data: &[u8]) -> io::Result<()> {
+        if data.is_empty() {
+            return Ok(());
+        }
+        let bs = BLOCK_SIZE as u64;
+        let end = offset + data.len() as u64;
+        let first = offset / bs;
+        let last = (end - 1) / bs;
+        if last >= MAX_FILE_BLOCKS {
+            return Err(io::Error::new(
+                io::ErrorKind::FileTooLarge,
+                format!("write ends at byte {}, past the largest file size", end),
+            ));
+        }
+
+        // Map every block of the range, remembering which ones are new
+        let mut mapper = BlockMapper::new(&self.journal);
+        let tid = self.journal.running_tid();
+        let mut blocks = Vec::with_capacity((last - first + 1) as usize);
+        let mut fresh = Vec::with_capacity(blocks.capacity());
+        let mut extent = (0u64, 0u64);
+        let mut goal = match first {
+            0 => 0,
+            _ => mapper.lookup(inode, first - 1)?.map_or(0, |b| b + 1),
+        };
+        let mut result = Ok(());
+        for n in first..=last {
+            let block = match mapper.lookup(inode, n) {
+                Ok(Some(block)) => {
+                    fresh.push(false);
+                    block
+                }
+                Ok(None) => {
+                    if extent.1 == 0 {
+                        match self.allocator.allocate(goal, last - n + 1) {
+                            Some(e) => extent = e,
+                            None => {
+                                result = Err(no_space());
+                                break;
+                            }
+                        }
+                    }
+                    let block = extent.0;
+                    extent = (extent.0 + 1, extent.1 - 1);
+                    if let Err(e) = mapper.map(inode, n, block, &self.allocator) {
+                        self.allocator.free(block, 1, tid);
+                        result = Err(e);
+                        break;
+                    }
+                    fresh.push(true);
+                    block
+                }
+                Err(e) => {
+                    result = Err(e);
+                    break;
+                }
+            };
+            blocks.push(block);
+            goal = block + 1;
+        }
+        self.allocator.free(extent.0, extent.1, tid);
+        if result.is_ok() {
+            result = self.write_mapped(inode, &blocks, &fresh, offset, data);
+        }
+        if result.is_err() {
+            // Leave no new block mapped that may not have been written: it
+            // would show whatever its previous owner left there
+            for (i, _) in fresh.iter().enumerate().filter(|(_, &new)| new) {
+                if mapper.unmap(inode, first + i as u64).is_ok() {
+                    let logged = inode.file_type == FileType::Directory;
+                    release(&self.journal, &self.allocator, blocks[i], logged);
+                }
+            }
+        }
+        mapper.flush()?;
+        result?;
+        inode.size = inode.size.max(end);
+        return Ok(());
+    }
+
+    // The data half of write_data(): `blocks` are the disk blocks of the
+    // file blocks from offset / BLOCK_SIZE on, `fresh` marks the ones just
+    // allocated
+    fn write_mapped(
+        &self,
+        inode: &Inode,
+        blocks: &[u64],
+        fresh: &[bool],
+        offset: u64,
+        data: &[u8],
+    ) -> io::Result<()> {
+        let bs = BLOCK_SIZE as u64;
+        let end = offset + data.len() as u64;
+        let first = offset / bs;
+        let device = self.data_device(inode);
+        let mut i = 0;
+        let mut buf = [0u8; BLOCK_SIZE];
+        while i < blocks.len() {
+            let block_start = (first + i as u64) * bs;
+            let lo = block_start.max(offset);
+            let hi = (block_start + bs).min(end);
+            let chunk = &data[(lo - offset) as usize..(hi - offset) as usize];
+            if chunk.len() < BLOCK_SIZE {
+                // Partial block: merge with what is already there
+                if fresh[i] {
+                    buf.fill(0);
+                } else {
+                    device.read_block(blocks[i], &mut buf)?;
+                }
+                let at = (lo - block_start) as usize;
+                buf[at..at + chunk.len()].copy_from_slice(chunk);
+                device.write_block(blocks[i], &buf)?;
+                i += 1;
+                continue;
+            }
+            // Whole blocks: extend the run while the next block is whole too
+            let mut j = i + 1;
+            while j < blocks.len() && blocks[j] == blocks[j - 1] + 1 && (first + j as u64 + 1) * bs <= end {
+                j += 1;
+            }
+            let from = (lo - offset) as usize;
+            device.write_blocks(blocks[i], &data[from..from + (j - i) * BLOCK_SIZE])?;
+            i = j;
+        }
+        return Ok(());
+    }
+
+    // Cut `inode` down (or extend it with a hole) to `size` bytes
+    fn truncate_data(&self, inode: &mut Inode, size: u64) -> io::Result<()> {
+        let bs = BLOCK_SIZE as u64;
+        if size < inode.size && size % bs != 0 {
+            // Zero the tail of the last block so a later extension reads zeros
+            let mut mapper = BlockMapper::new(&self.journal);
+            if let Some(block) = mapper.lookup(inode, size / bs)? {
+                let device = self.data_device(inode);
+                let mut buf = [0u8; BLOCK_SIZE];
+                device.read_block(block, &mut buf)?;
+                buf[(size % bs) as usize..].fill(0);
+                device.write_block(block, &buf)?;
+            }
+        }
+        if size < inode.size {
+            truncate_blocks(&self.journal, &self.allocator, inode, (size + bs - 1) / bs)?;
+        }
+        inode.size = size;
+        return Ok(());
+    }
+
+    // File block `n` of a directory; a block never written reads as zeros
+    fn read_dir_block(&self, dir: &Inode, n: u64) -> io::Result<Vec<u8>> {
+        let mut buf = vec![0u8; BLOCK_SIZE];
+        if let Some(block) = BlockMapper::new(&self.journal).lookup(dir, n)? {
+            self.journal.read_block(block, &mut buf)?;
+        }
+        return Ok(buf);
+    }
+
+    fn write_bucket(&self, dir: &mut Inode, n: u64, bucket: &Bucket) -> io::Result<()> {
+        let mut buf = [0u8; BLOCK_SIZE];
+        bucket.encode(&mut buf);
+        return self.write_data(dir, n * BLOCK_SIZE as u64, &buf);
+    }
+
+    fn dir_header(&self, dir: &Inode) -> io::Result<DirHeader> {
+        if dir.file_type != FileType::Directory {
+            return Err(not_a_directory(dir.id));
+        }
+        return DirHeader::decode(&self.read_dir_block(dir, 0)?).ok_or_else(|| {
+            io::Error::new(
+                io::ErrorKind::InvalidData,
+                format!("directory {} has no header", dir.id),
+            )
+        });
+    }
+
+    fn write_dir_header(&self, dir: &mut Inode, header: &DirHeader) -> io::Result<()> {
+        let mut buf = [0u8; BLOCK_SIZE];
+        header.encode(&mut buf);
+        return self.write_data(dir, 0, &buf);
+    }
+
+    // The blocks of bucket `bucket`'s chain, as (file block, contents)
+    fn read_chain(&self, dir: &Inode, bucket: u64) -> io::Result<Vec<(u64, Bucket)>> {
+        let mut chain = Vec::new();
+        let mut n = bucket_block(bucket);
+        loop {
+            let block = Bucket::decode(&self.read_dir_block(dir, n)?);
+            let next = block.next;
+            chain.push((n, block));
+            if next == 0 {
+                return Ok(chain);
+            }
+            n = next;
+        }
+    }
+
+    fn dir_lookup(&self, dir: &Inode, name: &str) -> io::Result<Option<u64>> {
+        let header = self.dir_header(dir)?;
+        let mut n = bucket_block(header.bucket_of(name_hash(name)));
+        loop {
+            let block = Bucket::decode(&self.read_dir_block(dir, n)?);
+            if let Some(id) = block.find(name) {
+                return Ok(Some(id));
+            }
+            if block.next == 0 {
+                return Ok(None);
+            }
+            n = block.next;
+        }
+    }
+
+    fn allocate_overflow(&self, dir: &Inode, header: &mut DirHeader) -> io::Result<u64> {
+        if header.free_overflow != 0 {
+            let n = header.free_overflow;
+            header.free_overflow = Bucket::decode(&self.read_dir_block(dir, n)?).next;
+            return Ok(n);
+        }
+        let n = header.next_overflow;
+        header.next_overflow += 1;
+        return Ok(n);
+    }
+
+    // Rewrite bucket `bucket` to hold `entries`, reusing its old overflow
+    // blocks `overflow` first; any left over go on the free list
+    fn write_chain(
+        &self,
+        dir: &mut Inode,
+        header: &mut DirHeader,
+        bucket: u64,
+        entries: Vec<(String, u64)>,
+        overflow: Vec<u64>,
+    ) -> io::Result<()> {
+        let mut packed = vec![Bucket::new()];
+        for (name, id) in entries {
+            if !packed.last().unwrap().fits(&name) {
+                packed.push(Bucket::new());
+            }
+            packed.last_mut().unwrap().entries.push((name, id));
+        }
+        let mut spare = overflow.into_iter();
+        let mut numbers = vec![bucket_block(bucket)];
+        for _ in 1..packed.len() {
+            let n = match spare.next() {
+                Some(n) => n,
+                None => self.allocate_overflow(dir, header)?,
+            };
+            numbers.push(n);
+        }
+        for n in spare {
+            let mut free = Bucket::new();
+            free.next = header.free_overflow;
+            self.write_bucket(dir, n, &free)?;
+            header.free_overflow = n;
+        }
+        for (i, block) in packed.iter_mut().enumerate() {
+            block.next = numbers.get(i + 1).copied().unwrap_or(0);
+            self.write_bucket(dir, numbers[i], block)?;
+        }
+        return Ok(());
+    }
+
+    // Split the bucket at the split pointer between itself and the new
+    // bucket past the end of the table
+    fn split_bucket(&self, dir: &mut Inode, header: &mut DirHeader) -> io::Result<()> {
+        let old = header.split;
+        let new = header.buckets;
+        let mask = (1u64 << (header.level + 1)) - 1;
+        let chain = self.read_chain(dir, old)?;
+        let overflow = chain.iter().skip(1).map(|(n, _)| *n).collect();
+        let (mut stay, mut moved) = (Vec::new(), Vec::new());
+        for (_, block) in chain {
+            for (name, id) in block.entries {
+                if name_hash(&name) & mask == old {
+                    stay.push((name, id));
+                } else {
+                    moved.push((name, id));
+                }
+            }
+        }
+        header.advance_split();
+        self.write_chain(dir, header, old, stay, overflow)?;
+        return self.write_chain(dir, header, new, moved, Vec::new());
+    }
+
+    fn dir_insert(&self, dir: &mut Inode, name: &str, id: u64) -> io::Result<()> {
+        if name.is_empty() || name.len() > NAME_MAX || name.contains('/') || name == "." || name == ".." {
+            return Err(invalid_input(format!("'{}' is not a valid file name", name)));
+        }
+        let mut header = self.dir_header(dir)?;
+        let bucket = header.bucket_of(name_hash(name));
+        let mut chain = self.read_chain(dir, bucket)?;
+        if chain.iter().any(|(_, block)| block.find(name).is_some()) {
+            return Err(io::Error::new(
+                io::ErrorKind::AlreadyExists,
+                format!("'{}' already exists in directory {}", name, dir.id),
+            ));
+        }
+        match chain.iter().position(|(_, block)| block.fits(name)) {
+            Some(i) => {
+                let (n, block) = &mut chain[i];
+                block.entries.push((name.to_string(), id));
+                let n = *n;
+                self.write_bucket(dir, n, &chain[i].1)?;
+            }
+            None => {
+                let n = self.allocate_overflow(dir, &mut header)?;
+                let mut block = Bucket::new();
+                block.entries.push((name.to_string(), id));
+                self.write_bucket(dir, n, &block)?;
+                let (last, tail) = chain.last_mut().unwrap();
+                tail.next = n;
+                let last = *last;
+                self.write_bucket(dir, last, &chain.last().unwrap().1)?;
+            }
+        }
+        header.entries += 1;
+        if header.needs_split() {
+            self.split_bucket(dir, &mut header)?;
+        }
+        self.write_dir_header(dir, &header)?;
+        self.dcache(name).lock().unwrap().insert(dir.id, name, id);
+        return Ok(());
+    }
+
+    fn dir_entries(&self, dir: &Inode) -> io::Result<Vec<(String, u64)>> {
+        let header = self.dir_header(dir)?;
+        let mut entries = Vec::with_capacity(header.entries as usize);
+        for bucket in 0..header.buckets {
+            for (_, block) in self.read_chain(dir, bucket)? {
+                entries.extend(block.entries);
+            }
+        }
+        return Ok(entries);
+    }
+
+    // Run `op` inside a journal handle: it becomes part of one transaction
+    // and counts as one operation for the group commit. Blocks freed by
+    // transactions that have committed since become allocatable.
+    fn in_handle<T, F: FnOnce() -> io::Result<T>>(&self, op: F) -> io::Result<T> {
+        self.journal.begin();
+        let result = op();
+        let ended = self.journal.end();
+        self.allocator.release(self.journal.committed_tid());
+        let value = result?;
+        ended?;
+        return Ok(value);
+    }
+
+    // Run `op` on inode `id` under its write lock, then write the inode and
+    // the bitmaps back
+    fn update_inode<T, F>(&self, id: u64, op: F) -> io::Result<T>
+    where
+        F: FnOnce(&Self, &mut Inode) -> io::Result<T>,
+    {
+        return self.in_handle(|| {
+            let inode = self.inode(id)?;
+            let mut inode = inode.write().unwrap();
+            let result = op(self, &mut inode);
+            let written = self.write_inode(&inode);
+            let flushed = self.flush_bitmaps();
+            let value = result?;
+            written?;
+            flushed?;
+            return Ok(value);
+        });
+    }
+
+    fn check_regular_file(inode: &Inode) -> io::Result<()> {
+        if inode.file_type != FileType::RegularFile {
+            return Err(io::Error::new(
+                io::ErrorKind::IsADirectory,
+                format!("inode {} is a directory", inode.id),
+            ));
+        }
+        return Ok(());
+    }
+
+    fn create_inode(&self, name: &str, file_type: FileType) -> io::Result<u64> {
+        if name.len() > NAME_MAX {
+            return Err(invalid_input(format!(
+                "name is {} bytes, the limit is {}",
+                name.len(),
+                NAME_MAX
+            )));
+        }
+        return self.in_handle(|| {
+            let id = self.allocate_inode()?;
+            let mut inode = Inode::new(id, name, file_type);
+            if file_type == FileType::Directory {
+                self.write_dir_header(&mut inode, &DirHeader::new())?;
+            }
+            self.write_inode(&inode)?;
+            self.inodes[id as usize % INODE_SHARDS]
+                .write()
+                .unwrap()
+                .insert(id, Arc::new(RwLock::new(inode)));
+            self.flush_bitmaps()?;
+            return Ok(id);
+        });
+    }
+
+    pub fn create_directory(&self, name: &str) -> io::Result<u64> {
+        return self.create_inode(name, FileType::Directory);
+    }
+
+    pub fn create_file(&self, name: &str) -> io::Result<u64> {
+        return self.create_inode(name, FileType::RegularFile);
+    }
+
+    // Link inode `file_id` into directory `dir_id` under its own name
+    pub fn add_file_to_directory(&self, file_id: u64, dir_id: u64) -> io::Result<()> {
+        let name = self.with_inode(file_id, |inode| Ok(inode.name.clone()))?;
+        return self.update_inode(dir_id, |fs, dir_inode| {
+            return fs.dir_insert(dir_inode, &name, file_id);
+        });
+    }
+
+    // Create a file or directory at `path` and link it into its parent as
+    // one transaction
+    fn create_at(&self, path: &str, file_type: FileType) -> io::Result<u64> {
+        let (parent, name) = split_path(path)?;
+        let dir_id = self.lookup(parent)?;
+        return self.in_handle(|| {
+            let id = self.create_inode(name, file_type)?;
+            if let Err(e) = self.add_file_to_directory(id, dir_id) {
+                self.release_inode(id)?;
+                self.flush_bitmaps()?;
+                return Err(e);
+            }
+            return Ok(id);
+        });
+    }
+
+    pub fn mkdir(&self, path: &str) -> io::Result<u64> {
+        return self.create_at(path, FileType::Directory);
+    }
+
+    pub fn create(&self, path: &str) -> io::Result<u64> {
+        return self.create_at(path, FileType::RegularFile);
+    }
+
+    // Inode of an absolute path such as "/a/b/c". Each step is answered by
+    // the dentry cache or by reading one bucket of the parent directory.
+    pub fn lookup(&self, path: &str) -> io::Result<u64> {
+        if !path.starts_with('/') {
+            return Err(invalid_input(format!("'{}' is not an absolute path", path)));
+        }
+        let mut id = ROOT_ID;
+        for name in path.split('/') {
+            if name.is_empty() || name == "." {
+                continue;
+            }
+            if name == ".." {
+                return Err(invalid_input(format!("'..' in '{}' is not supported", path)));
+            }
+            if let Some(child) = self.dcache(name).lock().unwrap().get(id, name) {
+                id = child;
+                continue;
+            }
+            let child = self.with_inode(id, |dir| self.dir_lookup(dir, name))?;
+            match child {
+                Some(child) => {
+                    self.dcache(name).lock().unwrap().insert(id, name, child);
+                    id = child;
+                }
+                None => {
+                    return Err(io::Error::new(
+                        io::ErrorKind::NotFound,
+                        format!("'{}' not found", path),
+                    ))
+                }
+            }
+        }
+        return Ok(id);
+    }
+
+    // The (name, inode) entries of a directory, in no particular order
+    pub fn readdir(&self, dir_id: u64) -> io::Result<Vec<(String, u64)>> {
+        return self.with_inode(dir_id, |dir| self.dir_entries(dir));
+    }
+
+    // Dentry cache (hits, misses)
+    pub fn dcache_stats(&self) -> (u64, u64) {
+        let mut stats = (0, 0);
+        for shard in &self.dcache {
+            let shard = shard.lock().unwrap();
+            stats = (stats.0 + shard.hits, stats.1 + shard.misses);
+        }
+        return stats;
+    }
+
+    // Replace the contents of a file
+    pub fn write_to_file(&self, file_id: u64, data: &[u8]) -> io::Result<()> {
+        return self.update_inode(file_id, |fs, file_inode| {
+            Self::check_regular_file(file_inode)?;
+            fs.truncate_data(file_inode, 0)?;
+            return fs.write_data(file_inode, 0, data);
+        });
+    }
+
+    // Write at a byte offset, growing the file as needed; a gap past the
+    // old end is left as a hole that reads back as zeros
+    pub fn write_at(&self, file_id: u64, offset: u64, data: &[u8]) -> io::Result<()> {
+        return self.update_inode(file_id, |fs, file_inode| {
+            Self::check_regular_file(file_inode)?;
+            return fs.write_data(file_inode, offset, data);
+        });
+    }
+
+    pub fn append(&self, file_id: u64, data: &[u8]) -> io::Result<()> {
+        return self.update_inode(file_id, |fs, file_inode| {
+            Self::check_regular_file(file_inode)?;
+            let end = file_inode.size;
+            return fs.write_data(file_inode, end, data);
+        });
+    }
+
+    pub fn truncate(&self, file_id: u64, size: u64) -> io::Result<()> {
+        return self.update_inode(file_id, |fs, file_inode| {
+            Self::check_regular_file(file_inode)?;
+            return fs.truncate_data(file_inode, size);
+        });
+    }
+
+    pub fn file_size(&self, file_id: u64) -> io::Result<u64> {
+        return self.with_inode(file_id, |inode| Ok(inode.size));
+    }
+
+    pub fn read_file(&self, file_id: u64) -> io::Result<Vec<u8>> {
+        return self.with_inode(file_id, |inode| {
+            let mut data = vec![0u8; inode.size as usize];
+            self.read_range(inode, 0, &mut data)?;
+            return Ok(data);
+        });
+    }
+
+    // Read into `buf` from byte `offset` of a file. Returns the number of
+    // bytes read, short only at the end of the file.
+    pub fn read_at(&self, file_id: u64, offset: u64, buf: &mut [u8]) -> io::Result<usize> {
+        return self.with_inode(file_id, |inode| self.read_range(inode, offset, buf));
+    }
+
+    // A streaming reader over a file, see reader.rs
+    pub fn reader(&self, file_id: u64) -> io::Result<FileReader<'_>> {
+        return Ok(FileReader::new(self, self.inode(file_id)?));
+    }
+
+    fn list_directory(&self, path: &str, dir_id: u64) -> io::Result<()> {
+        let mut entries = self.readdir(dir_id)?;
+        entries.sort();
+        println!("Directory {} (ID: {}):", path, dir_id);
+        let mut subdirectories = Vec::new();
+        for (name, id) in entries {
+            let (file_type, size) = self.with_inode(id, |inode| Ok((inode.file_type, inode.size)))?;
+            match file_type {
+                FileType::Directory => {
+                    println!(" - Directory {} (ID: {})", name, id);
+                    subdirectories.push((format!("{}/{}", path.trim_end_matches('/'), name), id));
+                }
+                FileType::RegularFile => {
+                    println!(" - File {} (ID: {}, Size: {} bytes)", name, id, size);
+                }
+            }
+        }
+        for (path, id) in subdirectories {
+            self.list_directory(&path, id)?;
+        }
+        return Ok(());
+    }
+
+    // Print the tree under the root directory
+    pub fn list_directories_and_files(&self) -> io::Result<()> {
+        return self.list_directory("/", ROOT_ID);
+    }
+}
+
+// Unmounting: commit what is pending and checkpoint, so the next mount
+// finds an empty log
+impl Drop for FileSystem {
+    fn drop(&mut self) {
+        if let Err(e) = self.journal.shutdown() {
+            eprintln!("Warning: journal shutdown failed: {}", e);
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::dir::OVERFLOW_BASE;
+
+    fn mem_fs(blocks: u64) -> (Arc<dyn BlockDevice>, FileSystem) {
+        let disk: Arc<dyn BlockDevice> = Arc::new(MemDisk::new(blocks));
+        let fs = FileSystem::format(disk.clone()).unwrap();
+        return (disk, fs);
+    }
+
+    fn remount(disk: &Arc<dyn BlockDevice>, fs: FileSystem) -> FileSystem {
+        drop(fs);
+        return FileSystem::mount(disk.clone()).unwrap();
+    }
+
+    #[test]
+    fn image_round_trip() {
+        let path = std::env::temp_dir().join(format!("fs-test-{}.img", std::process::id()));
+        let fs = FileSystem::create_image(&path, 4096).unwrap();
+        fs.mkdir("/docs").unwrap();
+        let id = fs.create("/docs/a.txt").unwrap();
+        fs.write_to_file(id, b"hello, disk").unwrap();
+        drop(fs);
+
+        let fs = FileSystem::open_image(&path).unwrap();
+        assert_eq!(fs.journal_stats().replayed_transactions, 0);
+        let id = fs.lookup("/docs/a.txt").unwrap();
+        assert_eq!(fs.read_file(id).unwrap(), b"hello, disk");
+        drop(fs);
+        std::fs::remove_file(&path).unwrap();
+    }
+
+    #[test]
+    fn remount_keeps_files_and_free_space() {
+        let (disk, fs) = mem_fs(4096);
+        let before = fs.free_blocks();
+        let id = fs.create("/f").unwrap();
+        fs.write_to_file(id, &vec![7u8; 100000]).unwrap();
+        let used = fs.free_blocks();
+        assert!(used < before);
+        let fs = remount(&disk, fs);
+        assert_eq!(fs.free_blocks(), used);
+        assert_eq!(fs.read_file(fs.lookup("/f").unwrap()).unwrap(), vec![7u8; 100000]);
+    }
+
+    fn pattern(seed: u64, len: usize) -> Vec<u8> {
+        return (0..len as u64).map(|i| (i.wrapping_mul(2654435761) >> 7) as u8 ^ seed as u8).collect();
+    }
+
+    fn read_back(fs: &FileSystem, id: u64, offset: u64, len: usize) -> Vec<u8> {
+        let mut buf = vec![0xAAu8; len];
+        assert_eq!(fs.read_at(id, offset, &mut buf).unwrap(), len);
+        return buf;
+    }
+
+    #[test]
+    fn writes_across_indirect_boundaries() {
+        let (disk, fs) = mem_fs(8192);
+        let id = fs.create("/sparse").unwrap();
+        fs.sync().unwrap();
+        let free = fs.free_blocks();
+        let bs = BLOCK_SIZE as u64;
+        let direct = crate::layout::NUM_DIRECT_POINTERS as u64;
+        let ptrs = crate::layout::PTRS_PER_BLOCK;
+        // First file block of the single, double and triple indirect trees
+        let starts = [direct, direct + ptrs, direct + ptrs + ptrs * ptrs];
+        let mut written = Vec::new();
+        for (k, &n) in starts.iter().enumerate() {
+            // Starts mid-block before the boundary, ends mid-block after it
+            let offset = (n - 2) * bs + 100;
+            let data = pattern(k as u64, 4 * BLOCK_SIZE + 17);
+            fs.write_at(id, offset, &data).unwrap();
+            written.push((offset, data));
+        }
+        let fs = remount(&disk, fs);
+        for (offset, data) in &written {
+            assert_eq!(&read_back(&fs, id, *offset, data.len()), data);
+            // The holes around each write read as zeros
+            assert_eq!(read_back(&fs, id, offset - 100, 100), vec![0u8; 100]);
+        }
+        let end = written[1].0 + written[1].1.len() as u64;
+        assert_eq!(read_back(&fs, id, end, 50), vec![0u8; 50]);
+        let (offset, data) = written.last().unwrap();
+        assert_eq!(fs.file_size(id).unwrap(), offset + data.len() as u64);
+
+        // Cutting back into the single indirect tree frees the other trees
+        let (offset, data) = &written[0];
+        let keep = (starts[0] + 1) * bs;
+        fs.truncate(id, keep).unwrap();
+        let kept = (keep - offset) as usize;
+        assert_eq!(read_back(&fs, id, *offset, kept), &data[..kept]);
+        fs.truncate(id, 0).unwrap();
+        fs.sync().unwrap();
+        assert_eq!(fs.free_blocks(), free);
+    }
+
+    #[test]
+    fn whole_file_round_trip() {
+        let (disk, fs) = mem_fs(8192);
+        let id = fs.create("/big").unwrap();
+        let bs = BLOCK_SIZE;
+        let direct = crate::layout::NUM_DIRECT_POINTERS;
+        let ptrs = crate::layout::PTRS_PER_BLOCK as usize;
+        // Fills the direct pointers and the single tree, and starts the double
+        let data = pattern(9, (direct + ptrs + 3) * bs + 1);
+        fs.write_to_file(id, &data).unwrap();
+        fs.append(id, b"tail").unwrap();
+        fs.write_at(id, 5, b"head").unwrap();
+        let mut want = data.clone();
+        want.extend_from_slice(b"tail");
+        want[5..9].copy_from_slice(b"head");
+        assert_eq!(fs.read_file(id).unwrap(), want);
+        let fs = remount(&disk, fs);
+        assert_eq!(fs.read_file(id).unwrap(), want);
+    }
+
+    #[test]
+    fn failed_write_maps_no_new_blocks() {
+        let (disk, fs) = mem_fs(2048);
+        let id = fs.create("/f").unwrap();
+        let old = pattern(1, 3 * BLOCK_SIZE);
+        fs.write_to_file(id, &old).unwrap();
+        fs.sync().unwrap();
+        let free = fs.free_blocks();
+
+        // Runs out of space after mapping part of the range
+        let big = vec![5u8; (free as usize + 10) * BLOCK_SIZE];
+        let e = fs.write_at(id, BLOCK_SIZE as u64, &big).err().unwrap();
+        assert_eq!(e.kind(), io::ErrorKind::StorageFull);
+        assert_eq!(fs.file_size(id).unwrap(), old.len() as u64);
+        assert_eq!(fs.read_file(id).unwrap(), old);
+        fs.sync().unwrap();
+        assert_eq!(fs.free_blocks(), free);
+
+        // Past the old end nothing new is mapped: writing there later
+        // allocates again and the file reads back what was written
+        let fs = remount(&disk, fs);
+        assert_eq!(fs.free_blocks(), free);
+        fs.write_at(id, 10 * BLOCK_SIZE as u64, b"x").unwrap();
+        let data = fs.read_file(id).unwrap();
+        assert_eq!(&data[..old.len()], &old[..]);
+        assert!(data[old.len()..10 * BLOCK_SIZE].iter().all(|&b| b == 0));
+    }
+
+    // Lose whatever has not reached the device, then mount again
+    fn crash(disk: &Arc<dyn BlockDevice>, fs: FileSystem, cache_blocks: usize) -> FileSystem {
+        std::mem::forget(fs);
+        return FileSystem::mount_with_cache(disk.clone(), cache_blocks).unwrap();
+    }
+
+    #[test]
+    fn crash_keeps_what_was_synced() {
+        let (disk, fs) = mem_fs(4096);
+        let a = fs.create("/a").unwrap();
+        fs.write_to_file(a, b"synced").unwrap();
+        fs.sync().unwrap();
+        let b = fs.create("/b").unwrap();
+        fs.write_to_file(b, b"not synced").unwrap();
+        fs.append(a, b" and more").unwrap();
+
+        let fs = crash(&disk, fs, DEFAULT_CACHE_BLOCKS);
+        assert!(fs.journal_stats().replayed_transactions > 0);
+        assert_eq!(fs.read_file(fs.lookup("/a").unwrap()).unwrap(), b"synced");
+        assert_eq!(fs.lookup("/b").err().unwrap().kind(), io::ErrorKind::NotFound);
+        // The inode taken by /b is free again
+        assert_eq!(fs.create("/c").unwrap(), b);
+    }
+
+    #[test]
+    fn transactions_replay_whole() {
+        let (disk, fs) = mem_fs(4096);
+        fs.begin();
+        fs.mkdir("/d").unwrap();
+        for i in 0..10 {
+            let id = fs.create(&format!("/d/{}", i)).unwrap();
+            fs.write_to_file(id, &pattern(i, 5000)).unwrap();
+        }
+        fs.commit().unwrap();
+        let free = fs.free_blocks();
+
+        let fs = crash(&disk, fs, DEFAULT_CACHE_BLOCKS);
+        assert_eq!(fs.free_blocks(), free);
+        assert_eq!(fs.readdir(fs.lookup("/d").unwrap()).unwrap().len(), 10);
+        for i in 0..10 {
+            let id = fs.lookup(&format!("/d/{}", i)).unwrap();
+            assert_eq!(fs.read_file(id).unwrap(), pattern(i, 5000));
+        }
+    }
+
+    // Blocks freed by a truncate must not take new data before the
+    // truncate has committed: after a crash the file still owns them
+    #[test]
+    fn freed_blocks_are_not_reused_before_commit() {
+        for cache_blocks in [16, DEFAULT_CACHE_BLOCKS] {
+            let disk: Arc<dyn BlockDevice> = Arc::new(MemDisk::new(16384));
+            let fs = FileSystem::format_with_cache(disk.clone(), cache_blocks).unwrap();
+            let a = fs.create("/a").unwrap();
+            fs.write_to_file(a, &vec![b'A'; 20 * BLOCK_SIZE]).unwrap();
+            fs.sync().unwrap();
+            fs.truncate(a, 10 * BLOCK_SIZE as u64).unwrap();
+            fs.append(a, &vec![b'C'; 20 * BLOCK_SIZE]).unwrap();
+
+            let fs = crash(&disk, fs, cache_blocks);
+            assert_eq!(fs.read_file(a).unwrap(), vec![b'A'; 20 * BLOCK_SIZE]);
+        }
+    }
+
+    // The same for pointer blocks: a file's indirect blocks, freed and
+    // then needed by another file in the same transaction
+    #[test]
+    fn freed_pointer_blocks_are_not_reused_before_commit() {
+        let disk: Arc<dyn BlockDevice> = Arc::new(MemDisk::new(16384));
+        let fs = FileSystem::format_with_cache(disk.clone(), 16).unwrap();
+        let a = fs.create("/a").unwrap();
+        let b = fs.create("/b").unwrap();
+        let data = pattern(3, 600 * BLOCK_SIZE);
+        fs.write_to_file(a, &data).unwrap();
+        fs.sync().unwrap();
+        fs.truncate(a, 0).unwrap();
+        fs.write_to_file(b, &vec![0xEE; 600 * BLOCK_SIZE]).unwrap();
+
+        let fs = crash(&disk, fs, 16);
+        assert_eq!(fs.read_file(a).unwrap(), data);
+        assert_eq!(fs.file_size(b).unwrap(), 0);
+    }
+
+    fn header_of(fs: &FileSystem, dir: u64) -> DirHeader {
+        return fs.with_inode(dir, |inode| fs.dir_header(inode)).unwrap();
+    }
+
+    #[test]
+    fn directory_splits_as_it_grows() {
+        let (disk, fs) = mem_fs(8192);
+        let dir = fs.mkdir("/d").unwrap();
+        let mut ids = Vec::new();
+        for i in 0..2000 {
+            ids.push(fs.create(&format!("/d/f{}", i)).unwrap());
+        }
+        let header = header_of(&fs, dir);
+        assert_eq!(header.entries, 2000);
+        assert!(header.buckets >= 2000 / 64, "{} buckets", header.buckets);
+        let fs = remount(&disk, fs);
+        for (i, &id) in ids.iter().enumerate() {
+            assert_eq!(fs.lookup(&format!("/d/f{}", i)).unwrap(), id);
+        }
+        let mut names: Vec<String> = fs.readdir(dir).unwrap().into_iter().map(|(n, _)| n).collect();
+        names.sort();
+        names.dedup();
+        assert_eq!(names.len(), 2000);
+        assert_eq!(fs.lookup("/d/f2000").err().unwrap().kind(), io::ErrorKind::NotFound);
+    }
+
+    #[test]
+    fn long_names_overflow_their_bucket() {
+        let (disk, fs) = mem_fs(8192);
+        let dir = fs.mkdir("/long").unwrap();
+        let name = |i: usize| format!("{:x>128}", i);
+        for i in 0..600 {
+            fs.create(&format!("/long/{}", name(i))).unwrap();
+        }
+        // 64 entries of 137 bytes do not fit in one block
+        let header = header_of(&fs, dir);
+        assert!(header.next_overflow > OVERFLOW_BASE);
+        let chains = fs
+            .with_inode(dir, |inode| {
+                return (0..header.buckets).map(|b| fs.read_chain(inode, b)).collect();
+            })
+            .unwrap();
+        let chains: Vec<Vec<(u64, Bucket)>> = chains;
+        assert!(chains.iter().any(|chain| chain.len() > 1));
+        // Splits give overflow blocks back to the free list or reuse them
+        let chained: usize = chains.iter().map(|chain| chain.len() - 1).sum();
+        let mut free = 0;
+        let mut n = header.free_overflow;
+        while n != 0 {
+            free += 1;
+            let block = fs.with_inode(dir, |inode| fs.read_dir_block(inode, n)).unwrap();
+            n = Bucket::decode(&block).next;
+        }
+        assert_eq!((header.next_overflow - OVERFLOW_BASE) as usize, chained + free);
+
+        let fs = remount(&disk, fs);
+        for i in 0..600 {
+            fs.lookup(&format!("/long/{}", name(i))).unwrap();
+        }
+        assert_eq!(fs.readdir(dir).unwrap().len(), 600);
+    }
+
+    #[test]
+    fn bad_and_duplicate_names() {
+        let (_disk, fs) = mem_fs(4096);
+        fs.mkdir("/d").unwrap();
+        fs.create("/d/x").unwrap();
+        assert_eq!(fs.create("/d/x").err().unwrap().kind(), io::ErrorKind::AlreadyExists);
+        assert_eq!(fs.mkdir("/d/x").err().unwrap().kind(), io::ErrorKind::AlreadyExists);
+        assert!(fs.create(&format!("/d/{}", "n".repeat(NAME_MAX + 1))).is_err());
+        assert!(fs.create("/d/..").is_err());
+        assert!(fs.create("relative").is_err());
+        assert_eq!(fs.create("/missing/x").err().unwrap().kind(), io::ErrorKind::NotFound);
+        assert_eq!(fs.create("/d/x/y").err().unwrap().kind(), io::ErrorKind::NotADirectory);
+        // Failed creates give their inode back: in use are inode 0, the
+        // root, /d, /d/x and /d/y
+        fs.create("/d/y").unwrap();
+        assert_eq!(fs.readdir(fs.lookup("/d").unwrap()).unwrap().len(), 2);
+        assert_eq!(fs.inode_alloc.lock().unwrap().bitmap.count_ones(), 5);
+    }
+
+    #[test]
+    fn nested_paths() {
+        let (disk, fs) = mem_fs(4096);
+        fs.mkdir("/a").unwrap();
+        fs.mkdir("/a/b").unwrap();
+        let id = fs.create("/a/b/c").unwrap();
+        fs.write_to_file(id, b"deep").unwrap();
+        let fs = remount(&disk, fs);
+        assert_eq!(fs.lookup("/a/b/c").unwrap(), id);
+        assert_eq!(fs.lookup("/a/./b//c/").unwrap(), id);
+        assert_eq!(fs.read_file(fs.lookup("/a/b/c").unwrap()).unwrap(), b"deep");
+        let e = fs.write_to_file(fs.lookup("/a").unwrap(), b"x").err().unwrap();
+        assert_eq!(e.kind(), io::ErrorKind::IsADirectory);
+    }
+
+    #[test]
+    fn threads_share_one_file_system() {
+        let (disk, fs) = mem_fs(16384);
+        let dir = fs.mkdir("/shared").unwrap();
+        let log = fs.create("/log").unwrap();
+        std::thread::scope(|s| {
+            for t in 0..4u64 {
+                let fs = &fs;
+                s.spawn(move || {
+                    for i in 0..200u64 {
+                        let id = fs.create(&format!("/shared/{}-{}", t, i)).unwrap();
+                        fs.write_to_file(id, &pattern(t * 1000 + i, (i as usize % 5) * 3000)).unwrap();
+                        fs.append(log, &[t as u8; 10]).unwrap();
+                        if i % 50 == 0 {
+                            fs.sync().unwrap();
+                        }
+                        if i % 30 == 0 {
+                            fs.begin();
+                            fs.truncate(id, 100).unwrap();
+                            fs.append(id, b"end").unwrap();
+                            fs.commit().unwrap();
+                        }
+                    }
+                });
+            }
+        });
+        fs.sync().unwrap();
+        let free = fs.free_blocks();
+
+        let fs = crash(&disk, fs, DEFAULT_CACHE_BLOCKS);
+        assert_eq!(fs.free_blocks(), free);
+        assert_eq!(fs.readdir(dir).unwrap().len(), 800);
+        let data = fs.read_file(log).unwrap();
+        assert_eq!(data.len(), 8000);
+        for t in 0..4u8 {
+            assert_eq!(data.iter().filter(|&&b| b == t).count(), 2000);
+        }
+        for t in 0..4u64 {
+            for i in 0..200u64 {
+                let id = fs.lookup(&format!("/shared/{}-{}", t, i)).unwrap();
+                let mut want = pattern(t * 1000 + i, (i as usize % 5) * 3000);
+                if i % 30 == 0 {
+                    want.resize(100, 0);
+                    want.extend_from_slice(b"end");
+                }
+                assert_eq!(fs.read_file(id).unwrap(), want, "/shared/{}-{}", t, i);
+            }
+        }
+    }
+
+    #[test]
+    fn readers_run_beside_a_writer() {
+        let (_disk, fs) = mem_fs(8192);
+        let id = fs.create("/f").unwrap();
+        fs.write_to_file(id, &vec![1u8; 64 * BLOCK_SIZE]).unwrap();
+        std::thread::scope(|s| {
+            let fs = &fs;
+            s.spawn(move || {
+                for i in 2..40u8 {
+                    fs.write_to_file(id, &vec![i; 64 * BLOCK_SIZE]).unwrap();
+                }
+            });
+            for _ in 0..2 {
+                s.spawn(move || {
+                    for _ in 0..40 {
+                        // Each read sees one whole version of the file
+                        let data = fs.read_file(id).unwrap();
+                        assert_eq!(data.len(), 64 * BLOCK_SIZE);
+                        assert!(data.iter().all(|&b| b == data[0]));
+                    }
+                });
+            }
+        });
+    }
+
+    #[test]
+    fn read_at_edges() {
+        let (_disk, fs) = mem_fs(4096);
+        let id = fs.create("/f").unwrap();
+        let bs = BLOCK_SIZE as u64;
+        let data = pattern(4, 5 * BLOCK_SIZE + 123);
+        fs.write_to_file(id, &data).unwrap();
+        let len = data.len() as u64;
+        // Within one block, across one and several block edges, whole blocks
+        for (offset, n) in [(7, 100), (bs - 1, 2), (bs - 10, 2 * bs + 20), (bs, 3 * bs), (0, len)] {
+            let (offset, n) = (offset as usize, n as usize);
+            assert_eq!(read_back(&fs, id, offset as u64, n), &data[offset..offset + n]);
+        }
+        // Short at the end of the file, nothing past it
+        let mut buf = vec![0u8; 1000];
+        assert_eq!(fs.read_at(id, len - 10, &mut buf).unwrap(), 10);
+        assert_eq!(&buf[..10], &data[data.len() - 10..]);
+        assert_eq!(fs.read_at(id, len, &mut buf).unwrap(), 0);
+        assert_eq!(fs.read_at(id, len + bs, &mut buf).unwrap(), 0);
+        assert_eq!(fs.read_at(id, 0, &mut []).unwrap(), 0);
+        assert!(fs.read_at(9999, 0, &mut buf).is_err());
+    }
+
+    #[test]
+    fn mount_rejects_other_devices() {
+        let disk: Arc<dyn BlockDevice> = Arc::new(MemDisk::new(64));
+        let e = FileSystem::mount(disk).err().unwrap();
+        assert_eq!(e.kind(), io::ErrorKind::InvalidData);
+        let tiny: Arc<dyn BlockDevice> = Arc::new(MemDisk::new(8));
+        assert!(FileSystem::format(tiny).is_err());
+    }
+}
@@ -0,0 +1,868 @@
+// Write-ahead log for metadata blocks.
+//
+// The journal sits between the file system and the device for every
+// metadata block (inode table, bitmaps, pointer blocks, directory data);
+// file data goes straight to the device. Writes land in the running
+// transaction and become durable when it commits:
+//
+//   [revoke blocks] [descriptor, images]... [commit]
+//
+// Descriptors list the home block of each image that follows; revoke
+// blocks list blocks freed in this transaction, whose older logged copies
+// must not be replayed over whatever the block holds now. The commit block
+// carries a checksum of the whole transaction, so a torn tail is ignored.
+//
+// Committed blocks are written to their home location at the next
+// checkpoint, which happens when the log fills up or at unmount. Mount
+// replays every complete transaction after the last checkpoint.
+//
+// Many operations share one transaction (group commit): a transaction is
+// committed once it holds GROUP_COMMIT_OPS operations or a quarter of the
+// log, on sync(), or when an explicit begin()/commit() pair ends.
+//
+// Every operation runs inside a handle (begin() ... end()), and threads
+// add to the running transaction concurrently. Once a commit is due, new
+// handles wait; the last handle to close takes the running transaction
+// and writes it to the log while the next one already fills up.
+
+use std::cell::Cell;
+use std::collections::{BTreeMap, HashMap, HashSet};
+use std::io;
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::{Arc, Condvar, Mutex, MutexGuard};
+
+use crate::disk::{BlockDevice, BLOCK_SIZE};
+use crate::layout::{get_u32, get_u64, put_u32, put_u64};
+
+const HEADER_MAGIC: u64 = u64::from_le_bytes(*b"CPSCWAL1");
+const DESCRIPTOR_MAGIC: u64 = u64::from_le_bytes(*b"WALDESC\0");
+const REVOKE_MAGIC: u64 = u64::from_le_bytes(*b"WALREVOK");
+const COMMIT_MAGIC: u64 = u64::from_le_bytes(*b"WALCOMMT");
+// Block numbers per descriptor or revoke block, after the 24-byte header
+const TAGS_PER_BLOCK: usize = (BLOCK_SIZE - 24) / 8;
+const GROUP_COMMIT_OPS: u64 = 256;
+
+#[derive(Clone, Debug, Default)]
+pub struct JournalStats {
+    pub commits: u64,
+    pub logged_blocks: u64,
+    pub revoked_blocks: u64,
+    pub checkpoints: u64,
+    pub syncs: u64,
+    pub replayed_transactions: u64,
+}
+
+// Running, committing and checkpoint blocks are split by block number so
+// that writers of different blocks do not share a lock
+const SHARDS: usize = 16;
+
+#[derive(Default)]
+struct Shard {
+    running: HashMap<u64, Arc<[u8]>>,
+    // The transaction being written to the log
+    committing: HashMap<u64, Arc<[u8]>>,
+    // Committed, not yet written home
+    checkpoint: HashMap<u64, Arc<[u8]>>,
+}
+
+struct JournalState {
+    // Handles open on the running transaction
+    handles: u32,
+    ops: u64,
+    // A commit is due: new handles wait until it has taken the running
+    // transaction
+    locked: bool,
+    // A commit is writing the log (at most one at a time)
+    committing: bool,
+    revoked: Vec<u64>,
+    // In-memory transaction ids, including empty transactions that never
+    // reach the log; every id below `done` has committed
+    tid: u64,
+    done: u64,
+    // Log sequence number of the next transaction written
+    sequence: u64,
+    head: u64,
+    stats: JournalStats,
+}
+
+pub struct Journal {
+    device: Arc<dyn BlockDevice>,
+    start: u64,
+    blocks: u64,
+    shards: Vec<Mutex<Shard>>,
+    running_blocks: AtomicU64,
+    state: Mutex<JournalState>,
+    changed: Condvar,
+}
+
+thread_local! {
+    // Handles held by this thread, so that a nested begin() never waits
+    // for a commit that is itself waiting for this thread
+    static HANDLES: Cell<u32> = Cell::new(0);
+}
+
+fn checksum(h: u64, buf: &[u8]) -> u64 {
+    let mut h = h;
+    for word in buf.chunks_exact(8) {
+        h = (h ^ get_u64(word, 0)).wrapping_mul(0x100000001B3);
+    }
+    return h;
+}
+
+fn tag_block(magic: u64, sequence: u64, tags: &[u64]) -> Vec<u8> {
+    let mut buf = vec![0u8; BLOCK_SIZE];
+    put_u64(&mut buf, 0, magic);
+    put_u64(&mut buf, 8, sequence);
+    put_u32(&mut buf, 16, tags.len() as u32);
+    for (i, tag) in tags.iter().enumerate() {
+        put_u64(&mut buf, 24 + i * 8, *tag);
+    }
+    return buf;
+}
+
+fn read_tags(buf: &[u8]) -> Vec<u64> {
+    let count = (get_u32(buf, 16) as usize).min(TAGS_PER_BLOCK);
+    return (0..count).map(|i| get_u64(buf, 24 + i * 8)).collect();
+}
+
+impl Journal {
+    // Log region: blocks [start, start + blocks); the first one is the header
+    fn new(device: Arc<dyn BlockDevice>, start: u64, blocks: u64, sequence: u64) -> Self {
+        return Self {
+            device,
+            start,
+            blocks,
+            shards: (0..SHARDS).map(|_| Mutex::new(Shard::default())).collect(),
+            running_blocks: AtomicU64::new(0),
+            state: Mutex::new(JournalState {
+                handles: 0,
+                ops: 0,
+                locked: false,
+                committing: false,
+                revoked: Vec::new(),
+                tid: 0,
+                done: 0,
+                sequence,
+                head: start + 1,
+                stats: JournalStats::default(),
+            }),
+            changed: Condvar::new(),
+        };
+    }
+
+    fn shard(&self, block: u64) -> &Mutex<Shard> {
+        return &self.shards[(block % SHARDS as u64) as usize];
+    }
+
+    fn write_header(&self, sequence: u64) -> io::Result<()> {
+        let buf = tag_block(HEADER_MAGIC, sequence, &[]);
+        self.device.write_block(self.start, &buf)?;
+        return self.device.sync();
+    }
+
+    // Set up an empty log on a freshly formatted device
+    pub fn create(device: Arc<dyn BlockDevice>, start: u64, blocks: u64) -> io::Result<Self> {
+        let journal = Self::new(device, start, blocks, 1);
+        journal.write_header(1)?;
+        return Ok(journal);
+    }
+
+    // Replay whatever the log holds, leaving it empty
+    pub fn open(device: Arc<dyn BlockDevice>, start: u64, blocks: u64) -> io::Result<Self> {
+        let mut buf = vec![0u8; BLOCK_SIZE];
+        device.read_block(start, &mut buf)?;
+        if get_u64(&buf, 0) != HEADER_MAGIC {
+            return Err(io::Error::new(io::ErrorKind::InvalidData, "bad journal header"));
+        }
+        let journal = Self::new(device, start, blocks, get_u64(&buf, 8));
+        journal.replay()?;
+        return Ok(journal);
+    }
+
+    fn replay(&self) -> io::Result<()> {
+        let mut state = self.state.lock().unwrap();
+        let end = self.start + self.blocks;
+        let mut pos = self.start + 1;
+        let mut sequence = state.sequence;
+        let mut buf = vec![0u8; BLOCK_SIZE];
+        // Complete transactions: (sequence, [(home, image)])
+        let mut transactions: Vec<(u64, Vec<(u64, Vec<u8>)>)> = Vec::new();
+        let mut revoked: HashMap<u64, u64> = HashMap::new();
+
+        'transactions: while pos < end {
+            let mut images = Vec::new();
+            let mut revokes = Vec::new();
+            let mut h = sequence;
+            loop {
+                if pos >= end {
+                    break 'transactions;
+                }
+                self.device.read_block(pos, &mut buf)?;
+                pos += 1;
+                if get_u64(&buf, 8) != sequence {
+                    break 'transactions;
+                }
+                match get_u64(&buf, 0) {
+                    REVOKE_MAGIC => {
+                        h = checksum(h, &buf);
+                        revokes.extend(read_tags(&buf));
+                    }
+                    DESCRIPTOR_MAGIC => {
+                        h = checksum(h, &buf);
+                        for home in read_tags(&buf) {
+                            if pos >= end {
+                                break 'transactions;
+                            }
+                            let mut image = vec![0u8; BLOCK_SIZE];
+                            self.device.read_block(pos, &mut image)?;
+                            pos += 1;
+                            h = checksum(h, &image);
+                            images.push((home, image));
+                        }
+                    }
+                    COMMIT_MAGIC => {
+                        if get_u64(&buf, 24) != h {
+                            break 'transactions;
+                        }
+                        break;
+                    }
+                    _ => break 'transactions,
+                }
+            }
+            for block in revokes {
+                revoked.insert(block, sequence);
+            }
+            transactions.push((sequence, images));
+            sequence += 1;
+        }
+
+        // A revoke in transaction s cancels copies logged in s or earlier
+        for (seq, images) in &transactions {
+            for (home, image) in images {
+                if revoked.get(home).map_or(true, |&r| *seq > r) {
+                    let image: Arc<[u8]> = Arc::from(image.as_slice());
+                    self.shard(*home).lock().unwrap().checkpoint.insert(*home, image);
+                }
+            }
+        }
+        state.stats.replayed_transactions = transactions.len() as u64;
+        state.sequence = sequence;
+        // Log space in use, so the header moves past what was replayed
+        state.head = pos;
+        return self.checkpoint_locked(&mut state);
+    }
+
+    // Write committed blocks home and empty the log. The caller is the
+    // only one committing, so nothing is added to the checkpoint meanwhile,
+    // but a block may be revoked: each one is written with its shard
+    // locked, and only if it is still there, so a revoked block's old
+    // image never lands on top of its next owner.
+    fn checkpoint(&self, sequence: u64) -> io::Result<()> {
+        let mut blocks: BTreeMap<u64, Arc<[u8]>> = BTreeMap::new();
+        for shard in &self.shards {
+            let shard = shard.lock().unwrap();
+            blocks.extend(shard.checkpoint.iter().map(|(home, image)| (*home, image.clone())));
+        }
+        for (home, image) in &blocks {
+            let shard = self.shard(*home).lock().unwrap();
+            if shard.checkpoint.get(home).map_or(false, |current| Arc::ptr_eq(current, image)) {
+                self.device.write_block(*home, image)?;
+            }
+        }
+        self.device.sync()?;
+        self.write_header(sequence)?;
+        for home in blocks.keys() {
+            self.shard(*home).lock().unwrap().checkpoint.remove(home);
+        }
+        return Ok(());
+    }
+
+    fn checkpoint_locked(&self, state: &mut JournalState) -> io::Result<()> {
+        let pending = self.shards.iter().any(|shard| !shard.lock().unwrap().checkpoint.is_empty());
+        if !pending && state.head == self.start + 1 {
+            return Ok(());
+        }
+        self.checkpoint(state.sequence)?;
+        state.head = self.start + 1;
+        state.stats.checkpoints += 1;
+        state.stats.syncs += 2;
+        return Ok(());
+    }
+
+    // Write one transaction to the log starting at `head`, checkpointing
+    // first if it does not fit. Returns the new head.
+    fn write_transaction(
+        &self,
+        sequence: u64,
+        head: u64,
+        running: &BTreeMap<u64, Arc<[u8]>>,
+        revoked: &[u64],
+        stats: &mut JournalStats,
+    ) -> io::Result<u64> {
+        let n = running.len();
+        let needed = ((revoked.len() + TAGS_PER_BLOCK - 1) / TAGS_PER_BLOCK
+            + (n + TAGS_PER_BLOCK - 1) / TAGS_PER_BLOCK
+            + n
+            + 1) as u64;
+
+        if needed > self.blocks - 1 {
+            // Writing it in place would not be atomic. Handles stop joining
+            // a transaction at a quarter of the log, so only an operation
+            // that is itself this big gets here.
+            return Err(io::Error::new(
+                io::ErrorKind::StorageFull,
+                format!("transaction of {} blocks does not fit the {}-block journal", needed, self.blocks),
+            ));
+        }
+        let mut head = head;
+        if head + needed > self.start + self.blocks {
+            self.checkpoint(sequence)?;
+            head = self.start + 1;
+            stats.checkpoints += 1;
+            stats.syncs += 2;
+        }
+        let mut h = sequence;
+        let mut pos = head;
+        for chunk in revoked.chunks(TAGS_PER_BLOCK) {
+            let buf = tag_block(REVOKE_MAGIC, sequence, chunk);
+            h = checksum(h, &buf);
+            self.device.write_block(pos, &buf)?;
+            pos += 1;
+        }
+        let homes: Vec<u64> = running.keys().copied().collect();
+        for chunk in homes.chunks(TAGS_PER_BLOCK) {
+            let buf = tag_block(DESCRIPTOR_MAGIC, sequence, chunk);
+            h = checksum(h, &buf);
+            self.device.write_block(pos, &buf)?;
+            pos += 1;
+            let mut images = Vec::with_capacity(chunk.len() * BLOCK_SIZE);
+            for home in chunk {
+                h = checksum(h, &running[home]);
+                images.extend_from_slice(&running[home]);
+            }
+            self.device.write_blocks(pos, &images)?;
+            pos += chunk.len() as u64;
+        }
+        // Data written before this point, and the log itself, must be on
+        // disk before the commit block is
+        self.device.sync()?;
+        let mut buf = tag_block(COMMIT_MAGIC, sequence, &[]);
+        put_u64(&mut buf, 24, h);
+        self.device.write_block(pos, &buf)?;
+        self.device.sync()?;
+
+        stats.commits += 1;
+        stats.logged_blocks += n as u64;
+        stats.revoked_blocks += revoked.len() as u64;
+        stats.syncs += 2;
+        return Ok(pos + 1);
+    }
+
+    // Commit the running transaction. No handle may be open and no other
+    // commit running. The state lock is dropped while the log is written,
+    // so handles on the next transaction can proceed meanwhile. Commits
+    // again if another one became due in the meantime.
+    fn commit_locked<'a>(
+        &'a self,
+        mut state: MutexGuard<'a, JournalState>,
+    ) -> (MutexGuard<'a, JournalState>, io::Result<()>) {
+        loop {
+            state.locked = false;
+            state.ops = 0;
+            let tid = state.tid;
+            state.tid += 1;
+            let mut running: BTreeMap<u64, Arc<[u8]>> = BTreeMap::new();
+            for shard in &self.shards {
+                let mut shard = shard.lock().unwrap();
+                shard.committing = std::mem::take(&mut shard.running);
+                running.extend(shard.committing.iter().map(|(home, image)| (*home, image.clone())));
+            }
+            self.running_blocks.fetch_sub(running.len() as u64, Ordering::Relaxed);
+            // A block logged again needs no revoke: replay applies the
+            // newer copy after the old one
+            let mut revoked = std::mem::take(&mut state.revoked);
+            revoked.retain(|block| !running.contains_key(block));
+            if running.is_empty() && revoked.is_empty() {
+                state.done = tid + 1;
+                self.changed.notify_all();
+                return (state, Ok(()));
+            }
+
+            let sequence = state.sequence;
+            let head = state.head;
+            state.sequence += 1;
+            state.committing = true;
+            self.changed.notify_all();
+            drop(state);
+
+            let mut stats = JournalStats::default();
+            let result = self.write_transaction(sequence, head, &running, &revoked, &mut stats);
+
+            state = self.state.lock().unwrap();
+            state.committing = false;
+            let s = &mut state.stats;
+            s.commits += stats.commits;
+            s.logged_blocks += stats.logged_blocks;
+            s.revoked_blocks += stats.revoked_blocks;
+            s.checkpoints += stats.checkpoints;
+            s.syncs += stats.syncs;
+            // A block revoked while the log was written keeps its committed
+            // image until the revoke itself commits, but a failed attempt
+            // must not log it again
+            let revoked_since: HashSet<u64> = state.revoked.iter().copied().collect();
+            for shard in &self.shards {
+                let mut shard = shard.lock().unwrap();
+                let committed = std::mem::take(&mut shard.committing);
+                for (home, image) in committed {
+                    match result {
+                        Ok(_) => {
+                            shard.checkpoint.insert(home, image);
+                        }
+                        // Keep the blocks for the next attempt
+                        Err(_) => {
+                            if !shard.running.contains_key(&home) && !revoked_since.contains(&home) {
+                                shard.running.insert(home, image);
+                                self.running_blocks.fetch_add(1, Ordering::Relaxed);
+                            }
+                        }
+                    }
+                }
+            }
+            match result {
+                Ok(next) => state.head = next,
+                Err(e) => {
+                    state.revoked.extend(revoked);
+                    self.changed.notify_all();
+                    return (state, Err(e));
+                }
+            }
+            // The revokes are in the log now, so the older images must not
+            // be written home over the blocks' next owners. Until this
+            // point a checkpoint may still write them: the allocator keeps
+            // the blocks until this transaction is done.
+            for block in &revoked {
+                self.shard(*block).lock().unwrap().checkpoint.remove(block);
+            }
+            state.done = tid + 1;
+            self.changed.notify_all();
+            if !(state.locked && state.handles == 0) {
+                return (state, Ok(()));
+            }
+        }
+    }
+
+    // Ask for a commit of transaction `tid` (or a later one) and wait for it
+    fn commit_and_wait<'a>(&'a self, mut state: MutexGuard<'a, JournalState>, tid: u64) -> io::Result<()> {
+        state.locked = true;
+        loop {
+            if state.done > tid {
+                return Ok(());
+            }
+            if state.handles == 0 && !state.committing {
+                let (next, result) = self.commit_locked(state);
+                state = next;
+                result?;
+                continue;
+            }
+            state = self.changed.wait(state).unwrap();
+        }
+    }
+
+    // Open a handle: the operations until the matching end() or commit()
+    // land in one transaction, and after a crash either all of them are
+    // replayed or none. Handles nest, and many threads may hold one at
+    // once; a transaction commits only when all its handles are closed.
+    pub fn begin(&self) {
+        let nested = HANDLES.with(|handles| {
+            let n = handles.get();
+            handles.set(n + 1);
+            return n > 0;
+        });
+        let mut state = self.state.lock().unwrap();
+        while !nested && state.locked {
+            state = self.changed.wait(state).unwrap();
+        }
+        state.handles += 1;
+    }
+
+    fn close_handle(&self, force: bool) -> io::Result<()> {
+        let outermost = HANDLES.with(|handles| {
+            let n = handles.get().saturating_sub(1);
+            handles.set(n);
+            return n == 0;
+        });
+        let mut state = self.state.lock().unwrap();
+        state.handles = state.handles.saturating_sub(1);
+        state.ops += 1;
+        if !outermost {
+            return Ok(());
+        }
+        if force {
+            let tid = state.tid;
+            return self.commit_and_wait(state, tid);
+        }
+        if state.ops >= GROUP_COMMIT_OPS
+            || self.running_blocks.load(Ordering::Relaxed) >= self.blocks / 4
+        {
+            state.locked = true;
+        }
+        if state.locked && state.handles == 0 && !state.committing {
+            return self.commit_locked(state).1;
+        }
+        return Ok(());
+    }
+
+    // Close a handle and wait until its transaction has committed
+    pub fn commit(&self) -> io::Result<()> {
+        return self.close_handle(true);
+    }
+
+    // Close a handle without forcing a commit; the transaction goes out
+    // with the next group commit
+    pub fn end(&self) -> io::Result<()> {
+        return self.close_handle(false);
+    }
+
+    // Transaction the operations of an open handle belong to
+    pub fn running_tid(&self) -> u64 {
+        return self.state.lock().unwrap().tid;
+    }
+
+    // Every transaction below this one has committed
+    pub fn committed_tid(&self) -> u64 {
+        return self.state.lock().unwrap().done;
+    }
+
+    // Block `block` was freed: forget any pending copy of it and keep
+    // logged copies from being replayed over its next owner
+    pub fn revoke(&self, block: u64) {
+        let mut shard = self.shard(block).lock().unwrap();
+        if shard.running.remove(&block).is_some() {
+            self.running_blocks.fetch_sub(1, Ordering::Relaxed);
+        }
+        // Only blocks awaiting checkpoint or being committed have copies
+        // in the log. The checkpoint image stays until the revoke commits:
+        // if the log fills up first, the checkpoint must still write it
+        // home, or a crash would lose it with the log.
+        let logged = shard.checkpoint.contains_key(&block) || shard.committing.contains_key(&block);
+        drop(shard);
+        if logged {
+            self.state.lock().unwrap().revoked.push(block);
+        }
+    }
+
+    // Commit and checkpoint, leaving an empty log (clean unmount). No other
+    // thread may be using the journal.
+    pub fn shutdown(&self) -> io::Result<()> {
+        let mut state = self.state.lock().unwrap();
+        while state.committing {
+            state = self.changed.wait(state).unwrap();
+        }
+        state.handles = 0;
+        HANDLES.with(|handles| handles.set(0));
+        let (mut state, result) = self.commit_locked(state);
+        result?;
+        return self.checkpoint_locked(&mut state);
+    }
+
+    pub fn stats(&self) -> JournalStats {
+        return self.state.lock().unwrap().stats.clone();
+    }
+
+    pub fn print_journal(&self) {
+        let state = self.state.lock().unwrap();
+        let s = &state.stats;
+        let checkpoint: usize = self.shards.iter().map(|shard| shard.lock().unwrap().checkpoint.len()).sum();
+        println!("Journal");
+        println!("  next transaction:      {}", state.sequence);
+        println!("  uncommitted blocks:    {}", self.running_blocks.load(Ordering::Relaxed));
+        println!("  awaiting checkpoint:   {}", checkpoint);
+        println!("  log used:              {} / {} blocks", state.head - self.start - 1, self.blocks - 1);
+        println!(
+            "  commits {}, blocks logged {}, revoked {}, checkpoints {}, syncs {}, replayed {}",
+            s.commits, s.logged_blocks, s.revoked_blocks, s.checkpoints, s.syncs, s.replayed_transactions
+        );
+    }
+}
+
+// Metadata I/O goes through the journal: reads see the newest version of a
+// block, writes join the running transaction
+impl BlockDevice for Journal {
+    fn num_blocks(&self) -> u64 {
+        return self.device.num_blocks();
+    }
+
+    fn read_block(&self, block: u64, buf: &mut [u8]) -> io::Result<()> {
+        {
+            let shard = self.shard(block).lock().unwrap();
+            let image = shard
+                .running
+                .get(&block)
+                .or_else(|| shard.committing.get(&block))
+                .or_else(|| shard.checkpoint.get(&block));
+            if let Some(image) = image {
+                buf.copy_from_slice(image);
+                return Ok(());
+            }
+        }
+        return self.device.read_block(block, buf);
+    }
+
+    fn write_block(&self, block: u64, buf: &[u8]) -> io::Result<()> {
+        if buf.len() != BLOCK_SIZE {
+            return Err(io::Error::new(io::ErrorKind::InvalidInput, "not one block"));
+        }
+        let mut shard = self.shard(block).lock().unwrap();
+        let added = shard.running.insert(block, Arc::from(buf)).is_none();
+        drop(shard);
+        // A quarter of the log is full: commit once the open handles
+        // close, rather than let new ones grow the transaction past the
+        // log. Checking only when a handle closes is too late for a big
+        // operation or many concurrent ones.
+        if added && self.running_blocks.fetch_add(1, Ordering::Relaxed) + 1 >= self.blocks / 4 {
+            let mut state = self.state.lock().unwrap();
+            if state.handles > 0 {
+                state.locked = true;
+            }
+        }
+        return Ok(());
+    }
+
+    // Commit everything done so far. A thread holding a handle cannot wait
+    // for its own transaction; it commits when the handle is closed.
+    fn sync(&self) -> io::Result<()> {
+        if HANDLES.with(|handles| handles.get()) > 0 {
+            return Ok(());
+        }
+        let state = self.state.lock().unwrap();
+        let tid = state.tid;
+        return self.commit_and_wait(state, tid);
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::disk::MemDisk;
+    use std::sync::atomic::AtomicBool;
+
+    const LOG_START: u64 = 1;
+    const LOG_BLOCKS: u64 = 16;
+
+    fn block_of(byte: u8) -> Vec<u8> {
+        return vec![byte; BLOCK_SIZE];
+    }
+
+    fn read(device: &dyn BlockDevice, block: u64) -> Vec<u8> {
+        let mut buf = vec![0u8; BLOCK_SIZE];
+        device.read_block(block, &mut buf).unwrap();
+        return buf;
+    }
+
+    // A journal on a fresh device, and the device
+    fn journal() -> (Arc<dyn BlockDevice>, Journal) {
+        let device: Arc<dyn BlockDevice> = Arc::new(MemDisk::new(256));
+        let journal = Journal::create(device.clone(), LOG_START, LOG_BLOCKS).unwrap();
+        return (device, journal);
+    }
+
+    // Lose everything not on the device, then mount again
+    fn crash(device: &Arc<dyn BlockDevice>, journal: Journal) -> Journal {
+        std::mem::forget(journal);
+        return Journal::open(device.clone(), LOG_START, LOG_BLOCKS).unwrap();
+    }
+
+    // Fails commit blocks on request, as a crash between the log and the
+    // commit would
+    struct FailingDisk {
+        disk: MemDisk,
+        fail_commits: AtomicBool,
+    }
+
+    impl BlockDevice for FailingDisk {
+        fn num_blocks(&self) -> u64 {
+            return self.disk.num_blocks();
+        }
+
+        fn read_block(&self, block: u64, buf: &mut [u8]) -> io::Result<()> {
+            return self.disk.read_block(block, buf);
+        }
+
+        fn write_block(&self, block: u64, buf: &[u8]) -> io::Result<()> {
+            if self.fail_commits.load(Ordering::Relaxed) && get_u64(buf, 0) == COMMIT_MAGIC {
+                return Err(io::Error::new(io::ErrorKind::Other, "commit failed"));
+            }
+            return self.disk.write_block(block, buf);
+        }
+
+        fn sync(&self) -> io::Result<()> {
+            return self.disk.sync();
+        }
+    }
+
+    fn transaction(journal: &Journal, blocks: &[(u64, u8)]) {
+        journal.begin();
+        for &(home, byte) in blocks {
+            journal.write_block(home, &block_of(byte)).unwrap();
+        }
+        journal.commit().unwrap();
+    }
+
+    #[test]
+    fn committed_transactions_are_replayed() {
+        let (device, journal) = journal();
+        transaction(&journal, &[(100, 1), (101, 2), (150, 3)]);
+        // In the log, not home yet, but reads see it
+        assert_eq!(read(&*device, 100), block_of(0));
+        assert_eq!(read(&journal, 100), block_of(1));
+
+        let journal = crash(&device, journal);
+        assert_eq!(journal.stats().replayed_transactions, 1);
+        assert_eq!(read(&*device, 100), block_of(1));
+        assert_eq!(read(&*device, 101), block_of(2));
+        assert_eq!(read(&*device, 150), block_of(3));
+        // Replay leaves an empty log
+        let journal = crash(&device, journal);
+        assert_eq!(journal.stats().replayed_transactions, 0);
+    }
+
+    #[test]
+    fn open_handles_are_not_replayed() {
+        let (device, journal) = journal();
+        transaction(&journal, &[(100, 1)]);
+        journal.begin();
+        journal.write_block(100, &block_of(2)).unwrap();
+        journal.write_block(101, &block_of(2)).unwrap();
+        journal.end().unwrap();
+        let journal = crash(&device, journal);
+        assert_eq!(read(&*device, 100), block_of(1));
+        assert_eq!(read(&*device, 101), block_of(0));
+        drop(journal);
+    }
+
+    #[test]
+    fn torn_transaction_is_ignored() {
+        let (device, journal) = journal();
+        transaction(&journal, &[(100, 1)]);
+        transaction(&journal, &[(101, 2)]);
+        // Second transaction: descriptor, image, commit after the first
+        // one's three blocks and the header
+        device.write_block(LOG_START + 5, &block_of(9)).unwrap();
+        let journal = crash(&device, journal);
+        assert_eq!(journal.stats().replayed_transactions, 1);
+        assert_eq!(read(&*device, 100), block_of(1));
+        assert_eq!(read(&*device, 101), block_of(0));
+    }
+
+    #[test]
+    fn revoked_blocks_are_not_replayed() {
+        let (device, journal) = journal();
+        transaction(&journal, &[(100, 1), (101, 1)]);
+        // Block 100 is freed and reused for file data, written in place
+        journal.begin();
+        journal.revoke(100);
+        device.write_block(100, &block_of(7)).unwrap();
+        journal.commit().unwrap();
+        let journal = crash(&device, journal);
+        assert_eq!(journal.stats().replayed_transactions, 2);
+        assert_eq!(read(&*device, 100), block_of(7));
+        assert_eq!(read(&*device, 101), block_of(1));
+
+        // Logged again after the revoke: the newer copy wins
+        transaction(&journal, &[(101, 2)]);
+        journal.begin();
+        journal.revoke(101);
+        journal.commit().unwrap();
+        transaction(&journal, &[(101, 3)]);
+        let journal = crash(&device, journal);
+        assert_eq!(journal.stats().replayed_transactions, 3);
+        assert_eq!(read(&*device, 101), block_of(3));
+    }
+
+    #[test]
+    fn revoked_blocks_survive_a_failed_commit() {
+        let disk = Arc::new(FailingDisk { disk: MemDisk::new(256), fail_commits: AtomicBool::new(false) });
+        let device: Arc<dyn BlockDevice> = disk.clone();
+        let journal = Journal::create(device.clone(), LOG_START, 8).unwrap();
+        transaction(&journal, &[(100, 1), (101, 1)]);
+        // The next transaction does not fit behind the first one, so the
+        // log is checkpointed before it is written; 101 is still in use
+        // until the revoke commits, and must reach home
+        disk.fail_commits.store(true, Ordering::Relaxed);
+        journal.begin();
+        journal.revoke(101);
+        journal.write_block(100, &block_of(2)).unwrap();
+        assert!(journal.commit().is_err());
+        assert!(journal.stats().checkpoints > 0);
+        std::mem::forget(journal);
+        let journal = Journal::open(device.clone(), LOG_START, 8).unwrap();
+        assert_eq!(read(&*device, 100), block_of(1));
+        assert_eq!(read(&*device, 101), block_of(1));
+        drop(journal);
+    }
+
+    #[test]
+    fn full_log_is_checkpointed() {
+        let (device, journal) = journal();
+        for i in 0..20u8 {
+            transaction(&journal, &[(100 + i as u64 % 4, i), (120, i)]);
+        }
+        assert!(journal.stats().checkpoints > 0);
+        let journal = crash(&device, journal);
+        for i in 16..20u8 {
+            assert_eq!(read(&*device, 100 + i as u64 % 4), block_of(i));
+        }
+        assert_eq!(read(&*device, 120), block_of(19));
+
+        // Too big for the log: refused, and nothing is written in place
+        journal.begin();
+        for i in 0..LOG_BLOCKS {
+            journal.write_block(200 + i, &block_of(5)).unwrap();
+        }
+        assert_eq!(journal.commit().unwrap_err().kind(), io::ErrorKind::StorageFull);
+        let journal = crash(&device, journal);
+        for i in 0..LOG_BLOCKS {
+            assert_eq!(read(&*device, 200 + i), block_of(0));
+        }
+        drop(journal);
+    }
+
+    #[test]
+    fn concurrent_handles_share_transactions() {
+        let device: Arc<dyn BlockDevice> = Arc::new(MemDisk::new(1024));
+        let journal = Journal::create(device.clone(), LOG_START, 128).unwrap();
+        std::thread::scope(|s| {
+            for t in 0..4u64 {
+                let journal = &journal;
+                s.spawn(move || {
+                    for i in 0..100u64 {
+                        journal.begin();
+                        journal.write_block(200 + t * 100 + i, &block_of(t as u8 + 1)).unwrap();
+                        journal.write_block(150, &block_of(9)).unwrap();
+                        journal.end().unwrap();
+                    }
+                });
+            }
+        });
+        journal.sync().unwrap();
+        assert!(journal.stats().commits < 400);
+        std::mem::forget(journal);
+        let _journal = Journal::open(device.clone(), LOG_START, 128).unwrap();
+        for t in 0..4u64 {
+            for i in 0..100u64 {
+                assert_eq!(read(&*device, 200 + t * 100 + i), block_of(t as u8 + 1));
+            }
+        }
+        assert_eq!(read(&*device, 150), block_of(9));
+    }
+
+    #[test]
+    fn transaction_ids() {
+        let (_device, journal) = journal();
+        let tid = journal.running_tid();
+        assert_eq!(journal.committed_tid(), tid);
+        transaction(&journal, &[(100, 1)]);
+        assert!(journal.committed_tid() > tid);
+        assert_eq!(journal.running_tid(), journal.committed_tid());
+    }
+}
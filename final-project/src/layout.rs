@@ -0,0 +1,428 @@
+// On-disk format. An image is a sequence of BLOCK_SIZE blocks:
+//
+//   block 0            superblock
+//   journal            header block, then the write-ahead log
+//   inode bitmap       one bit per inode
+//   block bitmap       one bit per block of the image (metadata included)
+//   inode table        INODE_SIZE bytes per inode
+//   data blocks
+//
+// All integers are little-endian. Inode 0 and block 0 are never handed
+// out, so 0 doubles as "no inode" / "no block".
+
+use crate::disk::BLOCK_SIZE;
+
+pub const MAGIC: u64 = u64::from_le_bytes(*b"CPSC351F");
+pub const VERSION: u32 = 2;
+pub const NUM_DIRECT_POINTERS: usize = 10;
+pub const NUM_INDIRECT_POINTERS: usize = 3; // single, double, triple
+pub const PTRS_PER_BLOCK: u64 = (BLOCK_SIZE / 8) as u64;
+pub const INODE_SIZE: usize = 256;
+pub const INODES_PER_BLOCK: u64 = (BLOCK_SIZE / INODE_SIZE) as u64;
+pub const BITS_PER_BLOCK: u64 = (BLOCK_SIZE * 8) as u64;
+pub const NAME_MAX: usize = 128;
+
+const NAME_OFFSET: usize = INODE_SIZE - NAME_MAX;
+
+pub fn get_u32(buf: &[u8], offset: usize) -> u32 {
+    return u32::from_le_bytes(buf[offset..offset + 4].try_into().unwrap());
+}
+
+pub fn get_u64(buf: &[u8], offset: usize) -> u64 {
+    return u64::from_le_bytes(buf[offset..offset + 8].try_into().unwrap());
+}
+
+pub fn put_u32(buf: &mut [u8], offset: usize, value: u32) {
+    buf[offset..offset + 4].copy_from_slice(&value.to_le_bytes());
+}
+
+pub fn put_u64(buf: &mut [u8], offset: usize, value: u64) {
+    buf[offset..offset + 8].copy_from_slice(&value.to_le_bytes());
+}
+
+fn blocks_for_bits(bits: u64) -> u64 {
+    return (bits + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK;
+}
+
+#[derive(Clone, Debug)]
+pub struct Superblock {
+    pub num_blocks: u64,
+    pub num_inodes: u64,
+    pub journal_start: u64,
+    pub journal_blocks: u64,
+    pub inode_bitmap_start: u64,
+    pub block_bitmap_start: u64,
+    pub inode_table_start: u64,
+    pub data_start: u64,
+}
+
+impl Superblock {
+    // Lay out a fresh image: one inode per four blocks, and 1/64 of the
+    // image (between 256 KB and 64 MB) for the journal. The journal
+    // refuses transactions bigger than itself, so even the smallest one
+    // must hold the metadata of any single operation.
+    pub fn new(num_blocks: u64) -> Self {
+        let num_inodes = ((num_blocks / 4).max(INODES_PER_BLOCK) + INODES_PER_BLOCK - 1)
+            / INODES_PER_BLOCK
+            * INODES_PER_BLOCK;
+        let journal_start = 1;
+        let journal_blocks = (num_blocks / 64).clamp(64, 16384);
+        let inode_bitmap_start = journal_start + journal_blocks;
+        let block_bitmap_start = inode_bitmap_start + blocks_for_bits(num_inodes);
+        let inode_table_start = block_bitmap_start + blocks_for_bits(num_blocks);
+        let data_start = inode_table_start + num_inodes / INODES_PER_BLOCK;
+        return Self {
+            num_blocks,
+            num_inodes,
+            journal_start,
+            journal_blocks,
+            inode_bitmap_start,
+            block_bitmap_start,
+            inode_table_start,
+            data_start,
+        };
+    }
+
+    pub fn inode_bitmap_blocks(&self) -> u64 {
+        return blocks_for_bits(self.num_inodes);
+    }
+
+    pub fn block_bitmap_blocks(&self) -> u64 {
+        return blocks_for_bits(self.num_blocks);
+    }
+
+    // Block holding inode `id` and the inode's byte offset inside it
+    pub fn inode_location(&self, id: u64) -> (u64, usize) {
+        return (
+            self.inode_table_start + id / INODES_PER_BLOCK,
+            (id % INODES_PER_BLOCK) as usize * INODE_SIZE,
+        );
+    }
+
+    pub fn encode(&self, buf: &mut [u8]) {
+        buf.fill(0);
+        put_u64(buf, 0, MAGIC);
+        put_u32(buf, 8, VERSION);
+        put_u32(buf, 12, BLOCK_SIZE as u32);
+        put_u64(buf, 16, self.num_blocks);
+        put_u64(buf, 24, self.num_inodes);
+        put_u64(buf, 32, self.inode_bitmap_start);
+        put_u64(buf, 40, self.block_bitmap_start);
+        put_u64(buf, 48, self.inode_table_start);
+        put_u64(buf, 56, self.data_start);
+        put_u64(buf, 64, self.journal_start);
+        put_u64(buf, 72, self.journal_blocks);
+    }
+
+    pub fn decode(buf: &[u8]) -> Option<Self> {
+        if get_u64(buf, 0) != MAGIC
+            || get_u32(buf, 8) != VERSION
+            || get_u32(buf, 12) != BLOCK_SIZE as u32
+        {
+            return None;
+        }
+        return Some(Self {
+            num_blocks: get_u64(buf, 16),
+            num_inodes: get_u64(buf, 24),
+            inode_bitmap_start: get_u64(buf, 32),
+            block_bitmap_start: get_u64(buf, 40),
+            inode_table_start: get_u64(buf, 48),
+            data_start: get_u64(buf, 56),
+            journal_start: get_u64(buf, 64),
+            journal_blocks: get_u64(buf, 72),
+        });
+    }
+}
+
+#[derive(Clone, Copy, Debug, PartialEq)]
+pub enum FileType {
+    RegularFile,
+    Directory,
+}
+
+// Inode Structure
+//
+// On disk (INODE_SIZE bytes):
+//   0    type (0 = free, 1 = file, 2 = directory)
+//   1    name length
+//   8    size
+//   16   direct pointers
+//   96   single, double and triple indirect pointers
+//   128  name
+//
+// A directory's entries are kept in its data blocks (see dir.rs).
+#[derive(Clone, Debug)]
+pub struct Inode {
+    pub id: u64,
+    pub name: String,
+    pub size: u64,
+    pub file_type: FileType,
+    pub direct_pointers: [Option<u64>; NUM_DIRECT_POINTERS],
+    pub indirect_pointers: [Option<u64>; NUM_INDIRECT_POINTERS],
+}
+
+impl Inode {
+    pub fn new(id: u64, name: &str, file_type: FileType) -> Self {
+        return Self {
+            id,
+            name: name.to_string(),
+            size: 0,
+            file_type,
+            direct_pointers: [None; NUM_DIRECT_POINTERS],
+            indirect_pointers: [None; NUM_INDIRECT_POINTERS],
+        };
+    }
+
+    pub fn encode(&self, buf: &mut [u8]) {
+        buf[..INODE_SIZE].fill(0);
+        buf[0] = match self.file_type {
+            FileType::RegularFile => 1,
+            FileType::Directory => 2,
+        };
+        buf[1] = self.name.len() as u8;
+        put_u64(buf, 8, self.size);
+        for (i, pointer) in self.direct_pointers.iter().enumerate() {
+            put_u64(buf, 16 + i * 8, pointer.unwrap_or(0));
+        }
+        for (i, pointer) in self.indirect_pointers.iter().enumerate() {
+            put_u64(buf, 96 + i * 8, pointer.unwrap_or(0));
+        }
+        buf[NAME_OFFSET..NAME_OFFSET + self.name.len()].copy_from_slice(self.name.as_bytes());
+    }
+
+    // None for a free slot
+    pub fn decode(id: u64, buf: &[u8]) -> Option<Self> {
+        let file_type = match buf[0] {
+            1 => FileType::RegularFile,
+            2 => FileType::Directory,
+            _ => return None,
+        };
+        let name_len = buf[1] as usize;
+        let name = String::from_utf8_lossy(&buf[NAME_OFFSET..NAME_OFFSET + name_len]);
+        let mut inode = Inode::new(id, &name, file_type);
+        inode.size = get_u64(buf, 8);
+        for i in 0..NUM_DIRECT_POINTERS {
+            let block = get_u64(buf, 16 + i * 8);
+            inode.direct_pointers[i] = if block == 0 { None } else { Some(block) };
+        }
+        for i in 0..NUM_INDIRECT_POINTERS {
+            let block = get_u64(buf, 96 + i * 8);
+            inode.indirect_pointers[i] = if block == 0 { None } else { Some(block) };
+        }
+        return Some(inode);
+    }
+}
+
+// Allocation bitmap, held in memory and written back one block at a time
+pub struct Bitmap {
+    words: Vec<u64>,
+    len: u64,
+}
+
+const WORDS_PER_BLOCK: usize = BLOCK_SIZE / 8;
+
+impl Bitmap {
+    pub fn new(len: u64) -> Self {
+        let blocks = blocks_for_bits(len) as usize;
+        return Self {
+            words: vec![0; blocks * WORDS_PER_BLOCK],
+            len,
+        };
+    }
+
+    pub fn len(&self) -> u64 {
+        return self.len;
+    }
+
+    pub fn count_ones(&self) -> u64 {
+        return self.words.iter().map(|w| w.count_ones() as u64).sum();
+    }
+
+    pub fn get(&self, bit: u64) -> bool {
+        return self.words[(bit / 64) as usize] & (1 << (bit % 64)) != 0;
+    }
+
+    pub fn set(&mut self, bit: u64, value: bool) {
+        let word = &mut self.words[(bit / 64) as usize];
+        if value {
+            *word |= 1 << (bit % 64);
+        } else {
+            *word &= !(1 << (bit % 64));
+        }
+    }
+
+    // First clear bit in [from, end)
+    pub fn next_free(&self, from: u64, end: u64) -> Option<u64> {
+        let end = end.min(self.len);
+        let mut bit = from;
+        while bit < end {
+            let shift = bit % 64;
+            let free = !self.words[(bit / 64) as usize] >> shift;
+            if free != 0 {
+                let found = bit + free.trailing_zeros() as u64;
+                return if found < end { Some(found) } else { None };
+            }
+            bit += 64 - shift;
+        }
+        return None;
+    }
+
+    // First clear bit at or after `hint`, wrapping around once
+    pub fn find_free(&self, hint: u64) -> Option<u64> {
+        return self
+            .next_free(hint, self.len)
+            .or_else(|| self.next_free(0, hint));
+    }
+
+    // Number of clear bits starting at `start`, counting at most `max`
+    pub fn free_run(&self, start: u64, max: u64) -> u64 {
+        let mut run = 0;
+        let mut bit = start;
+        while run < max && bit < self.len {
+            let shift = bit % 64;
+            let word = self.words[(bit / 64) as usize] >> shift;
+            let n = (word.trailing_zeros() as u64).min(64 - shift);
+            run += n;
+            bit += n;
+            if n < 64 - shift {
+                break;
+            }
+        }
+        return run.min(max).min(self.len.saturating_sub(start));
+    }
+
+    // The first run of `want` clear bits at or after `hint` (wrapping
+    // around), or failing that the longest shorter run
+    pub fn find_run(&self, hint: u64, want: u64) -> Option<(u64, u64)> {
+        let mut best = (0, 0);
+        for (from, end) in [(hint, self.len), (0, hint)] {
+            let mut bit = from;
+            while let Some(start) = self.next_free(bit, end) {
+                let run = self.free_run(start, want.min(end - start));
+                if run >= want {
+                    return Some((start, want));
+                }
+                if run > best.1 {
+                    best = (start, run);
+                }
+                bit = start + run;
+            }
+        }
+        return if best.1 > 0 { Some(best) } else { None };
+    }
+
+    pub fn set_range(&mut self, start: u64, len: u64, value: bool) {
+        for bit in start..start + len {
+            self.set(bit, value);
+        }
+    }
+
+    // Index of the bitmap block that holds `bit`
+    pub fn block_of(bit: u64) -> u64 {
+        return bit / BITS_PER_BLOCK;
+    }
+
+    pub fn load_block(&mut self, index: u64, buf: &[u8]) {
+        let start = index as usize * WORDS_PER_BLOCK;
+        for i in 0..WORDS_PER_BLOCK {
+            self.words[start + i] = get_u64(buf, i * 8);
+        }
+    }
+
+    pub fn store_block(&self, index: u64, buf: &mut [u8]) {
+        let start = index as usize * WORDS_PER_BLOCK;
+        for i in 0..WORDS_PER_BLOCK {
+            put_u64(buf, i * 8, self.words[start + i]);
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn superblock_round_trip() {
+        let sb = Superblock::new(100000);
+        assert!(sb.journal_start < sb.inode_bitmap_start);
+        assert!(sb.inode_bitmap_start < sb.block_bitmap_start);
+        assert!(sb.block_bitmap_start < sb.inode_table_start);
+        assert!(sb.inode_table_start < sb.data_start);
+        assert!(sb.data_start < sb.num_blocks);
+        let mut buf = [0u8; BLOCK_SIZE];
+        sb.encode(&mut buf);
+        let back = Superblock::decode(&buf).unwrap();
+        assert_eq!(back.num_blocks, sb.num_blocks);
+        assert_eq!(back.num_inodes, sb.num_inodes);
+        assert_eq!(back.journal_start, sb.journal_start);
+        assert_eq!(back.journal_blocks, sb.journal_blocks);
+        assert_eq!(back.inode_bitmap_start, sb.inode_bitmap_start);
+        assert_eq!(back.block_bitmap_start, sb.block_bitmap_start);
+        assert_eq!(back.inode_table_start, sb.inode_table_start);
+        assert_eq!(back.data_start, sb.data_start);
+    }
+
+    #[test]
+    fn superblock_rejects_other_images() {
+        let mut buf = [0u8; BLOCK_SIZE];
+        assert!(Superblock::decode(&buf).is_none());
+        Superblock::new(1000).encode(&mut buf);
+        put_u32(&mut buf, 8, VERSION + 1);
+        assert!(Superblock::decode(&buf).is_none());
+    }
+
+    #[test]
+    fn inode_round_trip() {
+        let mut inode = Inode::new(7, &"n".repeat(NAME_MAX), FileType::Directory);
+        inode.size = 1 << 40;
+        inode.direct_pointers[0] = Some(100);
+        inode.direct_pointers[NUM_DIRECT_POINTERS - 1] = Some(u64::MAX);
+        inode.indirect_pointers[2] = Some(12345);
+        let mut buf = [0xffu8; INODE_SIZE];
+        inode.encode(&mut buf);
+        let back = Inode::decode(7, &buf).unwrap();
+        assert_eq!(back.name, inode.name);
+        assert_eq!(back.size, inode.size);
+        assert_eq!(back.file_type, FileType::Directory);
+        assert_eq!(back.direct_pointers, inode.direct_pointers);
+        assert_eq!(back.indirect_pointers, inode.indirect_pointers);
+        assert!(Inode::decode(7, &[0u8; INODE_SIZE]).is_none());
+    }
+
+    #[test]
+    fn bitmap_runs() {
+        let mut bitmap = Bitmap::new(200);
+        bitmap.set_range(0, 10, true);
+        bitmap.set_range(60, 10, true);
+        assert_eq!(bitmap.count_ones(), 20);
+        assert_eq!(bitmap.next_free(0, 200), Some(10));
+        assert_eq!(bitmap.next_free(60, 70), None);
+        assert_eq!(bitmap.free_run(10, 100), 50);
+        assert_eq!(bitmap.free_run(190, 100), 10);
+        assert_eq!(bitmap.find_run(0, 50), Some((10, 50)));
+        // Longer than any run: the longest one
+        assert_eq!(bitmap.find_run(0, 500), Some((70, 130)));
+        // Wraps around past the end
+        assert_eq!(bitmap.find_run(195, 20), Some((10, 20)));
+        assert_eq!(bitmap.find_free(199), Some(199));
+        bitmap.set_range(0, 200, true);
+        assert_eq!(bitmap.find_free(50), None);
+        assert_eq!(bitmap.find_run(0, 1), None);
+    }
+
+    #[test]
+    fn bitmap_blocks_round_trip() {
+        let mut bitmap = Bitmap::new(BITS_PER_BLOCK + 5);
+        bitmap.set(3, true);
+        bitmap.set(BITS_PER_BLOCK + 4, true);
+        let mut copy = Bitmap::new(BITS_PER_BLOCK + 5);
+        let mut buf = [0u8; BLOCK_SIZE];
+        for index in 0..2 {
+            bitmap.store_block(index, &mut buf);
+            copy.load_block(index, &buf);
+        }
+        assert!(copy.get(3) && copy.get(BITS_PER_BLOCK + 4));
+        assert_eq!(copy.count_ones(), 2);
+        assert_eq!(Bitmap::block_of(BITS_PER_BLOCK + 4), 1);
+    }
+}
@@ -0,0 +1,11 @@
+pub mod alloc;
+pub mod bmap;
+pub mod cache;
+pub mod dir;
+pub mod disk;
+pub mod fs;
+pub mod journal;
+pub mod layout;
+pub mod reader;
+
+pub use fs::FileSystem;
@@ -0,0 +1,253 @@
+// Streaming reads of one file.
+//
+// FileReader fetches a file a chunk at a time: one device request per run
+// of contiguous blocks, at most READ_CHUNK_BLOCKS long, into a buffer the
+// reader keeps for its whole life. fill_buf() (or next_chunk()) lends
+// that buffer out as a slice, so a caller that processes the data in
+// place never copies it and never allocates per read. Read::read copies
+// into the caller's buffer as usual, and Seek moves anywhere in the file.
+//
+// The inode is read-locked only while a chunk is fetched, so a long
+// stream does not hold up writers; each chunk is consistent on its own.
+
+use std::io::{self, BufRead, Read, Seek, SeekFrom};
+
+use crate::disk::BLOCK_SIZE;
+use crate::fs::{FileSystem, InodeRef};
+
+// 256 KB, large enough to bypass the buffer cache
+const READ_CHUNK_BLOCKS: u64 = 64;
+
+pub struct FileReader<'a> {
+    fs: &'a FileSystem,
+    inode: InodeRef,
+    // File offset of the next byte handed out
+    pos: u64,
+    buf: Vec<u8>,
+    // Bytes of `buf` not handed out yet
+    start: usize,
+    end: usize,
+}
+
+impl<'a> FileReader<'a> {
+    pub(crate) fn new(fs: &'a FileSystem, inode: InodeRef) -> Self {
+        return Self {
+            fs,
+            inode,
+            pos: 0,
+            buf: vec![0u8; READ_CHUNK_BLOCKS as usize * BLOCK_SIZE],
+            start: 0,
+            end: 0,
+        };
+    }
+
+    pub fn position(&self) -> u64 {
+        return self.pos;
+    }
+
+    // Current size of the file
+    pub fn len(&self) -> u64 {
+        return self.inode.read().unwrap().size;
+    }
+
+    // Fetch the chunk holding `pos`: the run of blocks starting there,
+    // cut at the chunk size and at the end of the file
+    fn fill(&mut self) -> io::Result<()> {
+        let inode = self.inode.read().unwrap();
+        self.start = 0;
+        self.end = 0;
+        if self.pos >= inode.size {
+            return Ok(());
+        }
+        let bs = BLOCK_SIZE as u64;
+        let first = self.pos / bs;
+        let count = ((inode.size - 1) / bs - first + 1).min(READ_CHUNK_BLOCKS);
+        let (_, block, len) = self.fs.runs(&inode, first, count)?[0];
+        let bytes = (len * bs) as usize;
+        if block == 0 {
+            self.buf[..bytes].fill(0);
+        } else {
+            self.fs.data_device(&inode).read_blocks(block, &mut self.buf[..bytes])?;
+        }
+        self.start = (self.pos - first * bs) as usize;
+        self.end = bytes.min((inode.size - first * bs) as usize);
+        return Ok(());
+    }
+
+    // The rest of the current chunk (fetching the next one if needed),
+    // consumed in full; None at the end of the file
+    pub fn next_chunk(&mut self) -> io::Result<Option<&[u8]>> {
+        if self.start == self.end {
+            self.fill()?;
+        }
+        if self.start == self.end {
+            return Ok(None);
+        }
+        let (start, end) = (self.start, self.end);
+        self.pos += (end - start) as u64;
+        self.start = end;
+        return Ok(Some(&self.buf[start..end]));
+    }
+}
+
+impl Read for FileReader<'_> {
+    fn read(&mut self, out: &mut [u8]) -> io::Result<usize> {
+        let available = self.fill_buf()?;
+        let n = available.len().min(out.len());
+        out[..n].copy_from_slice(&available[..n]);
+        self.consume(n);
+        return Ok(n);
+    }
+}
+
+impl BufRead for FileReader<'_> {
+    fn fill_buf(&mut self) -> io::Result<&[u8]> {
+        if self.start == self.end {
+            self.fill()?;
+        }
+        return Ok(&self.buf[self.start..self.end]);
+    }
+
+    fn consume(&mut self, amt: usize) {
+        let amt = amt.min(self.end - self.start);
+        self.start += amt;
+        self.pos += amt as u64;
+    }
+}
+
+impl Seek for FileReader<'_> {
+    fn seek(&mut self, to: SeekFrom) -> io::Result<u64> {
+        let target = match to {
+            SeekFrom::Start(offset) => Some(offset),
+            SeekFrom::End(delta) => self.len().checked_add_signed(delta),
+            SeekFrom::Current(delta) => self.pos.checked_add_signed(delta),
+        };
+        let target = target.ok_or_else(|| {
+            io::Error::new(io::ErrorKind::InvalidInput, "seek before the start of the file")
+        })?;
+        // Keep the chunk if the target is still inside it
+        let chunk_start = self.pos - self.start as u64;
+        if target >= chunk_start && target < chunk_start + self.end as u64 {
+            self.start = (target - chunk_start) as usize;
+        } else {
+            self.start = 0;
+            self.end = 0;
+        }
+        self.pos = target;
+        return Ok(target);
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::disk::MemDisk;
+    use std::sync::Arc;
+
+    const CHUNK: usize = READ_CHUNK_BLOCKS as usize * BLOCK_SIZE;
+
+    fn pattern(len: usize) -> Vec<u8> {
+        return (0..len).map(|i| (i % 251) as u8).collect();
+    }
+
+    fn mem_fs() -> FileSystem {
+        return FileSystem::format(Arc::new(MemDisk::new(8192))).unwrap();
+    }
+
+    #[test]
+    fn chunks_cover_the_file() {
+        let fs = mem_fs();
+        let sizes = [0, 1, BLOCK_SIZE - 1, BLOCK_SIZE, CHUNK - 1, CHUNK, CHUNK + 1, 3 * CHUNK + 5];
+        for (i, &size) in sizes.iter().enumerate() {
+            let id = fs.create(&format!("/f{}", i)).unwrap();
+            let data = pattern(size);
+            fs.write_to_file(id, &data).unwrap();
+
+            let mut reader = fs.reader(id).unwrap();
+            assert_eq!(reader.len(), size as u64);
+            let mut streamed = Vec::new();
+            while let Some(chunk) = reader.next_chunk().unwrap() {
+                assert!(!chunk.is_empty() && chunk.len() <= CHUNK);
+                streamed.extend_from_slice(chunk);
+            }
+            assert_eq!(streamed, data, "size {}", size);
+            assert_eq!(reader.position(), size as u64);
+            assert!(reader.next_chunk().unwrap().is_none());
+
+            let mut copied = Vec::new();
+            fs.reader(id).unwrap().read_to_end(&mut copied).unwrap();
+            assert_eq!(copied, data, "size {}", size);
+        }
+    }
+
+    #[test]
+    fn holes_and_scattered_blocks() {
+        let fs = mem_fs();
+        let a = fs.create("/a").unwrap();
+        let b = fs.create("/b").unwrap();
+        // Interleaved appends leave each file in many short runs
+        let mut want = Vec::new();
+        for i in 0..40u8 {
+            fs.append(a, &[i; BLOCK_SIZE]).unwrap();
+            fs.append(b, &[!i; BLOCK_SIZE]).unwrap();
+            want.extend_from_slice(&[i; BLOCK_SIZE]);
+        }
+        // And a hole of more than a chunk before the last block
+        let at = (want.len() + CHUNK + 100) as u64;
+        fs.write_at(a, at, b"last").unwrap();
+        want.resize(at as usize, 0);
+        want.extend_from_slice(b"last");
+
+        let mut data = Vec::new();
+        fs.reader(a).unwrap().read_to_end(&mut data).unwrap();
+        assert_eq!(data, want);
+    }
+
+    #[test]
+    fn seek() {
+        let fs = mem_fs();
+        let id = fs.create("/f").unwrap();
+        let data = pattern(2 * CHUNK + 10);
+        fs.write_to_file(id, &data).unwrap();
+        let mut reader = fs.reader(id).unwrap();
+        let mut buf = [0u8; 10];
+
+        // Inside the chunk already fetched
+        reader.read_exact(&mut buf).unwrap();
+        assert_eq!(reader.seek(SeekFrom::Start(1000)).unwrap(), 1000);
+        reader.read_exact(&mut buf).unwrap();
+        assert_eq!(buf, data[1000..1010]);
+        // Back to the start of the chunk, and to its last byte
+        reader.seek(SeekFrom::Start(0)).unwrap();
+        reader.read_exact(&mut buf[..1]).unwrap();
+        assert_eq!(buf[0], data[0]);
+        reader.seek(SeekFrom::Start(CHUNK as u64 - 1)).unwrap();
+        reader.read_exact(&mut buf).unwrap();
+        assert_eq!(buf, data[CHUNK - 1..CHUNK + 9]);
+        // Relative and from the end
+        assert_eq!(reader.seek(SeekFrom::Current(-5)).unwrap(), CHUNK as u64 + 4);
+        reader.read_exact(&mut buf).unwrap();
+        assert_eq!(buf, data[CHUNK + 4..CHUNK + 14]);
+        assert_eq!(reader.seek(SeekFrom::End(-10)).unwrap(), 2 * CHUNK as u64);
+        reader.read_exact(&mut buf).unwrap();
+        assert_eq!(buf, data[2 * CHUNK..]);
+        assert_eq!(reader.read(&mut buf).unwrap(), 0);
+
+        // Past the end reads nothing; before the start is an error
+        assert_eq!(reader.seek(SeekFrom::End(100)).unwrap(), data.len() as u64 + 100);
+        assert_eq!(reader.read(&mut buf).unwrap(), 0);
+        assert!(reader.seek(SeekFrom::Current(-(data.len() as i64) - 101)).is_err());
+        assert_eq!(reader.position(), data.len() as u64 + 100);
+    }
+
+    #[test]
+    fn buf_read_lines() {
+        let fs = mem_fs();
+        let id = fs.create("/lines").unwrap();
+        let text: String = (0..20000).map(|i| format!("line {}\n", i)).collect();
+        fs.write_to_file(id, text.as_bytes()).unwrap();
+        let lines: Vec<String> = fs.reader(id).unwrap().lines().map(|l| l.unwrap()).collect();
+        assert_eq!(lines.len(), 20000);
+        assert_eq!(lines[12345], "line 12345");
+    }
+}
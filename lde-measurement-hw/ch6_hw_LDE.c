@@ -1,16 +1,33 @@
+#define _GNU_SOURCE
 #include <bits/time.h>
 #include <sched.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <linux/futex.h>
 #include <pthread.h>
+#include <stdatomic.h>
+#include "tsc_timer.h"
+#include "perf_counters.h"
 
 #define ONE_HUNDRED_MILLION 100000000LL
 #define BILLION 1000000000LL
 #define NUM_SWITCHES 1000000
+#define NUM_PINGPONGS 100000
+#define NUM_C2C_ROUNDTRIPS 100000
+#define NUM_C2C_WARMUP 1000
+#define CACHE_LINE 64
+#define SYSCALL_BATCH 1000000
+#define SYSCALL_CHUNK 4096  // ops between resets; keeps a pipe below its capacity
+#define SYSCALL_OPS ((SYSCALL_BATCH + SYSCALL_CHUNK - 1) / SYSCALL_CHUNK * SYSCALL_CHUNK)
 
 int localpid(void) {
   static int a[9] = { 0 };
@@ -21,22 +38,47 @@ void print_ns_us_ms(const char* label, uint64_t delta_time) {
   printf("%s%llu ns = %.3f us = %.6f ms\n", label, (unsigned long long) delta_time, delta_time / 1000.0, delta_time / 1.0e6);
 }
 
-#define REPEATS ONE_HUNDRED_MILLION
+// Machine-readable results, enabled by passing a CSV path after the mode
+FILE* csv_out = NULL;
+
+// Record a measured region's timing and counters in the CSV
+void csv_counters(const char* label, double ns_per_op, const struct perf_counters* pc, uint64_t ops) {
+  if (csv_out) {
+    fprintf(csv_out, "\"%s\",ns,%.4f\n", label, ns_per_op);
+    perf_counters_csv(pc, csv_out, label, ops);
+  }
+}
 
-// rdtsc.cpp
-// processor: x86, x64
-// #include <intrin.h>  // INTEL ONLY (will not run on ARM processors like M1, M2, M3)
+// Print counter values already read next to the timing, and record both
+void print_counters(const char* label, double ns_per_op, const struct perf_counters* pc, uint64_t ops) {
+  perf_counters_print(pc, stdout, ops);
+  csv_counters(label, ns_per_op, pc, ops);
+}
+
+// Read a measured region's counters, print them and record them
+void report_counters(const char* label, double ns_per_op, struct perf_counters* pc, uint64_t ops) {
+  perf_counters_read(pc);
+  print_counters(label, ns_per_op, pc, ops);
+}
 
-// #pragma intrinsic(__rdtsc)
+#define REPEATS ONE_HUNDRED_MILLION
 
-uint64_t repeat_rdtsc(void) { 
-  uint64_t i, j;
+// Back-to-back timer reads: the difference is the overhead of the timer
+// itself. Ticks are converted to ns with the calibrated TSC frequency.
+uint64_t repeat_rdtsc(struct perf_counters* pc) { 
+  uint64_t i, j, total = 0;
+  printf("timer source: %s, %.3f MHz\n", timer.use_tsc ? "invariant TSC" : "CLOCK_MONOTONIC_RAW", timer_frequency_hz() / 1e6);
+  perf_counters_reset(pc);
   for (uint64_t k = 0; k < 5; ++k) { 
-    i = __rdtsc();
-    j = __rdtsc();
+    perf_counters_enable(pc);
+    i = timer_start();
+    j = timer_stop();
+    perf_counters_disable(pc);
+    total += timer_ticks_to_ns(j - i);
     printf("i ticks: %llu, j ticks: %llu, j - i ticks: %llu\n", (unsigned long long) i, (unsigned long long) j, (unsigned long long) (j - i));
-    print_ns_us_ms("rtdsc = ", j - i);
+    print_ns_us_ms("rtdsc = ", timer_ticks_to_ns(j - i));
   }
+  report_counters("timer read pair", total / 5.0, pc, 5);
   return REPEATS;
 }
 
@@ -48,26 +90,34 @@ uint64_t repeat_get_time_of_day(void) {
   return REPEATS;
 }
 
-uint64_t measure_generic(const char* label, clockid_t clockid, void* (*fp)(void*), void* args) { 
+uint64_t measure_generic(const char* label, clockid_t clockid, void* (*fp)(void*), void* args, struct perf_counters* pc) { 
   uint64_t diff;
   struct timespec start, end;
 
+  perf_counters_reset(pc);
+  perf_counters_enable(pc);
   clock_gettime(clockid, &start);	/* mark start time */
 
   uint64_t repeats = (uint64_t)fp(args);  // allows for some processes to run multiple times; others only once
 
   clock_gettime(clockid, &end);	/* mark the end time */
+  perf_counters_disable(pc);
 
   diff = BILLION * (end.tv_sec - start.tv_sec) + end.tv_nsec - start.tv_nsec;
   // printf("diff in measure_generic is: %llu\n", diff);
-  if (repeats == REPEATS) { diff /= REPEATS; }   
-  print_ns_us_ms(label, diff);
+  if (repeats != REPEATS) { repeats = 1; }
+  diff /= repeats;
+  printf("%s = ", label);
+  print_ns_us_ms("", diff);
+  report_counters(label, diff, pc, repeats);
 
   return diff;
 }
 
-uint64_t measure_system_call(clockid_t clockid, void* (*fp)(void*), void* args) { 
+uint64_t measure_system_call(clockid_t clockid, void* (*fp)(void*), void* args, struct perf_counters* pc) { 
   struct timespec start, end;
+  perf_counters_reset(pc);
+  perf_counters_enable(pc);
   // Get the start time
   clock_gettime(clockid, &start);
 
@@ -76,6 +126,7 @@ uint64_t measure_system_call(clockid_t clockid, void* (*fp)(void*), void* args)
 
   // Get the end time
   clock_gettime(clockid, &end);
+  perf_counters_disable(pc);
 
   // Calculate elapsed time in miliseconds
   uint64_t diff = (end.tv_sec - start.tv_sec) * BILLION + (end.tv_nsec - start.tv_nsec);
@@ -91,33 +142,53 @@ void* getpid_wrapper(void* args) {
 
 volatile int switch_control = 0;
 
+// Counters only follow the thread that opened them, so each switching
+// thread counts itself into the perf_counters passed as its argument
+void switch_counters_start(struct perf_counters* pc) {
+  perf_counters_open(pc);
+  perf_counters_reset(pc);
+  perf_counters_enable(pc);
+}
+
+void switch_counters_stop(struct perf_counters* pc) {
+  perf_counters_disable(pc);
+  perf_counters_read(pc);
+}
+
 // Thread 1: Yields to Thread 2
 void* thread1_func(void* args) {
+  switch_counters_start(args);
   for (int i = 0; i < NUM_SWITCHES; i++) {
     while (switch_control != 0);  // Busy wait for control
     switch_control = 1;  // Pass control to thread 2
     sched_yield();  // Force context switch
   }
+  switch_counters_stop(args);
   return NULL;
 }
 
 // Thread 2: Yields to Thread 1
 void* thread2_func(void* args) {
+  switch_counters_start(args);
   for (int i = 0; i < NUM_SWITCHES; i++) {
     while (switch_control != 1);  // Busy wait for control
     switch_control = 0;  // Pass control to thread 1
     sched_yield();  // Force context switch
   }
+  switch_counters_stop(args);
   return NULL;
 }
 
-uint64_t measure_context_switching(clockid_t clockid, void* (*fp)(void*), void* args) { 
+// The counters of both threads are summed into `total`, whose values stay
+// valid after its events are closed
+uint64_t measure_context_switching(clockid_t clockid, void* (*fp)(void*), void* args, struct perf_counters* total) { 
   pthread_t thread1, thread2;
+  struct perf_counters pc1, pc2;
   struct timespec start, end;
 
   // Create two threads
-  pthread_create(&thread1, NULL, thread1_func, NULL);
-  pthread_create(&thread2, NULL, thread2_func, NULL);
+  pthread_create(&thread1, NULL, thread1_func, &pc1);
+  pthread_create(&thread2, NULL, thread2_func, &pc2);
 
   // Start time measurement
   clock_gettime(clockid, &start);
@@ -129,30 +200,451 @@ uint64_t measure_context_switching(clockid_t clockid, void* (*fp)(void*), void*
   // End time measurement
   clock_gettime(clockid, &end);
 
+  *total = pc1;
+  perf_counters_add(total, &pc2);
+  perf_counters_close(&pc1);
+  perf_counters_close(&pc2);
+
   // Calculate elapsed time in nanoseconds
   uint64_t elapsed_time = (end.tv_sec - start.tv_sec) * BILLION + (end.tv_nsec - start.tv_nsec);
 
   return elapsed_time;
 }
 
-int main(int argc, char **argv) {
-  measure_generic("elapsed time = ", CLOCK_MONOTONIC, (void *)sleep, (void *)1L);
+// Affinity mask the process started with, and the CPUs in it. CPU ids
+// need not be contiguous (offline CPUs, cpusets, taskset).
+cpu_set_t start_mask;
+int allowed_cpus[CPU_SETSIZE];
+int num_allowed_cpus = 0;
+
+void init_cpus(void) {
+  if (sched_getaffinity(0, sizeof(start_mask), &start_mask)) { perror("sched_getaffinity"); exit(1); }
+  for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+    if (CPU_ISSET(cpu, &start_mask)) { allowed_cpus[num_allowed_cpus++] = cpu; }
+  }
+}
+
+// Pin the calling thread (or process) to a single CPU. A measurement that
+// relies on pinning is meaningless without it, so failure is fatal.
+void pin_to_cpu(int cpu) {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  if (sched_setaffinity(0, sizeof(set), &set)) {
+    fprintf(stderr, "cannot pin to CPU %d: ", cpu);
+    perror("sched_setaffinity");
+    exit(1);
+  }
+}
+
+// Undo pin_to_cpu for the calling thread
+void restore_affinity(void) {
+  if (sched_setaffinity(0, sizeof(start_mask), &start_mask)) { perror("sched_setaffinity"); exit(1); }
+}
+
+uint64_t elapsed_ns(struct timespec* start, struct timespec* end) {
+  return (end->tv_sec - start->tv_sec) * BILLION + (end->tv_nsec - start->tv_nsec);
+}
+
+/*
+ * lmbench-style context switch cost: two processes pinned to the same CPU
+ * pass a token back and forth, so every hand-off forces the scheduler to
+ * switch. The cost of the pipe read/write itself is measured in a single
+ * process and subtracted out.
+ */
+uint64_t measure_pipe_overhead(int cpu) {
+  int p[2];
+  char token = 'x';
+  struct timespec start, end;
+
+  if (pipe(p)) { perror("pipe"); exit(1); }
+  pin_to_cpu(cpu);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int i = 0; i < NUM_PINGPONGS; ++i) {
+    if (write(p[1], &token, 1) != 1 || read(p[0], &token, 1) != 1) { perror("pipe"); exit(1); }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  close(p[0]);
+  close(p[1]);
+  return elapsed_ns(&start, &end) / NUM_PINGPONGS;
+}
+
+uint64_t measure_pipe_switch(int cpu, struct perf_counters* pc) {
+  int to_child[2], to_parent[2];
+  char token = 'x';
+  struct timespec start, end;
+
+  if (pipe(to_child) || pipe(to_parent)) { perror("pipe"); exit(1); }
+  pin_to_cpu(cpu);  // the child inherits the affinity mask
+
+  int rc = fork();
+  if (rc < 0) {
+    fprintf(stderr, "fork failed\n");
+    exit(1);
+  } else if (rc == 0) { // child: echo every token back
+    for (int i = 0; i < NUM_PINGPONGS; ++i) {
+      if (read(to_child[0], &token, 1) != 1 || write(to_parent[1], &token, 1) != 1) { _exit(1); }
+    }
+    _exit(0);
+  }
+
+  perf_counters_reset(pc);
+  perf_counters_enable(pc);
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int i = 0; i < NUM_PINGPONGS; ++i) {
+    if (write(to_child[1], &token, 1) != 1 || read(to_parent[0], &token, 1) != 1) { perror("pipe"); exit(1); }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  perf_counters_disable(pc);
+  waitpid(rc, NULL, 0);
+
+  close(to_child[0]); close(to_child[1]);
+  close(to_parent[0]); close(to_parent[1]);
+
+  // One round trip = two switches, each paying one write + one read
+  uint64_t per_switch = elapsed_ns(&start, &end) / NUM_PINGPONGS / 2;
+  uint64_t overhead = measure_pipe_overhead(cpu);
+  return per_switch > overhead ? per_switch - overhead : 0;
+}
+
+long futex(atomic_int* uaddr, int op, int val) {
+  return syscall(SYS_futex, uaddr, op, val, NULL, NULL, 0);
+}
+
+// Same as measure_pipe_switch, but the token lives in shared memory and the
+// waiter sleeps in the kernel on a futex instead of a pipe
+uint64_t measure_futex_switch(int cpu, struct perf_counters* pc) {
+  struct timespec start, end;
+  atomic_int* turn = mmap(NULL, sizeof(atomic_int), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (turn == MAP_FAILED) { perror("mmap"); exit(1); }
+  atomic_store(turn, 0);
+  pin_to_cpu(cpu);
+
+  int rc = fork();
+  if (rc < 0) {
+    fprintf(stderr, "fork failed\n");
+    exit(1);
+  } else if (rc == 0) { // child: wait for 1, hand back 0
+    for (int i = 0; i < NUM_PINGPONGS; ++i) {
+      while (atomic_load(turn) != 1) { futex(turn, FUTEX_WAIT, 0); }
+      atomic_store(turn, 0);
+      futex(turn, FUTEX_WAKE, 1);
+    }
+    _exit(0);
+  }
+
+  perf_counters_reset(pc);
+  perf_counters_enable(pc);
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int i = 0; i < NUM_PINGPONGS; ++i) {
+    atomic_store(turn, 1);
+    futex(turn, FUTEX_WAKE, 1);
+    while (atomic_load(turn) != 0) { futex(turn, FUTEX_WAIT, 1); }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  perf_counters_disable(pc);
+  waitpid(rc, NULL, 0);
+  munmap(turn, sizeof(atomic_int));
+
+  return elapsed_ns(&start, &end) / NUM_PINGPONGS / 2;
+}
+
+/*
+ * Core-to-core latency: two threads pinned to different cores bounce a
+ * single cache line back and forth with plain atomic stores, so each hop
+ * is one cache-line transfer with no kernel involvement. The responder is
+ * created on its CPU and says when it is running; a few round trips warm
+ * up both sides before the clock starts, so thread start-up and migration
+ * stay out of the result.
+ */
+struct c2c_args {
+  _Alignas(CACHE_LINE) atomic_int flag;   // -1 until the responder runs
+};
+
+void* c2c_responder(void* args) {
+  struct c2c_args* c2c = args;
+  atomic_store_explicit(&c2c->flag, 0, memory_order_release);
+  for (int i = 0; i < NUM_C2C_WARMUP + NUM_C2C_ROUNDTRIPS; ++i) {
+    while (atomic_load_explicit(&c2c->flag, memory_order_acquire) != 1);
+    atomic_store_explicit(&c2c->flag, 0, memory_order_release);
+  }
+  return NULL;
+}
+
+uint64_t measure_core_to_core(int cpu_a, int cpu_b, struct perf_counters* pc) {
+  pthread_t responder;
+  pthread_attr_t attr;
+  cpu_set_t set;
+  struct timespec start, end;
+  struct c2c_args c2c;
+  atomic_store(&c2c.flag, -1);
+
+  pin_to_cpu(cpu_a);
+  CPU_ZERO(&set);
+  CPU_SET(cpu_b, &set);
+  pthread_attr_init(&attr);
+  int rc = pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+  if (rc == 0) { rc = pthread_create(&responder, &attr, c2c_responder, &c2c); }
+  pthread_attr_destroy(&attr);
+  if (rc) { fprintf(stderr, "cannot start a thread on CPU %d: %s\n", cpu_b, strerror(rc)); exit(1); }
+
+  while (atomic_load_explicit(&c2c.flag, memory_order_acquire) != 0);
+  for (int i = 0; i < NUM_C2C_WARMUP; ++i) {
+    atomic_store_explicit(&c2c.flag, 1, memory_order_release);
+    while (atomic_load_explicit(&c2c.flag, memory_order_acquire) != 0);
+  }
+
+  perf_counters_reset(pc);
+  perf_counters_enable(pc);
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int i = 0; i < NUM_C2C_ROUNDTRIPS; ++i) {
+    atomic_store_explicit(&c2c.flag, 1, memory_order_release);
+    while (atomic_load_explicit(&c2c.flag, memory_order_acquire) != 0);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  perf_counters_disable(pc);
+  perf_counters_read(pc);
+  pthread_join(responder, NULL);
+
+  // Report one-way latency (half a round trip)
+  return elapsed_ns(&start, &end) / NUM_C2C_ROUNDTRIPS / 2;
+}
+
+// Counters cover the initiating thread. Each pair goes to the CSV; the
+// sum over all pairs is printed after the matrix.
+void print_core_to_core_matrix(void) {
+  struct perf_counters pc, total;
+  char label[64];
+  uint64_t pairs = 0, total_ns = 0;
+  perf_counters_open(&pc);
+  total = pc;
+  memset(total.values, 0, sizeof(total.values));
+
+  int ncpus = num_allowed_cpus;
+  printf("Core-to-core one-way latency (ns), %d CPUs:\n     ", ncpus);
+  for (int j = 0; j < ncpus; ++j) { printf("%6d", allowed_cpus[j]); }
+  printf("\n");
+  for (int i = 0; i < ncpus; ++i) {
+    printf("%4d ", allowed_cpus[i]);
+    for (int j = 0; j < ncpus; ++j) {
+      if (i == j) { printf("%6s", "-"); continue; }
+      uint64_t ns = measure_core_to_core(allowed_cpus[i], allowed_cpus[j], &pc);
+      printf("%6llu", (unsigned long long) ns);
+      snprintf(label, sizeof(label), "c2c %d->%d", allowed_cpus[i], allowed_cpus[j]);
+      csv_counters(label, ns, &pc, 2 * NUM_C2C_ROUNDTRIPS);
+      perf_counters_add(&total, &pc);
+      total_ns += ns;
+      ++pairs;
+    }
+    printf("\n");
+  }
+  restore_affinity();
+
+  if (pairs) {
+    printf("all pairs, per one-way hop:\n");
+    print_counters("c2c all pairs", (double) total_ns / pairs, &total, 2 * NUM_C2C_ROUNDTRIPS * pairs);
+  }
+  perf_counters_close(&pc);
+}
+
+/*
+ * Amortized system call costs. Each operation runs SYSCALL_BATCH times in
+ * chunks of SYSCALL_CHUNK; an optional reset runs between chunks outside
+ * the timed region (e.g. to drain a pipe). glibc-cached or vDSO-backed
+ * calls are listed next to their raw syscall() equivalents.
+ */
+struct syscall_fds {
+  int dev_zero;
+  int pipe[2];
+};
+
+static struct syscall_fds sc_fds;
+static atomic_int sc_futex_word;
+
+void sc_getpid_raw(void) { syscall(SYS_getpid); }
+void sc_getpid_libc(void) { getpid(); }
+
+void sc_clock_gettime_vdso(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+}
+
+void sc_clock_gettime_raw(void) {
+  struct timespec ts;
+  syscall(SYS_clock_gettime, CLOCK_MONOTONIC, &ts);
+}
+
+void sc_read_dev_zero(void) {
+  char c;
+  if (read(sc_fds.dev_zero, &c, 1) != 1) { perror("read"); exit(1); }
+}
+
+void sc_write_pipe(void) {
+  char c = 'x';
+  if (write(sc_fds.pipe[1], &c, 1) != 1) { perror("write"); exit(1); }
+}
+
+void sc_drain_pipe(void) {
+  char buf[SYSCALL_CHUNK];
+  while (read(sc_fds.pipe[0], buf, sizeof(buf)) > 0);
+}
+
+void sc_futex_wake(void) { futex(&sc_futex_word, FUTEX_WAKE, 1); }
+void sc_sched_yield(void) { sched_yield(); }
+
+struct syscall_op {
+  const char* label;
+  void (*op)(void);
+  void (*reset)(void);
+};
+
+struct syscall_op syscall_ops[] = {
+  { "getpid() (glibc)",              sc_getpid_libc,        NULL },
+  { "syscall(SYS_getpid)",           sc_getpid_raw,         NULL },
+  { "clock_gettime() (vDSO)",        sc_clock_gettime_vdso, NULL },
+  { "syscall(SYS_clock_gettime)",    sc_clock_gettime_raw,  NULL },
+  { "read(/dev/zero, 1)",            sc_read_dev_zero,      NULL },
+  { "write(pipe, 1)",                sc_write_pipe,         sc_drain_pipe },
+  { "futex(FUTEX_WAKE), no waiters", sc_futex_wake,         NULL },
+  { "sched_yield()",                 sc_sched_yield,        NULL },
+};
+
+uint64_t measure_syscall_op(struct syscall_op* op, struct perf_counters* pc) {
+  uint64_t ticks = 0;
+  perf_counters_reset(pc);
+  for (uint64_t done = 0; done < SYSCALL_BATCH; done += SYSCALL_CHUNK) {
+    perf_counters_enable(pc);
+    uint64_t start = timer_start();
+    for (int i = 0; i < SYSCALL_CHUNK; ++i) {
+      op->op();
+    }
+    ticks += timer_stop() - start;
+    perf_counters_disable(pc);
+    if (op->reset) { op->reset(); }
+  }
+  return timer_ticks_to_ns(ticks) * 1000 / SYSCALL_OPS;  // picoseconds per call
+}
+
+int run_syscall(void) {
+  sc_fds.dev_zero = open("/dev/zero", O_RDONLY);
+  if (sc_fds.dev_zero < 0) { perror("open /dev/zero"); exit(1); }
+  if (pipe2(sc_fds.pipe, O_NONBLOCK)) { perror("pipe2"); exit(1); }
+
+  struct perf_counters pc;
+  perf_counters_open(&pc);
+
+  printf("Amortized cost over %d calls:\n", SYSCALL_OPS);
+  for (size_t i = 0; i < sizeof(syscall_ops) / sizeof(syscall_ops[0]); ++i) {
+    uint64_t ps = measure_syscall_op(&syscall_ops[i], &pc);
+    printf("  %-32s %8.1f ns/call\n", syscall_ops[i].label, ps / 1000.0);
+    report_counters(syscall_ops[i].label, ps / 1000.0, &pc, SYSCALL_OPS);
+  }
+  perf_counters_close(&pc);
+
+  close(sc_fds.dev_zero);
+  close(sc_fds.pipe[0]);
+  close(sc_fds.pipe[1]);
+  return 0;
+}
+
+int run_lde(void) {
+  struct perf_counters pc, switch_pc;
+  perf_counters_open(&pc);
+
+  measure_generic("elapsed time", CLOCK_MONOTONIC, (void *)sleep, (void *)1L, &pc);
 
   /* the time spent sleeping will not count (but there is a bit of overhead */
-  measure_generic("elapsed process CPU time = ", CLOCK_PROCESS_CPUTIME_ID, (void *)sleep, (void*)1L);
+  measure_generic("elapsed process CPU time", CLOCK_PROCESS_CPUTIME_ID, (void *)sleep, (void*)1L, &pc);
 
-  measure_generic("elapsed process CPU time for gettimeofday() = ", CLOCK_PROCESS_CPUTIME_ID, (void *)repeat_get_time_of_day, NULL);
+  measure_generic("elapsed process CPU time for gettimeofday()", CLOCK_PROCESS_CPUTIME_ID, (void *)repeat_get_time_of_day, NULL, &pc);
 
-  repeat_rdtsc();
-  repeat_rdtsc();
+  repeat_rdtsc(&pc);
+  repeat_rdtsc(&pc);
 
-  uint64_t elapsed = measure_system_call(CLOCK_MONOTONIC, getpid_wrapper, NULL);
+  uint64_t elapsed = measure_system_call(CLOCK_MONOTONIC, getpid_wrapper, NULL, &pc);
   printf("Elapsed time for getpid() system call: %llu ns\n", (unsigned long long) elapsed);
+  report_counters("getpid() system call", elapsed, &pc, 1);
 
-  elapsed = measure_context_switching(CLOCK_MONOTONIC, NULL, NULL);
+  elapsed = measure_context_switching(CLOCK_MONOTONIC, NULL, NULL, &switch_pc);
   printf("Elapsed time for context switching: %llu ns\n", (unsigned long long) elapsed);
+  print_counters("sched_yield() context switch", (double) elapsed / (2 * NUM_SWITCHES), &switch_pc, 2 * NUM_SWITCHES);
+
+  perf_counters_close(&pc);
+  return 0;
+}
+
+int run_switch(void) {
+  struct perf_counters pc;
+  perf_counters_open(&pc);
+
+  // Both sides of each ping-pong share the first CPU we may run on
+  int cpu = allowed_cpus[0];
+  uint64_t ns = measure_pipe_switch(cpu, &pc);
+  print_ns_us_ms("pipe ping-pong context switch (same CPU) = ", ns);
+  report_counters("pipe context switch", ns, &pc, 2 * NUM_PINGPONGS);
+
+  ns = measure_futex_switch(cpu, &pc);
+  print_ns_us_ms("futex ping-pong context switch (same CPU) = ", ns);
+  report_counters("futex context switch", ns, &pc, 2 * NUM_PINGPONGS);
 
-  exit(0);
+  restore_affinity();
+  perf_counters_close(&pc);
   return 0;
 }
 
+int run_c2c(void) {
+  print_core_to_core_matrix();
+  return 0;
+}
+
+/*
+ * Benchmark modes, selected by the first command line argument.
+ * With no argument the original LDE measurements run.
+ */
+char *mode_str[] = {
+  "lde",
+  "switch",
+  "c2c",
+  "syscall"
+};
+
+int (*mode_func[]) (void) = {
+  &run_lde,
+  &run_switch,
+  &run_c2c,
+  &run_syscall
+};
+
+int num_modes(void) {
+  return sizeof(mode_str) / sizeof(char *);
+}
+
+int main(int argc, char **argv) {
+  timer_init();
+  init_cpus();
+
+  const char* mode = argc > 1 ? argv[1] : "lde";
+  if (argc > 2) {
+    csv_out = fopen(argv[2], "w");
+    if (csv_out == NULL) { perror(argv[2]); exit(1); }
+    fprintf(csv_out, "label,metric,value\n");
+  }
+
+  for (int i = 0; i < num_modes(); ++i) {
+    if (strcmp(mode, mode_str[i]) == 0) {
+      int rc = mode_func[i]();
+      if (csv_out) { fclose(csv_out); }
+      exit(rc);
+    }
+  }
+
+  fprintf(stderr, "usage: %s [", argv[0]);
+  for (int i = 0; i < num_modes(); ++i) {
+    fprintf(stderr, "%s%s", i ? "|" : "", mode_str[i]);
+  }
+  fprintf(stderr, "] [results.csv]\n");
+  exit(1);
+  return 0;
+}
@@ -0,0 +1,329 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "tsc_timer.h"
+#include "perf_counters.h"
+
+/*
+ * Memory hierarchy and TLB benchmark.
+ *
+ * Latency: a pointer chase through a random cyclic permutation (Sattolo's
+ * algorithm), so every load depends on the previous one and the prefetchers
+ * cannot guess the next line. Two layouts are swept:
+ *   - line chase: one node per 64 B line, shows the L1/L2/L3/DRAM staircase
+ *   - page chase: one node per 4 KB page, shows where the TLB runs out
+ * Bandwidth: sequential scalar and SIMD reads, strided reads and writes.
+ * Bandwidth counts the bytes a kernel loads or stores, so the strided read
+ * (one word per line) shows the rate of useful data, not of line traffic.
+ *
+ * Every sweep, latency and bandwidth, runs with 4 KB pages
+ * (MADV_NOHUGEPAGE), transparent huge pages (MADV_HUGEPAGE) and, when the
+ * kernel has a hugetlb pool, explicit 2 MB pages (MAP_HUGETLB).
+ *
+ * usage: mem_hierarchy [max_size_mb] [results.csv]
+ */
+
+#define KB 1024ULL
+#define MB (1024ULL * KB)
+#define GB (1024ULL * MB)
+#define CACHE_LINE 64
+#define PAGE_SIZE_4K (4 * KB)
+#define HUGE_PAGE_SIZE (2 * MB)
+#define MIN_SIZE (4 * KB)
+#define DEFAULT_MAX_SIZE (1 * GB)
+#define CHASE_ACCESSES (4 * 1000 * 1000)
+#define BANDWIDTH_BYTES (2 * GB)         // bytes moved per bandwidth point
+#define LATENCY_JUMP 1.35                // ratio that marks a new level
+
+enum page_mode { PAGES_4K, PAGES_THP, PAGES_HUGETLB, NUM_PAGE_MODES };
+
+const char* page_mode_str[] = { "4K", "THP", "hugetlb" };
+
+FILE* csv_out = NULL;
+
+// xorshift64*, good enough to shuffle a permutation
+uint64_t rng_state = 0x9E3779B97F4A7C15ULL;
+
+uint64_t rng_next(void) {
+  rng_state ^= rng_state >> 12;
+  rng_state ^= rng_state << 25;
+  rng_state ^= rng_state >> 27;
+  return rng_state * 0x2545F4914F6CDD1DULL;
+}
+
+/*
+ * Map a region with the requested page size. Returns NULL when explicit huge
+ * pages are not available (no hugetlb pool configured).
+ */
+void* map_region(size_t size, enum page_mode mode) {
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+  if (mode == PAGES_HUGETLB) {
+    size = (size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+    flags |= MAP_HUGETLB;
+  }
+  void* p = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+  if (p == MAP_FAILED) { return NULL; }
+  if (mode == PAGES_4K) { madvise(p, size, MADV_NOHUGEPAGE); }
+  if (mode == PAGES_THP) { madvise(p, size, MADV_HUGEPAGE); }
+  memset(p, 0, size);  // fault everything in before timing
+  return p;
+}
+
+void unmap_region(void* p, size_t size, enum page_mode mode) {
+  if (mode == PAGES_HUGETLB) {
+    size = (size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+  }
+  munmap(p, size);
+}
+
+/*
+ * Link nodes spaced `stride` bytes apart into one random cycle. For page
+ * strides each node sits at a different line offset within its page so the
+ * chase does not pile onto a few cache sets.
+ */
+void** build_chase(char* base, size_t size, size_t stride) {
+  size_t n = size / stride;
+  size_t* order = malloc(n * sizeof(size_t));
+  if (order == NULL) { perror("malloc"); exit(1); }
+  for (size_t i = 0; i < n; ++i) { order[i] = i; }
+
+  // Sattolo: a uniformly random permutation that is a single cycle
+  for (size_t i = n - 1; i > 0; --i) {
+    size_t j = rng_next() % i;
+    size_t tmp = order[i]; order[i] = order[j]; order[j] = tmp;
+  }
+
+  size_t lines_per_node = stride / CACHE_LINE;
+  for (size_t i = 0; i < n; ++i) {
+    size_t from = order[i], to = order[(i + 1) % n];
+    void** node = (void**) (base + from * stride + (from % lines_per_node) * CACHE_LINE);
+    *node = base + to * stride + (to % lines_per_node) * CACHE_LINE;
+  }
+  void** start = (void**) (base + order[0] * stride + (order[0] % lines_per_node) * CACHE_LINE);
+  free(order);
+  return start;
+}
+
+// Follow the chain; returning the final pointer keeps the loop alive
+void** chase(void** p, uint64_t accesses) {
+  for (uint64_t i = 0; i < accesses; i += 8) {
+    p = (void**) *p; p = (void**) *p; p = (void**) *p; p = (void**) *p;
+    p = (void**) *p; p = (void**) *p; p = (void**) *p; p = (void**) *p;
+  }
+  return p;
+}
+
+double measure_chase(size_t size, size_t stride, enum page_mode mode, struct perf_counters* pc) {
+  char* base = map_region(size, mode);
+  if (base == NULL) { return -1.0; }
+
+  void** p = build_chase(base, size, stride);
+  uint64_t nodes = size / stride;
+  p = chase(p, nodes < CHASE_ACCESSES ? nodes : CHASE_ACCESSES);  // warm up
+
+  perf_counters_reset(pc);
+  perf_counters_enable(pc);
+  uint64_t start = timer_start();
+  p = chase(p, CHASE_ACCESSES);
+  uint64_t ticks = timer_stop() - start;
+  perf_counters_disable(pc);
+  perf_counters_read(pc);
+
+  if (p == NULL) { printf("unreachable\n"); }
+  unmap_region(base, size, mode);
+  return (double) timer_ticks_to_ns(ticks) / CHASE_ACCESSES;
+}
+
+/*
+ * Bandwidth kernels. The SIMD kernel uses GCC vector extensions, which
+ * compile to SSE2/AVX2/NEON depending on the target flags. All kernels
+ * share one signature so they can be called through bw_kernel.fn.
+ */
+typedef uint64_t vec_u64 __attribute__((vector_size(32)));
+
+uint64_t read_scalar(uint64_t* buf, size_t n) {
+  uint64_t sum = 0;
+  for (size_t i = 0; i < n; ++i) { sum += buf[i]; }
+  return sum;
+}
+
+uint64_t read_simd(uint64_t* buf, size_t n) {
+  const vec_u64* v = (const vec_u64*) buf;
+  vec_u64 a = { 0 }, b = { 0 }, c = { 0 }, d = { 0 };
+  size_t nv = n / (sizeof(vec_u64) / sizeof(uint64_t));
+  for (size_t i = 0; i + 4 <= nv; i += 4) {
+    a += v[i]; b += v[i + 1]; c += v[i + 2]; d += v[i + 3];
+  }
+  a += b + c + d;
+  return a[0] + a[1] + a[2] + a[3];
+}
+
+// Touch one word per cache line, so every load brings in a new line
+uint64_t read_strided(uint64_t* buf, size_t n) {
+  uint64_t sum = 0;
+  size_t step = CACHE_LINE / sizeof(uint64_t);
+  for (size_t i = 0; i < n; i += step) { sum += buf[i]; }
+  return sum;
+}
+
+uint64_t write_simd(uint64_t* buf, size_t n) {
+  vec_u64* v = (vec_u64*) buf;
+  vec_u64 x = { 1, 2, 3, 4 };
+  size_t nv = n / (sizeof(vec_u64) / sizeof(uint64_t));
+  for (size_t i = 0; i < nv; ++i) { v[i] = x; }
+  return buf[0];
+}
+
+struct bw_kernel {
+  const char* label;
+  uint64_t (*fn)(uint64_t* buf, size_t n);
+  size_t stride;  // bytes per word touched; bandwidth counts only touched words
+};
+
+struct bw_kernel bw_kernels[] = {
+  { "read scalar",     read_scalar,  sizeof(uint64_t) },
+  { "read simd",       read_simd,    sizeof(uint64_t) },
+  { "read 64B-stride", read_strided, CACHE_LINE },
+  { "write simd",      write_simd,   sizeof(uint64_t) },
+};
+
+#define NUM_BW_KERNELS (sizeof(bw_kernels) / sizeof(bw_kernels[0]))
+
+volatile uint64_t bw_sink;
+
+double measure_bandwidth(struct bw_kernel* k, size_t size, enum page_mode mode) {
+  uint64_t* buf = map_region(size, mode);
+  if (buf == NULL) { return -1.0; }
+
+  size_t n = size / sizeof(uint64_t);
+  uint64_t reps = BANDWIDTH_BYTES / size;
+  if (reps == 0) { reps = 1; }
+  bw_sink = k->fn(buf, n);  // warm up
+
+  uint64_t start = timer_start();
+  for (uint64_t r = 0; r < reps; ++r) {
+    bw_sink += k->fn(buf, n);
+  }
+  uint64_t ns = timer_ticks_to_ns(timer_stop() - start);
+
+  unmap_region(buf, size, mode);
+  uint64_t touched = size / k->stride * sizeof(uint64_t) * reps;
+  return ns ? (double) touched / ns : 0.0;  // bytes/ns == GB/s
+}
+
+// Sizes 4K, 6K, 8K, 12K, ... so each cache level shows at least two points
+size_t next_size(size_t size) {
+  return (size & (size - 1)) == 0 ? size + size / 2 : (size / 3) * 4;
+}
+
+void format_size(char* out, size_t len, size_t size) {
+  if (size >= GB) { snprintf(out, len, "%.1fG", (double) size / GB); }
+  else if (size >= MB) { snprintf(out, len, "%.1fM", (double) size / MB); }
+  else { snprintf(out, len, "%.0fK", (double) size / KB); }
+}
+
+/*
+ * Run one latency sweep for every page mode and print the staircase.
+ * A size is flagged when latency jumps by LATENCY_JUMP over the previous
+ * size, which marks the capacity edge of a cache level (line chase) or of
+ * the TLB (page chase). Cache misses per access follow, one column per
+ * page mode.
+ */
+void latency_sweep(const char* name, size_t stride, size_t min_size, size_t max_size, struct perf_counters* pc) {
+  double prev[NUM_PAGE_MODES] = { 0 };
+  double misses[NUM_PAGE_MODES];
+  int miss = perf_counters_find(pc, "cache-misses");
+
+  printf("\n%s latency (ns/access), stride %zu B\n%10s", name, stride, "size");
+  for (int m = 0; m < NUM_PAGE_MODES; ++m) { printf("%12s", page_mode_str[m]); }
+  if (miss >= 0) {
+    printf("  misses/access:");
+    for (int m = 0; m < NUM_PAGE_MODES; ++m) { printf("%10s", page_mode_str[m]); }
+  }
+  printf("\n");
+
+  for (size_t size = min_size; size <= max_size; size = next_size(size)) {
+    char label[32];
+    format_size(label, sizeof(label), size);
+    printf("%10s", label);
+
+    for (int m = 0; m < NUM_PAGE_MODES; ++m) {
+      misses[m] = -1.0;
+      double ns = measure_chase(size, stride, (enum page_mode) m, pc);
+      if (ns < 0) { printf("%12s", "n/a"); continue; }
+      int knee = prev[m] > 0 && ns > prev[m] * LATENCY_JUMP;
+      printf("%10.2f%s", ns, knee ? " *" : "  ");
+      prev[m] = ns;
+      if (miss >= 0) { misses[m] = (double) pc->values[miss] / CHASE_ACCESSES; }
+      if (csv_out) {
+        fprintf(csv_out, "%s,%s,%zu,%.4f\n", name, page_mode_str[m], size, ns);
+        if (miss >= 0) {
+          fprintf(csv_out, "%s misses,%s,%zu,%.4f\n", name, page_mode_str[m], size, misses[m]);
+        }
+      }
+    }
+    if (miss >= 0) {
+      printf("%16s", "");
+      for (int m = 0; m < NUM_PAGE_MODES; ++m) {
+        if (misses[m] < 0) { printf("%10s", "n/a"); }
+        else { printf("%10.3f", misses[m]); }
+      }
+    }
+    printf("\n");
+  }
+}
+
+// One table per page mode; large working sets stream through many more
+// TLB entries with 4 KB pages
+void bandwidth_sweep(size_t max_size, enum page_mode mode) {
+  printf("\nBandwidth (GB/s), %s pages\n%10s", page_mode_str[mode], "size");
+  for (size_t k = 0; k < NUM_BW_KERNELS; ++k) { printf("%17s", bw_kernels[k].label); }
+  printf("\n");
+
+  for (size_t size = 16 * KB; size <= max_size; size *= 4) {
+    char label[32];
+    format_size(label, sizeof(label), size);
+    printf("%10s", label);
+    for (size_t k = 0; k < NUM_BW_KERNELS; ++k) {
+      double gbs = measure_bandwidth(&bw_kernels[k], size, mode);
+      if (gbs < 0) { printf("%17s", "n/a"); continue; }
+      printf("%17.2f", gbs);
+      if (csv_out) {
+        fprintf(csv_out, "bandwidth %s,%s,%zu,%.4f\n", bw_kernels[k].label, page_mode_str[mode], size, gbs);
+      }
+    }
+    printf("\n");
+  }
+}
+
+int main(int argc, char **argv) {
+  size_t max_size = DEFAULT_MAX_SIZE;
+  if (argc > 1) { max_size = strtoull(argv[1], NULL, 10) * MB; }
+  if (max_size < MIN_SIZE) { max_size = MIN_SIZE; }
+  if (argc > 2) {
+    csv_out = fopen(argv[2], "w");
+    if (csv_out == NULL) { perror(argv[2]); exit(1); }
+    fprintf(csv_out, "test,pages,bytes,value\n");
+  }
+
+  timer_init();
+  struct perf_counters pc;
+  perf_counters_open(&pc);
+
+  printf("timer: %s, max working set %zu MB (* = latency jump)\n",
+         timer.use_tsc ? "invariant TSC" : "CLOCK_MONOTONIC_RAW", (size_t) (max_size / MB));
+
+  latency_sweep("line chase", CACHE_LINE, MIN_SIZE, max_size, &pc);
+  latency_sweep("page chase", PAGE_SIZE_4K, 16 * PAGE_SIZE_4K, max_size, &pc);
+  for (int m = 0; m < NUM_PAGE_MODES; ++m) {
+    bandwidth_sweep(max_size, (enum page_mode) m);
+  }
+
+  perf_counters_close(&pc);
+  if (csv_out) { fclose(csv_out); }
+  return 0;
+}
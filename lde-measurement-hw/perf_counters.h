@@ -0,0 +1,196 @@
+#ifndef __perf_counters_h__
+#define __perf_counters_h__
+
+/*
+ * perf_event_open counter groups for measured regions.
+ *
+ * perf_counters_open() first tries a hardware group (cycles, instructions,
+ * cache misses, branch misses) plus the context-switch and page-fault
+ * software events. If the PMU is not available (VMs, containers) it falls
+ * back to a software-only group. Kernel-side counting is dropped when
+ * perf_event_paranoid forbids it, which is reported in the output.
+ *
+ * Usage:
+ *   struct perf_counters pc;
+ *   perf_counters_open(&pc);
+ *   perf_counters_reset(&pc);
+ *   perf_counters_enable(&pc);
+ *   ... region (enable/disable may be repeated to skip setup work) ...
+ *   perf_counters_disable(&pc);
+ *   perf_counters_read(&pc);
+ *   perf_counters_print(&pc, stdout, ops);
+ *   perf_counters_close(&pc);
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#define PERF_MAX_EVENTS 8
+
+struct perf_event_desc {
+  const char* name;
+  uint32_t type;
+  uint64_t config;
+};
+
+static const struct perf_event_desc perf_hw_events[] = {
+  { "cycles",           PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+  { "instructions",     PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+  { "cache-misses",     PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+  { "branch-misses",    PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+  { "context-switches", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES },
+  { "page-faults",      PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS },
+};
+
+static const struct perf_event_desc perf_sw_events[] = {
+  { "task-clock",       PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK },
+  { "context-switches", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES },
+  { "page-faults",      PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS },
+  { "cpu-migrations",   PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_MIGRATIONS },
+};
+
+struct perf_counters {
+  int nevents;                               // events actually opened
+  const struct perf_event_desc* events[PERF_MAX_EVENTS];
+  int fds[PERF_MAX_EVENTS];
+  uint64_t values[PERF_MAX_EVENTS];
+  int hardware;                              // 1 if the hardware group opened
+  int user_only;                             // 1 if kernel counting was refused
+};
+
+static inline int perf_event_open(struct perf_event_attr* attr, pid_t pid, int cpu, int group_fd, unsigned long flags) {
+  return (int) syscall(SYS_perf_event_open, attr, pid, cpu, group_fd, flags);
+}
+
+static inline int perf_counters_open_one(const struct perf_event_desc* ev, int group_fd, int user_only) {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = ev->type;
+  attr.config = ev->config;
+  attr.disabled = group_fd == -1;  // the leader starts the whole group
+  attr.exclude_kernel = user_only;
+  attr.exclude_hv = 1;
+  attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+  return perf_event_open(&attr, 0, -1, group_fd, 0);
+}
+
+static inline void perf_counters_close(struct perf_counters* pc) {
+  for (int i = 0; i < pc->nevents; ++i) {
+    close(pc->fds[i]);
+  }
+  pc->nevents = 0;
+}
+
+// Open one group from a list of events. The leader must open; members that
+// the PMU does not support are skipped.
+static inline int perf_counters_open_group(struct perf_counters* pc, const struct perf_event_desc* events, int n, int user_only) {
+  pc->nevents = 0;
+  for (int i = 0; i < n && pc->nevents < PERF_MAX_EVENTS; ++i) {
+    int leader = pc->nevents ? pc->fds[0] : -1;
+    int fd = perf_counters_open_one(&events[i], leader, user_only);
+    if (fd < 0) {
+      if (leader == -1) { return -1; }
+      continue;
+    }
+    pc->events[pc->nevents] = &events[i];
+    pc->fds[pc->nevents++] = fd;
+  }
+  pc->user_only = user_only;
+  return pc->nevents;
+}
+
+// Returns the number of events opened, 0 if perf_event_open is unavailable
+static inline int perf_counters_open(struct perf_counters* pc) {
+  memset(pc, 0, sizeof(*pc));
+  for (int user_only = 0; user_only <= 1; ++user_only) {
+    if (perf_counters_open_group(pc, perf_hw_events, sizeof(perf_hw_events) / sizeof(perf_hw_events[0]), user_only) > 0) {
+      pc->hardware = 1;
+      return pc->nevents;
+    }
+    if (perf_counters_open_group(pc, perf_sw_events, sizeof(perf_sw_events) / sizeof(perf_sw_events[0]), user_only) > 0) {
+      return pc->nevents;
+    }
+    if (errno != EACCES && errno != EPERM) { break; }
+  }
+  pc->nevents = 0;
+  return 0;
+}
+
+static inline void perf_counters_reset(struct perf_counters* pc) {
+  if (pc->nevents) { ioctl(pc->fds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP); }
+  memset(pc->values, 0, sizeof(pc->values));
+}
+
+static inline void perf_counters_enable(struct perf_counters* pc) {
+  if (pc->nevents) { ioctl(pc->fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP); }
+}
+
+static inline void perf_counters_disable(struct perf_counters* pc) {
+  if (pc->nevents) { ioctl(pc->fds[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP); }
+}
+
+// Read the group, scaling values up if the PMU had to multiplex the events
+static inline int perf_counters_read(struct perf_counters* pc) {
+  uint64_t buf[3 + PERF_MAX_EVENTS];  // nr, time_enabled, time_running, values...
+  if (!pc->nevents) { return -1; }
+  if (read(pc->fds[0], buf, sizeof(buf)) < (ssize_t) (3 * sizeof(uint64_t))) { return -1; }
+
+  uint64_t nr = buf[0], enabled = buf[1], running = buf[2];
+  double scale = running ? (double) enabled / (double) running : 1.0;
+  for (uint64_t i = 0; i < nr && i < (uint64_t) pc->nevents; ++i) {
+    pc->values[i] = (uint64_t) (buf[3 + i] * scale);
+  }
+  return 0;
+}
+
+static inline int perf_counters_find(const struct perf_counters* pc, const char* name) {
+  for (int i = 0; i < pc->nevents; ++i) {
+    if (strcmp(pc->events[i]->name, name) == 0) { return i; }
+  }
+  return -1;
+}
+
+// Add the values of a group with the same events, such as the same group
+// opened in another thread
+static inline void perf_counters_add(struct perf_counters* pc, const struct perf_counters* other) {
+  for (int i = 0; i < other->nevents; ++i) {
+    int j = perf_counters_find(pc, other->events[i]->name);
+    if (j >= 0) { pc->values[j] += other->values[i]; }
+  }
+}
+
+// One indented line of per-op counter values (plus IPC when available)
+static inline void perf_counters_print(const struct perf_counters* pc, FILE* out, uint64_t ops) {
+  if (!pc->nevents) {
+    fprintf(out, "      [perf counters unavailable]\n");
+    return;
+  }
+  if (ops == 0) { ops = 1; }
+  fprintf(out, "      [%s%s]", pc->hardware ? "hw" : "sw", pc->user_only ? ", user only" : "");
+  for (int i = 0; i < pc->nevents; ++i) {
+    fprintf(out, " %s=%.2f", pc->events[i]->name, (double) pc->values[i] / ops);
+  }
+  int cycles = perf_counters_find(pc, "cycles");
+  int instructions = perf_counters_find(pc, "instructions");
+  if (cycles >= 0 && instructions >= 0 && pc->values[cycles]) {
+    fprintf(out, " IPC=%.2f", (double) pc->values[instructions] / pc->values[cycles]);
+  }
+  fprintf(out, "\n");
+}
+
+// Machine-readable rows: label,metric,value (values per op)
+static inline void perf_counters_csv(const struct perf_counters* pc, FILE* out, const char* label, uint64_t ops) {
+  if (ops == 0) { ops = 1; }
+  for (int i = 0; i < pc->nevents; ++i) {
+    fprintf(out, "\"%s\",%s,%.4f\n", label, pc->events[i]->name, (double) pc->values[i] / ops);
+  }
+}
+
+#endif // __perf_counters_h__
@@ -0,0 +1,138 @@
+#ifndef __tsc_timer_h__
+#define __tsc_timer_h__
+
+/*
+ * Low-overhead timestamp source shared by the LDE benchmarks.
+ *
+ * On x86 with an invariant TSC, timestamps come straight from the TSC and are
+ * converted to nanoseconds with a frequency calibrated against
+ * CLOCK_MONOTONIC_RAW. Everywhere else (ARM, or an x86 without invariant TSC)
+ * ticks are just CLOCK_MONOTONIC_RAW nanoseconds.
+ *
+ * Usage:
+ *   timer_init();
+ *   uint64_t t0 = timer_start();
+ *   ... region ...
+ *   uint64_t t1 = timer_stop();
+ *   uint64_t ns = timer_ticks_to_ns(t1 - t0);
+ */
+
+#include <stdint.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#include <cpuid.h>
+#define TIMER_HAVE_TSC 1
+#else
+#define TIMER_HAVE_TSC 0
+#endif
+
+#define TIMER_CALIBRATION_NS 20000000ULL  // 20 ms per calibration round
+#define TIMER_CALIBRATION_ROUNDS 3
+
+struct timer_state {
+  int use_tsc;          // 1 if ticks are TSC cycles, 0 if they are ns
+  double ns_per_tick;
+  double ticks_per_ns;
+};
+
+static struct timer_state timer = { 0, 1.0, 1.0 };
+
+static inline uint64_t timer_clock_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// CPUID leaf 0x80000007, EDX bit 8: TSC runs at a constant rate in all
+// P-/C-states, so it can be used as a wall clock
+static inline int timer_has_invariant_tsc(void) {
+#if TIMER_HAVE_TSC
+  unsigned int eax, ebx, ecx, edx = 0;
+  if (__get_cpuid_max(0x80000000, NULL) < 0x80000007) { return 0; }
+  __get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx);
+  return (edx >> 8) & 1;
+#else
+  return 0;
+#endif
+}
+
+// lfence before rdtsc keeps earlier instructions from leaking into the region
+static inline uint64_t timer_start(void) {
+#if TIMER_HAVE_TSC
+  if (timer.use_tsc) {
+    _mm_lfence();
+    uint64_t t = __rdtsc();
+    _mm_lfence();
+    return t;
+  }
+#endif
+  return timer_clock_ns();
+}
+
+// rdtscp waits for earlier instructions to retire; lfence keeps later ones out
+static inline uint64_t timer_stop(void) {
+#if TIMER_HAVE_TSC
+  if (timer.use_tsc) {
+    unsigned int aux;
+    uint64_t t = __rdtscp(&aux);
+    _mm_lfence();
+    return t;
+  }
+#endif
+  return timer_clock_ns();
+}
+
+static inline uint64_t timer_ticks_to_ns(uint64_t ticks) {
+  return (uint64_t) (ticks * timer.ns_per_tick);
+}
+
+static inline uint64_t timer_ns_to_ticks(uint64_t ns) {
+  return (uint64_t) (ns * timer.ticks_per_ns);
+}
+
+static inline uint64_t timer_now_ns(void) {
+  return timer_ticks_to_ns(timer_start());
+}
+
+// Ticks per second (the TSC frequency, or 1e9 on the fallback path)
+static inline double timer_frequency_hz(void) {
+  return timer.ticks_per_ns * 1e9;
+}
+
+/*
+ * Calibrate the TSC against CLOCK_MONOTONIC_RAW over a few short rounds and
+ * keep the median, so one preempted round cannot skew the result.
+ * Returns 1 when the TSC is used, 0 when falling back to clock_gettime.
+ */
+static inline int timer_init(void) {
+  timer.use_tsc = 0;
+  timer.ns_per_tick = 1.0;
+  timer.ticks_per_ns = 1.0;
+  if (!timer_has_invariant_tsc()) { return 0; }
+
+#if TIMER_HAVE_TSC
+  double rounds[TIMER_CALIBRATION_ROUNDS];
+  for (int r = 0; r < TIMER_CALIBRATION_ROUNDS; ++r) {
+    uint64_t ns0 = timer_clock_ns();
+    uint64_t tsc0 = __rdtsc();
+    uint64_t ns1;
+    while ((ns1 = timer_clock_ns()) - ns0 < TIMER_CALIBRATION_NS);
+    uint64_t tsc1 = __rdtsc();
+    rounds[r] = (double) (tsc1 - tsc0) / (double) (ns1 - ns0);
+  }
+  // Insertion sort, there are only a handful of rounds
+  for (int i = 1; i < TIMER_CALIBRATION_ROUNDS; ++i) {
+    for (int j = i; j > 0 && rounds[j - 1] > rounds[j]; --j) {
+      double tmp = rounds[j]; rounds[j] = rounds[j - 1]; rounds[j - 1] = tmp;
+    }
+  }
+  timer.use_tsc = 1;
+  timer.ticks_per_ns = rounds[TIMER_CALIBRATION_ROUNDS / 2];
+  timer.ns_per_tick = 1.0 / timer.ticks_per_ns;
+#endif
+  return timer.use_tsc;
+}
+
+#endif // __tsc_timer_h__
@@ -3,6 +3,16 @@
 
 #include <sys/time.h>
 #include <assert.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#define SPIN_CHECK_NS 10000     // look at the clock at least every 10 us
+#define SPIN_PROBE_ITERS 64     // first chunk, before the loop rate is known
+#define SPIN_CALIBRATION_TICKS 10000  // probe time before a rate is shared
 
 double GetTime() {
     struct timeval t;
@@ -11,10 +21,91 @@ double GetTime() {
     return (double)t.tv_sec + (double)t.tv_usec/1e6;
 }
 
+// Monotonic nanoseconds; clock_gettime goes through the vDSO, no syscall
+uint64_t GetTimeNs() {
+    struct timespec t;
+    int rc = clock_gettime(CLOCK_MONOTONIC, &t);
+    assert(rc == 0);
+    return (uint64_t)t.tv_sec * 1000000000ULL + (uint64_t)t.tv_nsec;
+}
+
+// One unit of busy work the compiler cannot optimize away
+static inline void SpinLoop(uint64_t iters) {
+    for (uint64_t i = 0; i < iters; ++i) {
+        __asm__ __volatile__("" ::: "memory");
+    }
+}
+
+// SpinLoop iterations per nanosecond and per TSC cycle, 0 until measured.
+// Shared by all threads; whichever spin measures first publishes its rate.
+static _Atomic double spin_iters_per_ns = 0.0;
+static _Atomic double spin_iters_per_cycle = 0.0;
+
+// Spin until `clock` has advanced by `ticks`. Work happens in chunks of at
+// most half the remaining time (and at most `max_chunk` ticks), sized with
+// the loop rate in `shared_rate`. Until that rate is known, the spin starts
+// with a short probe and learns the rate from its own chunks as it goes,
+// so no call pays for a separate calibration or overshoots its deadline.
+static inline void SpinUntil(uint64_t (*clock)(void), uint64_t ticks, uint64_t max_chunk,
+    _Atomic double *shared_rate) {
+    double rate = atomic_load_explicit(shared_rate, memory_order_relaxed);
+    int measuring = rate == 0.0;
+    uint64_t probe_iters = 0, probe_ticks = 0;
+    uint64_t now = clock();
+    uint64_t deadline = now + ticks;
+    while (now < deadline) {
+        uint64_t remaining = deadline - now;
+        uint64_t chunk = remaining / 2 > max_chunk ? max_chunk : remaining / 2;
+        uint64_t iters = rate > 0.0 ? (uint64_t)(chunk * rate) : SPIN_PROBE_ITERS;
+        SpinLoop(iters ? iters : 1);
+        uint64_t then = clock();
+        if (measuring) {
+            probe_iters += iters ? iters : 1;
+            probe_ticks += then - now;
+            rate = probe_ticks ? (double)probe_iters / probe_ticks : 0.0;
+            if (probe_ticks >= SPIN_CALIBRATION_TICKS) {
+                double unknown = 0.0;
+                atomic_compare_exchange_strong(shared_rate, &unknown, rate);
+                measuring = 0;
+            }
+        }
+        now = then;
+    }
+}
+
+// SpinLoop iterations per nanosecond, measured on first use
+double SpinIterationsPerNs() {
+    while (atomic_load(&spin_iters_per_ns) == 0.0) {
+        SpinUntil(GetTimeNs, 2 * SPIN_CALIBRATION_TICKS, SPIN_CHECK_NS, &spin_iters_per_ns);
+    }
+    return atomic_load(&spin_iters_per_ns);
+}
+
+// Burn CPU for `ns` nanoseconds. The clock is read once per chunk, so
+// about every SPIN_CHECK_NS on a long spin and a few times on a short one.
+void SpinNs(uint64_t ns) {
+    SpinUntil(GetTimeNs, ns, SPIN_CHECK_NS, &spin_iters_per_ns);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+static inline uint64_t SpinTsc(void) {
+    return __rdtsc();
+}
+#endif
+
+// Burn `cycles` CPU cycles. On x86 this counts TSC (reference) cycles, with
+// SpinLoop calibrated against the TSC; elsewhere it spins for the same
+// number of nanoseconds at an assumed 1 GHz.
+void SpinCycles(uint64_t cycles) {
+#if defined(__x86_64__) || defined(__i386__)
+    SpinUntil(SpinTsc, cycles, UINT64_MAX, &spin_iters_per_cycle);
+#else
+    SpinNs(cycles);
+#endif
+}
+
 void Spin(int howlong) {
-    double t = GetTime();
-    while ((GetTime() - t) < (double)howlong)
-; // do nothing in loop
+    SpinNs((uint64_t)howlong * 1000000000ULL);
 }
 
 #endif
@@ -30,4 +30,44 @@ void Pthread_mutex_init(pthread_mutex_t *mutex, pthread_mutexattr_t *attr) {
     assert(rc == 0);
 }
 
+void Pthread_cond_init(pthread_cond_t *cond, pthread_condattr_t *attr) {
+    int rc = pthread_cond_init(cond, attr);
+    assert(rc == 0);
+}
+
+void Pthread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex) {
+    int rc = pthread_cond_wait(cond, mutex);
+    assert(rc == 0);
+}
+
+void Pthread_cond_signal(pthread_cond_t *cond) {
+    int rc = pthread_cond_signal(cond);
+    assert(rc == 0);
+}
+
+void Pthread_cond_broadcast(pthread_cond_t *cond) {
+    int rc = pthread_cond_broadcast(cond);
+    assert(rc == 0);
+}
+
+void Pthread_rwlock_init(pthread_rwlock_t *rwlock, pthread_rwlockattr_t *attr) {
+    int rc = pthread_rwlock_init(rwlock, attr);
+    assert(rc == 0);
+}
+
+void Pthread_rwlock_rdlock(pthread_rwlock_t *rwlock) {
+    int rc = pthread_rwlock_rdlock(rwlock);
+    assert(rc == 0);
+}
+
+void Pthread_rwlock_wrlock(pthread_rwlock_t *rwlock) {
+    int rc = pthread_rwlock_wrlock(rwlock);
+    assert(rc == 0);
+}
+
+void Pthread_rwlock_unlock(pthread_rwlock_t *rwlock) {
+    int rc = pthread_rwlock_unlock(rwlock);
+    assert(rc == 0);
+}
+
 #endif // __common_threads_h__
@@ -0,0 +1,222 @@
+#include "locks.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "common_threads.h"
+
+// Lock contention benchmark: every thread loops acquire / critical section /
+// release / non-critical work until the run time is up. Reported per lock:
+// total throughput and fairness (Jain's index over per-thread op counts,
+// 1.0 = perfectly even, 1/threads = one thread did everything).
+// Every run also checks mutual exclusion: each counter in the shared array
+// must equal the number of write sections, and readers must never see the
+// counters disagree. A broken lock aborts the benchmark.
+//
+// usage: lock_bench [max_threads] [run_ms]
+
+#define DEFAULT_RUN_MS 200
+#define NONCRITICAL_WORK 100       // loop iterations between acquisitions
+#define MAX_BENCH_THREADS 256
+
+typedef struct {
+    const char *name;
+    void (*init)(void *lock);
+    void (*rdlock)(void *lock);
+    void (*rdunlock)(void *lock);
+    void (*wrlock)(void *lock);
+    void (*wrunlock)(void *lock);
+} lock_ops_t;
+
+// Adapters so every lock fits the same table. Plain mutexes take the
+// exclusive path for reads too.
+void pthread_init(void *l) { Pthread_mutex_init(l, NULL); }
+void pthread_lock(void *l) { Pthread_mutex_lock(l); }
+void pthread_unlock(void *l) { Pthread_mutex_unlock(l); }
+void spin_init(void *l) { Spin_mutex_init(l); }
+void spin_lock(void *l) { Spin_mutex_lock(l); }
+void spin_unlock(void *l) { Spin_mutex_unlock(l); }
+void ticket_init(void *l) { Ticket_mutex_init(l); }
+void ticket_lock(void *l) { Ticket_mutex_lock(l); }
+void ticket_unlock(void *l) { Ticket_mutex_unlock(l); }
+void mcs_init(void *l) { Mcs_mutex_init(l); }
+void mcs_lock(void *l) { Mcs_mutex_lock(l); }
+void mcs_unlock(void *l) { Mcs_mutex_unlock(l); }
+void futex_init(void *l) { Futex_mutex_init(l); }
+void futex_lock(void *l) { Futex_mutex_lock(l); }
+void futex_unlock(void *l) { Futex_mutex_unlock(l); }
+void prw_init(void *l) { Pthread_rwlock_init(l, NULL); }
+void prw_rdlock(void *l) { Pthread_rwlock_rdlock(l); }
+void prw_wrlock(void *l) { Pthread_rwlock_wrlock(l); }
+void prw_unlock(void *l) { Pthread_rwlock_unlock(l); }
+void rws_init(void *l) { Rw_spinlock_init(l); }
+void rws_rdlock(void *l) { Rw_spinlock_rdlock(l); }
+void rws_rdunlock(void *l) { Rw_spinlock_rdunlock(l); }
+void rws_wrlock(void *l) { Rw_spinlock_wrlock(l); }
+void rws_wrunlock(void *l) { Rw_spinlock_wrunlock(l); }
+
+lock_ops_t locks[] = {
+    { "pthread_mutex",  pthread_init, pthread_lock, pthread_unlock, pthread_lock, pthread_unlock },
+    { "ttas+backoff",   spin_init,    spin_lock,    spin_unlock,    spin_lock,    spin_unlock },
+    { "ticket",         ticket_init,  ticket_lock,  ticket_unlock,  ticket_lock,  ticket_unlock },
+    { "mcs",            mcs_init,     mcs_lock,     mcs_unlock,     mcs_lock,     mcs_unlock },
+    { "futex",          futex_init,   futex_lock,   futex_unlock,   futex_lock,   futex_unlock },
+    { "pthread_rwlock", prw_init,     prw_rdlock,   prw_unlock,     prw_wrlock,   prw_unlock },
+    { "rw_spinlock",    rws_init,     rws_rdlock,   rws_rdunlock,   rws_wrlock,   rws_wrunlock },
+};
+
+#define NUM_LOCKS (sizeof(locks) / sizeof(locks[0]))
+
+// Big enough for any of the lock types above
+typedef union {
+    pthread_mutex_t pthread;
+    pthread_rwlock_t rwlock;
+    spin_mutex_t spin;
+    ticket_mutex_t ticket;
+    mcs_mutex_t mcs;
+    futex_mutex_t futex;
+    rw_spinlock_t rw;
+} any_lock_t;
+
+typedef struct {
+    lock_ops_t *ops;
+    _Alignas(LOCK_CACHE_LINE) any_lock_t lock;
+    _Alignas(LOCK_CACHE_LINE) atomic_int stop;
+    int cs_work;                   // loop iterations inside the lock
+    int read_percent;
+    volatile unsigned long shared[8];
+} bench_t;
+
+typedef struct {
+    _Alignas(LOCK_CACHE_LINE) bench_t *bench;
+    int id;
+    unsigned long ops;
+    unsigned long writes;
+    unsigned long torn_reads;      // read sections that saw a write in progress
+} bench_thread_t;
+
+static inline void work(int n) {
+    for (volatile int i = 0; i < n; ++i)
+        ; // do nothing in loop
+}
+
+void *bench_thread(void *arg) {
+    bench_thread_t *t = (bench_thread_t *)arg;
+    bench_t *b = t->bench;
+    unsigned int seed = (unsigned int)t->id * 7919 + 1;
+    unsigned long ops = 0, writes = 0, torn_reads = 0;
+
+    while (!atomic_load_explicit(&b->stop, memory_order_relaxed)) {
+        if ((int)(rand_r(&seed) % 100) < b->read_percent) {
+            b->ops->rdlock(&b->lock);
+            unsigned long first = b->shared[0];
+            for (int i = 1; i < 8; ++i) {
+                if (b->shared[i] != first) {
+                    ++torn_reads;
+                    break;
+                }
+            }
+            work(b->cs_work);
+            b->ops->rdunlock(&b->lock);
+        } else {
+            b->ops->wrlock(&b->lock);
+            for (int i = 0; i < 8; ++i) {
+                b->shared[i]++;
+            }
+            work(b->cs_work);
+            b->ops->wrunlock(&b->lock);
+            ++writes;
+        }
+        ++ops;
+        work(NONCRITICAL_WORK);
+    }
+    t->ops = ops;
+    t->writes = writes;
+    t->torn_reads = torn_reads;
+    return NULL;
+}
+
+void run_one(lock_ops_t *ops, int nthreads, int cs_work, int read_percent, int run_ms) {
+    bench_t *b = aligned_alloc(LOCK_CACHE_LINE, sizeof(bench_t));
+    bench_thread_t *threads = aligned_alloc(LOCK_CACHE_LINE, sizeof(bench_thread_t) * nthreads);
+    pthread_t *tids = malloc(sizeof(pthread_t) * nthreads);
+    assert(b != NULL && threads != NULL && tids != NULL);
+
+    memset(b, 0, sizeof(bench_t));
+    b->ops = ops;
+    b->cs_work = cs_work;
+    b->read_percent = read_percent;
+    ops->init(&b->lock);
+    atomic_init(&b->stop, 0);
+
+    for (int i = 0; i < nthreads; ++i) {
+        threads[i].bench = b;
+        threads[i].id = i;
+        threads[i].ops = 0;
+        threads[i].writes = 0;
+        threads[i].torn_reads = 0;
+        Pthread_create(&tids[i], NULL, bench_thread, &threads[i]);
+    }
+    struct timespec run = { run_ms / 1000, (run_ms % 1000) * 1000000L };
+    nanosleep(&run, NULL);
+    atomic_store(&b->stop, 1);
+
+    double total = 0, sum_sq = 0;
+    unsigned long min_ops = ~0UL, max_ops = 0, writes = 0, torn_reads = 0;
+    for (int i = 0; i < nthreads; ++i) {
+        Pthread_join(tids[i], NULL);
+        writes += threads[i].writes;
+        torn_reads += threads[i].torn_reads;
+        double o = (double)threads[i].ops;
+        total += o;
+        sum_sq += o * o;
+        if (threads[i].ops < min_ops) min_ops = threads[i].ops;
+        if (threads[i].ops > max_ops) max_ops = threads[i].ops;
+    }
+    double jain = sum_sq > 0 ? total * total / (nthreads * sum_sq) : 0.0;
+
+    // Lost increments or torn reads mean two threads were inside at once
+    for (int i = 0; i < 8; ++i) {
+        if (b->shared[i] != writes) {
+            fprintf(stderr, "%s: shared[%d] = %lu after %lu write sections, mutual exclusion broken\n",
+                ops->name, i, b->shared[i], writes);
+            exit(1);
+        }
+    }
+    if (torn_reads) {
+        fprintf(stderr, "%s: %lu read sections overlapped a writer\n", ops->name, torn_reads);
+        exit(1);
+    }
+
+    printf("  %-15s %8d %8d %6d%% %14.0f %8.3f %10lu %10lu\n",
+        ops->name, nthreads, cs_work, read_percent,
+        total * 1000.0 / run_ms, jain, min_ops, max_ops);
+
+    free(tids);
+    free(threads);
+    free(b);
+}
+
+int main(int argc, char *argv[]) {
+    int ncpus = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    int max_threads = argc > 1 ? atoi(argv[1]) : 2 * ncpus;
+    int run_ms = argc > 2 ? atoi(argv[2]) : DEFAULT_RUN_MS;
+    if (max_threads > MAX_BENCH_THREADS) max_threads = MAX_BENCH_THREADS;
+
+    int cs_lengths[] = { 0, 100, 1000 };
+    int read_mixes[] = { 0, 90 };
+
+    printf("  %-15s %8s %8s %7s %14s %8s %10s %10s\n",
+        "lock", "threads", "cs work", "reads", "ops/s", "fairness", "min ops", "max ops");
+    for (int nthreads = 1; nthreads <= max_threads; nthreads *= 2) {
+        for (size_t c = 0; c < sizeof(cs_lengths) / sizeof(int); ++c) {
+            for (size_t r = 0; r < sizeof(read_mixes) / sizeof(int); ++r) {
+                for (size_t l = 0; l < NUM_LOCKS; ++l) {
+                    run_one(&locks[l], nthreads, cs_lengths[c], read_mixes[r], run_ms);
+                }
+                printf("\n");
+            }
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,260 @@
+#ifndef __locks_h__
+#define __locks_h__
+
+// Alternatives to pthread_mutex_t with the same init/lock/unlock shape as
+// the Pthread_mutex_* wrappers in common_threads.h.
+//
+//   spin_mutex_t    test-and-test-and-set with exponential backoff
+//   ticket_mutex_t  FIFO ticket lock, backoff proportional to queue position
+//   mcs_mutex_t     MCS queue lock, each waiter spins on its own cache line
+//   futex_mutex_t   three-state futex mutex ("Futexes Are Tricky"), spins
+//                   briefly before sleeping in the kernel
+//   rw_spinlock_t   writer-preferring reader-writer spinlock
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <assert.h>
+#include <limits.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#define LOCK_CACHE_LINE 64
+#define SPIN_BACKOFF_MAX 1024
+#define TICKET_BACKOFF_UNIT 32
+#define MCS_MAX_NESTED 8           // MCS locks one thread may hold at once
+#define FUTEX_MUTEX_SPINS 100
+
+static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+/* ---- test-and-test-and-set spinlock ---- */
+
+typedef struct {
+    _Alignas(LOCK_CACHE_LINE) atomic_int locked;
+} spin_mutex_t;
+
+void Spin_mutex_init(spin_mutex_t *m) {
+    atomic_init(&m->locked, 0);
+}
+
+void Spin_mutex_lock(spin_mutex_t *m) {
+    int backoff = 1;
+    for (;;) {
+        // Spin on a plain load so waiters share the line instead of bouncing it
+        while (atomic_load_explicit(&m->locked, memory_order_relaxed)) {
+            cpu_relax();
+        }
+        if (!atomic_exchange_explicit(&m->locked, 1, memory_order_acquire)) {
+            return;
+        }
+        for (int i = 0; i < backoff; ++i) {
+            cpu_relax();
+        }
+        if (backoff < SPIN_BACKOFF_MAX) {
+            backoff <<= 1;
+        }
+    }
+}
+
+void Spin_mutex_unlock(spin_mutex_t *m) {
+    atomic_store_explicit(&m->locked, 0, memory_order_release);
+}
+
+/* ---- ticket lock ---- */
+
+typedef struct {
+    _Alignas(LOCK_CACHE_LINE) atomic_uint next;
+    _Alignas(LOCK_CACHE_LINE) atomic_uint serving;
+} ticket_mutex_t;
+
+void Ticket_mutex_init(ticket_mutex_t *m) {
+    atomic_init(&m->next, 0);
+    atomic_init(&m->serving, 0);
+}
+
+void Ticket_mutex_lock(ticket_mutex_t *m) {
+    unsigned int ticket = atomic_fetch_add_explicit(&m->next, 1, memory_order_relaxed);
+    for (;;) {
+        unsigned int serving = atomic_load_explicit(&m->serving, memory_order_acquire);
+        if (serving == ticket) {
+            return;
+        }
+        // Waiters further back in line check less often
+        for (unsigned int i = 0; i < (ticket - serving) * TICKET_BACKOFF_UNIT; ++i) {
+            cpu_relax();
+        }
+    }
+}
+
+void Ticket_mutex_unlock(ticket_mutex_t *m) {
+    unsigned int serving = atomic_load_explicit(&m->serving, memory_order_relaxed);
+    atomic_store_explicit(&m->serving, serving + 1, memory_order_release);
+}
+
+/* ---- MCS queue lock ---- */
+
+typedef struct __mcs_node {
+    _Alignas(LOCK_CACHE_LINE) _Atomic(struct __mcs_node *) next;
+    atomic_int locked;
+} mcs_node_t;
+
+typedef struct {
+    _Alignas(LOCK_CACHE_LINE) _Atomic(mcs_node_t *) tail;
+    mcs_node_t *holder;            // only touched by the thread holding the lock
+} mcs_mutex_t;
+
+// Queue nodes come from a small per-thread stack, so MCS locks must be
+// released in the reverse order they were taken
+static __thread mcs_node_t mcs_nodes[MCS_MAX_NESTED];
+static __thread int mcs_depth = 0;
+
+void Mcs_mutex_init(mcs_mutex_t *m) {
+    atomic_init(&m->tail, NULL);
+    m->holder = NULL;
+}
+
+void Mcs_mutex_lock(mcs_mutex_t *m) {
+    assert(mcs_depth < MCS_MAX_NESTED);
+    mcs_node_t *node = &mcs_nodes[mcs_depth++];
+    atomic_store_explicit(&node->next, NULL, memory_order_relaxed);
+    atomic_store_explicit(&node->locked, 1, memory_order_relaxed);
+
+    mcs_node_t *prev = atomic_exchange_explicit(&m->tail, node, memory_order_acq_rel);
+    if (prev) {
+        atomic_store_explicit(&prev->next, node, memory_order_release);
+        while (atomic_load_explicit(&node->locked, memory_order_acquire)) {
+            cpu_relax();
+        }
+    }
+    m->holder = node;
+}
+
+void Mcs_mutex_unlock(mcs_mutex_t *m) {
+    mcs_node_t *node = m->holder;
+    mcs_node_t *next = atomic_load_explicit(&node->next, memory_order_acquire);
+    if (next == NULL) {
+        mcs_node_t *expected = node;
+        if (atomic_compare_exchange_strong_explicit(&m->tail, &expected, NULL,
+                memory_order_release, memory_order_relaxed)) {
+            --mcs_depth;
+            return;
+        }
+        // A successor swapped itself in but has not linked up yet
+        while ((next = atomic_load_explicit(&node->next, memory_order_acquire)) == NULL) {
+            cpu_relax();
+        }
+    }
+    atomic_store_explicit(&next->locked, 0, memory_order_release);
+    --mcs_depth;
+}
+
+/* ---- futex mutex ---- */
+
+// 0 = unlocked, 1 = locked, 2 = locked and someone may be sleeping
+typedef struct {
+    _Alignas(LOCK_CACHE_LINE) atomic_int state;
+} futex_mutex_t;
+
+static inline long futex_call(atomic_int *uaddr, int op, int val) {
+    return syscall(SYS_futex, uaddr, op, val, NULL, NULL, 0);
+}
+
+void Futex_mutex_init(futex_mutex_t *m) {
+    atomic_init(&m->state, 0);
+}
+
+void Futex_mutex_lock(futex_mutex_t *m) {
+    int c = 0;
+    if (atomic_compare_exchange_strong_explicit(&m->state, &c, 1,
+            memory_order_acquire, memory_order_relaxed)) {
+        return;
+    }
+    // Adaptive part: the holder is probably about to let go
+    for (int i = 0; i < FUTEX_MUTEX_SPINS; ++i) {
+        c = 0;
+        if (atomic_load_explicit(&m->state, memory_order_relaxed) == 0 &&
+            atomic_compare_exchange_weak_explicit(&m->state, &c, 1,
+                memory_order_acquire, memory_order_relaxed)) {
+            return;
+        }
+        cpu_relax();
+    }
+    if (c != 2) {
+        c = atomic_exchange_explicit(&m->state, 2, memory_order_acquire);
+    }
+    while (c != 0) {
+        futex_call(&m->state, FUTEX_WAIT_PRIVATE, 2);
+        c = atomic_exchange_explicit(&m->state, 2, memory_order_acquire);
+    }
+}
+
+void Futex_mutex_unlock(futex_mutex_t *m) {
+    if (atomic_fetch_sub_explicit(&m->state, 1, memory_order_release) != 1) {
+        atomic_store_explicit(&m->state, 0, memory_order_release);
+        futex_call(&m->state, FUTEX_WAKE_PRIVATE, 1);
+    }
+}
+
+/* ---- reader-writer spinlock ---- */
+
+// Readers count in the low bits; a writer sets RW_WRITER once it owns the
+// lock and RW_WRITER_WAITING to hold off new readers while it waits
+#define RW_WRITER (1 << 30)
+#define RW_WRITER_WAITING (1 << 29)
+#define RW_READER_MASK (RW_WRITER_WAITING - 1)
+
+typedef struct {
+    _Alignas(LOCK_CACHE_LINE) atomic_int state;
+} rw_spinlock_t;
+
+void Rw_spinlock_init(rw_spinlock_t *l) {
+    atomic_init(&l->state, 0);
+}
+
+void Rw_spinlock_rdlock(rw_spinlock_t *l) {
+    for (;;) {
+        int s = atomic_load_explicit(&l->state, memory_order_relaxed);
+        if (!(s & (RW_WRITER | RW_WRITER_WAITING)) &&
+            atomic_compare_exchange_weak_explicit(&l->state, &s, s + 1,
+                memory_order_acquire, memory_order_relaxed)) {
+            return;
+        }
+        cpu_relax();
+    }
+}
+
+void Rw_spinlock_rdunlock(rw_spinlock_t *l) {
+    atomic_fetch_sub_explicit(&l->state, 1, memory_order_release);
+}
+
+void Rw_spinlock_wrlock(rw_spinlock_t *l) {
+    for (;;) {
+        int s = atomic_load_explicit(&l->state, memory_order_relaxed);
+        if ((s & ~RW_WRITER_WAITING) == 0) {
+            // No readers and no writer: take it (clearing our waiting flag)
+            if (atomic_compare_exchange_weak_explicit(&l->state, &s, RW_WRITER,
+                    memory_order_acquire, memory_order_relaxed)) {
+                return;
+            }
+        } else if (!(s & RW_WRITER_WAITING)) {
+            atomic_fetch_or_explicit(&l->state, RW_WRITER_WAITING, memory_order_relaxed);
+        }
+        cpu_relax();
+    }
+}
+
+void Rw_spinlock_wrunlock(rw_spinlock_t *l) {
+    atomic_fetch_and_explicit(&l->state, ~RW_WRITER, memory_order_release);
+}
+
+#endif // __locks_h__
@@ -0,0 +1,174 @@
+#include "thread_pool.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "common.h"
+
+// Exercises thread_pool.h and checks the results: a parallel_for over an
+// array, many short parallel_for calls back to back (each WaitGroup lives
+// on the caller's stack and dies right after the wait), recursive tasks
+// that submit and wait from inside the pool, tasks submitted from outside
+// it, a task whose children can only run if other workers steal them, and
+// a task that submits a child after ThreadPool_destroy has started waiting.
+// Runs more workers than cores by default, so the steal test works even on
+// one core. Exits non-zero on the first wrong result.
+//
+// usage: pool_test [workers]
+
+#define ARRAY_SIZE (1L << 20)
+#define SHORT_LOOPS 20000
+#define FIB_N 27
+#define FIB_CUTOFF 12             // below this, fib runs serially
+#define EXTERNAL_TASKS 10000
+#define STEAL_TASKS 64
+
+ThreadPool pool;
+
+void check(int ok, const char *what) {
+    if (!ok) {
+        fprintf(stderr, "pool_test: FAILED: %s\n", what);
+        exit(1);
+    }
+}
+
+void double_index(long i, void *arg) {
+    long *a = (long *)arg;
+    a[i] = 2 * i;
+}
+
+void count_index(long i, void *arg) {
+    (void)i;
+    atomic_fetch_add((atomic_long *)arg, 1);
+}
+
+long fib_serial(int n) {
+    return n < 2 ? n : fib_serial(n - 1) + fib_serial(n - 2);
+}
+
+typedef struct {
+    int n;
+    long result;
+} FibArg;
+
+void fib_task(void *arg) {
+    FibArg *f = (FibArg *)arg;
+    if (f->n < FIB_CUTOFF) {
+        f->result = fib_serial(f->n);
+        return;
+    }
+    FibArg a = { f->n - 1, 0 }, b = { f->n - 2, 0 };
+    WaitGroup wg;
+    WaitGroup_init(&wg);
+    ThreadPool_submit(&pool, &wg, fib_task, &a);
+    ThreadPool_submit(&pool, &wg, fib_task, &b);
+    WaitGroup_wait(&pool, &wg);
+    WaitGroup_destroy(&wg);
+    f->result = a.result + b.result;
+}
+
+void spin_and_count(void *arg) {
+    SpinNs(1000);
+    atomic_fetch_add((atomic_long *)arg, 1);
+}
+
+typedef struct {
+    Worker *parent;
+    atomic_long done;
+    atomic_long stolen;       // children run by a worker other than the parent
+} StealArg;
+
+void steal_child(void *arg) {
+    StealArg *s = (StealArg *)arg;
+    if (current_worker != s->parent) {
+        atomic_fetch_add(&s->stolen, 1);
+    }
+    atomic_fetch_add(&s->done, 1);
+}
+
+// Push children onto our own deque and never pop it, so every child has
+// to be stolen
+void steal_parent(void *arg) {
+    StealArg *s = (StealArg *)arg;
+    s->parent = current_worker;
+    for (int k = 0; k < STEAL_TASKS; ++k) {
+        ThreadPool_submit(&pool, NULL, steal_child, s);
+    }
+    while (atomic_load(&s->done) < STEAL_TASKS) {
+        sched_yield();
+    }
+}
+
+// Busy for a while, so destroy is already waiting when the child is
+// submitted
+void late_parent(void *arg) {
+    SpinNs(50 * 1000 * 1000);
+    ThreadPool_submit(&pool, NULL, spin_and_count, arg);
+}
+
+unsigned long total_steals(void) {
+    unsigned long steals = 0;
+    for (int i = 0; i < pool.num_workers; ++i) {
+        steals += atomic_load(&pool.workers[i].stats.steals);
+    }
+    return steals;
+}
+
+int main(int argc, char *argv[]) {
+    int ncpus = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    int workers = argc > 1 ? atoi(argv[1]) : (ncpus > 4 ? ncpus : 4);
+    ThreadPool_init(&pool, workers);
+    printf("pool_test: %d workers on %d CPUs\n", pool.num_workers, ncpus);
+
+    long *a = malloc(sizeof(long) * ARRAY_SIZE);
+    assert(a != NULL);
+    memset(a, 0xff, sizeof(long) * ARRAY_SIZE);
+    ThreadPool_parallel_for(&pool, 0, ARRAY_SIZE, 4096, double_index, a);
+    for (long i = 0; i < ARRAY_SIZE; ++i) {
+        check(a[i] == 2 * i, "parallel_for wrote every index");
+    }
+    free(a);
+
+    atomic_long count;
+    atomic_init(&count, 0);
+    for (int k = 0; k < SHORT_LOOPS; ++k) {
+        ThreadPool_parallel_for(&pool, 0, 4 * pool.num_workers, 1, count_index, &count);
+    }
+    check(atomic_load(&count) == (long)SHORT_LOOPS * 4 * pool.num_workers, "short parallel_for loops");
+    ThreadPool_parallel_for(&pool, 5, 5, 1, count_index, &count);
+    check(atomic_load(&count) == (long)SHORT_LOOPS * 4 * pool.num_workers, "empty parallel_for");
+
+    FibArg f = { FIB_N, 0 };
+    WaitGroup wg;
+    WaitGroup_init(&wg);
+    ThreadPool_submit(&pool, &wg, fib_task, &f);
+    WaitGroup_wait(&pool, &wg);
+    check(f.result == fib_serial(FIB_N), "recursive fib tasks");
+
+    atomic_init(&count, 0);
+    for (int k = 0; k < EXTERNAL_TASKS; ++k) {
+        ThreadPool_submit(&pool, &wg, spin_and_count, &count);
+    }
+    WaitGroup_wait(&pool, &wg);
+    WaitGroup_destroy(&wg);
+    check(atomic_load(&count) == EXTERNAL_TASKS, "external submits");
+
+    if (pool.num_workers > 1) {
+        StealArg steal;
+        atomic_init(&steal.done, 0);
+        atomic_init(&steal.stolen, 0);
+        WaitGroup_init(&wg);
+        ThreadPool_submit(&pool, &wg, steal_parent, &steal);
+        WaitGroup_wait(&pool, &wg);
+        WaitGroup_destroy(&wg);
+        check(atomic_load(&steal.stolen) == STEAL_TASKS, "idle workers stole every child");
+        check(total_steals() >= STEAL_TASKS, "steal counters");
+    }
+    ThreadPool_print_stats(&pool);
+
+    atomic_init(&count, 0);
+    ThreadPool_submit(&pool, NULL, late_parent, &count);
+    ThreadPool_destroy(&pool);
+    check(atomic_load(&count) == 1, "destroy ran a child submitted while it waited");
+    printf("pool_test: OK\n");
+    return 0;
+}
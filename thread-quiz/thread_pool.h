@@ -0,0 +1,476 @@
+#ifndef __thread_pool_h__
+#define __thread_pool_h__
+
+// Work-stealing thread pool built on the wrappers in common_threads.h.
+//
+// Each worker owns a Chase-Lev deque: it pushes and pops at the bottom, idle
+// workers steal from the top. Tasks submitted from outside the pool go to a
+// shared injection queue. Workers are pinned one per core and sleep on a
+// condition variable once they run out of work.
+//
+//   ThreadPool pool;
+//   WaitGroup wg;
+//   ThreadPool_init(&pool, 0);            // 0 = one worker per allowed CPU
+//   WaitGroup_init(&wg);
+//   ThreadPool_submit(&pool, &wg, func, arg);
+//   WaitGroup_wait(&pool, &wg);
+//   WaitGroup_destroy(&wg);
+//   ThreadPool_parallel_for(&pool, 0, n, 1024, body, arg);
+//   ThreadPool_print_stats(&pool);
+//   ThreadPool_destroy(&pool);
+//
+// Pinning needs _GNU_SOURCE, so include this before any system header.
+// pool_test.c exercises the pool and checks its results.
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "common_threads.h"
+
+#define POOL_MAX_WORKERS 256
+#define POOL_DEQUE_SIZE 4096   // power of two; a full deque runs the task inline
+#define POOL_IDLE_SPINS 64     // steal rounds before a worker goes to sleep
+#define POOL_CACHE_LINE 64
+
+typedef struct __WaitGroup {
+    atomic_long pending;
+    pthread_mutex_t mutex;     // held around the final decrement
+    pthread_cond_t done;
+} WaitGroup;
+
+typedef struct __Task {
+    void (*func)(void *);
+    void *arg;
+    WaitGroup *wg;
+    struct __Task *next;       // injection queue link
+} Task;
+
+// Chase-Lev deque with a fixed-size circular buffer
+typedef struct __Deque {
+    _Alignas(POOL_CACHE_LINE) atomic_long top;
+    _Alignas(POOL_CACHE_LINE) atomic_long bottom;
+    _Atomic(Task *) buffer[POOL_DEQUE_SIZE];
+} Deque;
+
+typedef struct __WorkerStats {
+    _Alignas(POOL_CACHE_LINE) atomic_ulong tasks;
+    atomic_ulong steals;
+    atomic_ulong failed_steals;
+    atomic_ulong idle_sleeps;
+} WorkerStats;
+
+typedef struct __ThreadPool ThreadPool;
+
+typedef struct __Worker {
+    ThreadPool *pool;
+    int id;
+    unsigned int seed;         // victim selection
+    pthread_t thread;
+    Deque deque;
+    WorkerStats stats;
+} Worker;
+
+struct __ThreadPool {
+    int num_workers;
+    Worker *workers;
+
+    pthread_mutex_t mutex;     // guards the injection queue and sleeping
+    pthread_cond_t wakeup;
+    Task *inject_head;
+    Task *inject_tail;
+    atomic_long injected;      // length of the injection queue
+    atomic_int sleepers;
+    atomic_long queued;        // tasks submitted but not yet picked up
+    atomic_long active;        // tasks submitted but not yet finished
+    atomic_int shutdown;
+    int cpus[POOL_MAX_WORKERS]; // CPUs this process may run on, for pinning
+    int num_cpus;
+};
+
+// The worker running on this thread, NULL outside the pool
+static __thread Worker *current_worker = NULL;
+
+/* ---- Chase-Lev deque ---- */
+
+void Deque_init(Deque *d) {
+    atomic_init(&d->top, 0);
+    atomic_init(&d->bottom, 0);
+}
+
+// Owner only. Returns 0 if the deque is full.
+int Deque_push(Deque *d, Task *task) {
+    long b = atomic_load_explicit(&d->bottom, memory_order_relaxed);
+    long t = atomic_load_explicit(&d->top, memory_order_acquire);
+    if (b - t >= POOL_DEQUE_SIZE) {
+        return 0;
+    }
+    atomic_store_explicit(&d->buffer[b & (POOL_DEQUE_SIZE - 1)], task, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+    return 1;
+}
+
+// Owner only. Pops the most recently pushed task.
+Task *Deque_pop(Deque *d) {
+    long b = atomic_load_explicit(&d->bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit(&d->bottom, b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    long t = atomic_load_explicit(&d->top, memory_order_relaxed);
+
+    Task *task = NULL;
+    if (t <= b) {
+        task = atomic_load_explicit(&d->buffer[b & (POOL_DEQUE_SIZE - 1)], memory_order_relaxed);
+        if (t == b) {
+            // Last task: race the thieves for it
+            if (!atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1,
+                    memory_order_seq_cst, memory_order_relaxed)) {
+                task = NULL;
+            }
+            atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+        }
+    } else {
+        atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+    }
+    return task;
+}
+
+// Any thread. Takes the oldest task; NULL if empty or the race was lost.
+Task *Deque_steal(Deque *d) {
+    long t = atomic_load_explicit(&d->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    long b = atomic_load_explicit(&d->bottom, memory_order_acquire);
+    if (t >= b) {
+        return NULL;
+    }
+    Task *task = atomic_load_explicit(&d->buffer[t & (POOL_DEQUE_SIZE - 1)], memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1,
+            memory_order_seq_cst, memory_order_relaxed)) {
+        return NULL;
+    }
+    return task;
+}
+
+/* ---- wait groups ---- */
+
+void WaitGroup_init(WaitGroup *wg) {
+    atomic_init(&wg->pending, 0);
+    Pthread_mutex_init(&wg->mutex, NULL);
+    Pthread_cond_init(&wg->done, NULL);
+}
+
+void WaitGroup_destroy(WaitGroup *wg) {
+    pthread_mutex_destroy(&wg->mutex);
+    pthread_cond_destroy(&wg->done);
+}
+
+void WaitGroup_add(WaitGroup *wg, long n) {
+    atomic_fetch_add(&wg->pending, n);
+}
+
+// The waiter may free the WaitGroup as soon as it returns. Decrements that
+// cannot be the last one are lock-free; the one that may reach zero happens
+// under the mutex together with the broadcast, and the waiter takes the
+// mutex before returning, so it cannot leave while we still use the struct.
+void WaitGroup_done(WaitGroup *wg) {
+    long n = atomic_load(&wg->pending);
+    while (n > 1) {
+        if (atomic_compare_exchange_weak(&wg->pending, &n, n - 1)) {
+            return;
+        }
+    }
+    Pthread_mutex_lock(&wg->mutex);
+    if (atomic_fetch_sub(&wg->pending, 1) == 1) {
+        Pthread_cond_broadcast(&wg->done);
+    }
+    Pthread_mutex_unlock(&wg->mutex);
+}
+
+/* ---- pool ---- */
+
+void ThreadPool_run_task(ThreadPool *pool, Worker *w, Task *task) {
+    task->func(task->arg);
+    if (task->wg) {
+        WaitGroup_done(task->wg);
+    }
+    if (w) {
+        atomic_fetch_add_explicit(&w->stats.tasks, 1, memory_order_relaxed);
+    }
+    free(task);
+    // Last: any task this one submitted is already counted
+    atomic_fetch_sub(&pool->active, 1);
+}
+
+Task *ThreadPool_take_injected(ThreadPool *pool) {
+    if (atomic_load(&pool->injected) == 0) {   // skip the lock when empty
+        return NULL;
+    }
+    Pthread_mutex_lock(&pool->mutex);
+    Task *task = pool->inject_head;
+    if (task) {
+        pool->inject_head = task->next;
+        if (pool->inject_head == NULL) {
+            pool->inject_tail = NULL;
+        }
+        atomic_fetch_sub(&pool->injected, 1);
+    }
+    Pthread_mutex_unlock(&pool->mutex);
+    return task;
+}
+
+// Own deque first, then the injection queue, then a random victim
+Task *ThreadPool_find_task(ThreadPool *pool, Worker *w) {
+    Task *task = w ? Deque_pop(&w->deque) : NULL;
+    if (task == NULL) {
+        task = ThreadPool_take_injected(pool);
+    }
+    if (task == NULL && w && pool->num_workers > 1) {
+        int start = rand_r(&w->seed) % pool->num_workers;
+        for (int i = 0; i < pool->num_workers && task == NULL; ++i) {
+            Worker *victim = &pool->workers[(start + i) % pool->num_workers];
+            if (victim == w) {
+                continue;
+            }
+            task = Deque_steal(&victim->deque);
+            if (task) {
+                atomic_fetch_add_explicit(&w->stats.steals, 1, memory_order_relaxed);
+            } else {
+                atomic_fetch_add_explicit(&w->stats.failed_steals, 1, memory_order_relaxed);
+            }
+        }
+    }
+    if (task) {
+        atomic_fetch_sub(&pool->queued, 1);
+    }
+    return task;
+}
+
+void ThreadPool_wake_one(ThreadPool *pool) {
+    if (atomic_load(&pool->sleepers) > 0) {
+        Pthread_mutex_lock(&pool->mutex);
+        Pthread_cond_signal(&pool->wakeup);
+        Pthread_mutex_unlock(&pool->mutex);
+    }
+}
+
+void pin_to_cpu(pthread_t thread, int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_setaffinity_np(thread, sizeof(set), &set);  // best effort
+}
+
+void *ThreadPool_worker(void *arg) {
+    Worker *w = (Worker *)arg;
+    ThreadPool *pool = w->pool;
+    current_worker = w;
+
+    while (!atomic_load(&pool->shutdown)) {
+        Task *task = NULL;
+        for (int spin = 0; spin < POOL_IDLE_SPINS && task == NULL; ++spin) {
+            task = ThreadPool_find_task(pool, w);
+            if (task == NULL) {
+                sched_yield();
+            }
+        }
+        if (task) {
+            ThreadPool_run_task(pool, w, task);
+            continue;
+        }
+
+        // Out of work: sleep until a submit (or shutdown) wakes us up
+        Pthread_mutex_lock(&pool->mutex);
+        atomic_fetch_add(&pool->sleepers, 1);
+        while (atomic_load(&pool->queued) == 0 && !atomic_load(&pool->shutdown)) {
+            atomic_fetch_add_explicit(&w->stats.idle_sleeps, 1, memory_order_relaxed);
+            Pthread_cond_wait(&pool->wakeup, &pool->mutex);
+        }
+        atomic_fetch_sub(&pool->sleepers, 1);
+        Pthread_mutex_unlock(&pool->mutex);
+    }
+    current_worker = NULL;
+    return NULL;
+}
+
+void ThreadPool_init(ThreadPool *pool, int num_workers) {
+    // Pin only to CPUs in the affinity mask (taskset, cgroups), not to
+    // every online one
+    cpu_set_t allowed;
+    pool->num_cpus = 0;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE && pool->num_cpus < POOL_MAX_WORKERS; ++cpu) {
+            if (CPU_ISSET(cpu, &allowed)) {
+                pool->cpus[pool->num_cpus++] = cpu;
+            }
+        }
+    }
+    if (num_workers <= 0) {
+        num_workers = pool->num_cpus > 0 ? pool->num_cpus : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    assert(num_workers <= POOL_MAX_WORKERS);
+
+    pool->num_workers = num_workers;
+    pool->workers = aligned_alloc(POOL_CACHE_LINE, sizeof(Worker) * num_workers);
+    assert(pool->workers != NULL);
+    Pthread_mutex_init(&pool->mutex, NULL);
+    Pthread_cond_init(&pool->wakeup, NULL);
+    pool->inject_head = pool->inject_tail = NULL;
+    atomic_init(&pool->injected, 0);
+    atomic_init(&pool->sleepers, 0);
+    atomic_init(&pool->queued, 0);
+    atomic_init(&pool->active, 0);
+    atomic_init(&pool->shutdown, 0);
+
+    for (int i = 0; i < num_workers; ++i) {
+        Worker *w = &pool->workers[i];
+        w->pool = pool;
+        w->id = i;
+        w->seed = (unsigned int)i * 2654435761u + 1;
+        Deque_init(&w->deque);
+        atomic_init(&w->stats.tasks, 0);
+        atomic_init(&w->stats.steals, 0);
+        atomic_init(&w->stats.failed_steals, 0);
+        atomic_init(&w->stats.idle_sleeps, 0);
+    }
+    // Start the threads only once every deque is ready to be stolen from
+    for (int i = 0; i < num_workers; ++i) {
+        Pthread_create(&pool->workers[i].thread, NULL, ThreadPool_worker, &pool->workers[i]);
+        if (pool->num_cpus > 0) {
+            pin_to_cpu(pool->workers[i].thread, pool->cpus[i % pool->num_cpus]);
+        }
+    }
+}
+
+// Queue func(arg). If wg is not NULL it is signalled when the task finishes.
+void ThreadPool_submit(ThreadPool *pool, WaitGroup *wg, void (*func)(void *), void *arg) {
+    Task *task = malloc(sizeof(Task));
+    assert(task != NULL);
+    task->func = func;
+    task->arg = arg;
+    task->wg = wg;
+    task->next = NULL;
+    if (wg) {
+        WaitGroup_add(wg, 1);
+    }
+
+    // Count the task before it becomes visible so thieves never see it early
+    atomic_fetch_add(&pool->active, 1);
+    atomic_fetch_add(&pool->queued, 1);
+    Worker *w = current_worker;
+    if (w && w->pool == pool) {
+        if (!Deque_push(&w->deque, task)) {
+            atomic_fetch_sub(&pool->queued, 1);
+            ThreadPool_run_task(pool, w, task);   // deque full: run it right here
+            return;
+        }
+    } else {
+        Pthread_mutex_lock(&pool->mutex);
+        if (pool->inject_tail) {
+            pool->inject_tail->next = task;
+        } else {
+            pool->inject_head = task;
+        }
+        pool->inject_tail = task;
+        atomic_fetch_add(&pool->injected, 1);
+        Pthread_mutex_unlock(&pool->mutex);
+    }
+    ThreadPool_wake_one(pool);
+}
+
+// Block until every task added to wg has finished. Workers that wait keep
+// running other tasks instead of blocking their core.
+void WaitGroup_wait(ThreadPool *pool, WaitGroup *wg) {
+    Worker *w = current_worker;
+    if (w && w->pool == pool) {
+        while (atomic_load(&wg->pending) > 0) {
+            Task *task = ThreadPool_find_task(pool, w);
+            if (task) {
+                ThreadPool_run_task(pool, w, task);
+            } else {
+                sched_yield();
+            }
+        }
+    }
+    // Also taken after the loop above: the final WaitGroup_done still
+    // holds the mutex until it is finished with wg
+    Pthread_mutex_lock(&wg->mutex);
+    while (atomic_load(&wg->pending) > 0) {
+        Pthread_cond_wait(&wg->done, &wg->mutex);
+    }
+    Pthread_mutex_unlock(&wg->mutex);
+}
+
+typedef struct __ForChunk {
+    long begin;
+    long end;
+    void (*body)(long, void *);
+    void *arg;
+} ForChunk;
+
+void ThreadPool_for_chunk(void *arg) {
+    ForChunk *chunk = (ForChunk *)arg;
+    for (long i = chunk->begin; i < chunk->end; ++i) {
+        chunk->body(i, chunk->arg);
+    }
+}
+
+// Run body(i, arg) for every i in [begin, end), grain indices per task
+void ThreadPool_parallel_for(ThreadPool *pool, long begin, long end, long grain,
+    void (*body)(long, void *), void *arg) {
+    if (end <= begin) {
+        return;
+    }
+    if (grain <= 0) {
+        grain = 1;
+    }
+    long nchunks = (end - begin + grain - 1) / grain;
+    ForChunk *chunks = malloc(sizeof(ForChunk) * nchunks);
+    assert(chunks != NULL);
+
+    WaitGroup wg;
+    WaitGroup_init(&wg);
+    for (long c = 0; c < nchunks; ++c) {
+        chunks[c].begin = begin + c * grain;
+        chunks[c].end = chunks[c].begin + grain < end ? chunks[c].begin + grain : end;
+        chunks[c].body = body;
+        chunks[c].arg = arg;
+        ThreadPool_submit(pool, &wg, ThreadPool_for_chunk, &chunks[c]);
+    }
+    WaitGroup_wait(pool, &wg);
+    WaitGroup_destroy(&wg);
+    free(chunks);
+}
+
+void ThreadPool_print_stats(ThreadPool *pool) {
+    printf("worker %10s %10s %14s %12s\n", "tasks", "steals", "failed steals", "idle sleeps");
+    for (int i = 0; i < pool->num_workers; ++i) {
+        WorkerStats *s = &pool->workers[i].stats;
+        printf("%6d %10lu %10lu %14lu %12lu\n", i,
+            atomic_load(&s->tasks), atomic_load(&s->steals),
+            atomic_load(&s->failed_steals), atomic_load(&s->idle_sleeps));
+    }
+}
+
+// Finish every task, including any that running tasks still submit, then
+// stop and join the workers
+void ThreadPool_destroy(ThreadPool *pool) {
+    while (atomic_load(&pool->active) > 0) {
+        sched_yield();
+    }
+    Pthread_mutex_lock(&pool->mutex);
+    atomic_store(&pool->shutdown, 1);
+    Pthread_cond_broadcast(&pool->wakeup);
+    Pthread_mutex_unlock(&pool->mutex);
+    for (int i = 0; i < pool->num_workers; ++i) {
+        Pthread_join(pool->workers[i].thread, NULL);
+    }
+    free(pool->workers);
+}
+
+#endif // __thread_pool_h__